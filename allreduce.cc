@@ -0,0 +1,258 @@
+#include "segbin/allreduce.h"
+#include <stdexcept>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+
+namespace allreduce {
+
+    namespace {
+
+        struct header {
+            std::atomic<int> ready;
+            pid_t owner;
+
+            // ranks waiting at the barrier, and the number of times it
+            // has opened
+            std::atomic<int> arrived;
+            std::atomic<int> generation;
+
+            // set by a rank that timed out at the barrier
+            std::atomic<int> failed;
+        };
+
+        bool alive(pid_t pid)
+        {
+            return kill(pid, 0) == 0 || errno == EPERM;
+        }
+
+        // keep the slots aligned for doubles
+        unsigned long header_bytes()
+        {
+            return (sizeof(header) + 63) / 64 * 64;
+        }
+
+    }
+
+    shm_group::shm_group(std::string name, int rank, int size, unsigned long nelem,
+            double timeout)
+        : name(name), rank(rank), size(size), nelem(nelem), timeout(timeout), base(nullptr),
+          failed(false)
+    {
+        if (name.size() == 0 || name[0] != '/') {
+            this->name = "/" + name;
+        }
+
+        if (rank < 0 || rank >= size) {
+            throw std::logic_error("rank " + std::to_string(rank)
+                + " out of range for group of size " + std::to_string(size));
+        }
+
+        bytes = header_bytes() + (size + size * nelem) * sizeof(double);
+
+        if (rank == 0) {
+            // remove whatever a crashed run might have left behind
+            shm_unlink(this->name.c_str());
+
+            int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+            if (fd == -1) {
+                throw std::logic_error("unable to create " + this->name);
+            }
+
+            if (ftruncate(fd, bytes) == -1) {
+                close(fd);
+                throw std::logic_error("unable to resize " + this->name);
+            }
+
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (p == MAP_FAILED) {
+                throw std::logic_error("unable to map " + this->name);
+            }
+
+            base = static_cast<char*>(p);
+
+            header *h = reinterpret_cast<header*>(base);
+
+            h->arrived.store(0, std::memory_order_relaxed);
+            h->generation.store(0, std::memory_order_relaxed);
+            h->failed.store(0, std::memory_order_relaxed);
+            h->owner = getpid();
+            h->ready.store(1, std::memory_order_release);
+        } else {
+            auto deadline = std::chrono::steady_clock::now()
+                + std::chrono::duration<double>(timeout);
+
+            // wait for rank 0 to create and initialize the segment, and
+            // ignore segments whose creator is gone
+            while (base == nullptr) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    throw std::logic_error("timed out waiting for rank 0 to create "
+                        + this->name);
+                }
+
+                int fd = shm_open(this->name.c_str(), O_RDWR, 0600);
+
+                if (fd != -1) {
+                    struct stat st;
+
+                    if (fstat(fd, &st) == 0 && st.st_size == bytes) {
+                        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+                        if (p != MAP_FAILED) {
+                            header *h = static_cast<header*>(p);
+
+                            if (h->ready.load(std::memory_order_acquire) == 1 && alive(h->owner)) {
+                                base = static_cast<char*>(p);
+                            } else {
+                                munmap(p, bytes);
+                            }
+                        }
+                    }
+
+                    close(fd);
+                }
+
+                if (base == nullptr) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+        }
+
+        // make sure nobody leaves before everybody has joined
+        if (!barrier()) {
+            if (rank == 0) {
+                shm_unlink(this->name.c_str());
+            }
+
+            munmap(base, bytes);
+
+            throw std::logic_error("timed out waiting for the other ranks to join "
+                + this->name);
+        }
+    }
+
+    shm_group::~shm_group()
+    {
+        // the other ranks may have left already after a failure, so
+        // there is nobody to wait for
+        if (!failed) {
+            barrier();
+        }
+
+        if (rank == 0) {
+            shm_unlink(name.c_str());
+        }
+
+        munmap(base, bytes);
+    }
+
+    bool shm_group::barrier()
+    {
+        header *h = reinterpret_cast<header*>(base);
+
+        if (failed || h->failed.load(std::memory_order_acquire)) {
+            failed = true;
+            return false;
+        }
+
+        int generation = h->generation.load(std::memory_order_acquire);
+
+        // the last rank to arrive opens the barrier for everybody; a
+        // rank that timed out still counts as arrived, so check again
+        if (h->arrived.fetch_add(1, std::memory_order_acq_rel) == size - 1) {
+            h->arrived.store(0, std::memory_order_relaxed);
+            h->generation.fetch_add(1, std::memory_order_release);
+            failed = h->failed.load(std::memory_order_acquire);
+            return !failed;
+        }
+
+        auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::duration<double>(timeout);
+
+        for (long spin = 0; h->generation.load(std::memory_order_acquire) == generation; ++spin) {
+            if (h->failed.load(std::memory_order_acquire)) {
+                failed = true;
+                return false;
+            }
+
+            if (spin < 1000) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            if (std::chrono::steady_clock::now() > deadline) {
+                h->failed.store(1, std::memory_order_release);
+                failed = true;
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        failed = h->failed.load(std::memory_order_acquire);
+        return !failed;
+    }
+
+    double shm_group::sum(double *buf, unsigned long n, double weight)
+    {
+        if (n != nelem) {
+            throw std::logic_error("expecting " + std::to_string(nelem)
+                + " elements, but got " + std::to_string(n));
+        }
+
+        double *weights = reinterpret_cast<double*>(base + header_bytes());
+        double *slots = weights + size;
+
+        weights[rank] = weight;
+        std::memcpy(slots + rank * nelem, buf, nelem * sizeof(double));
+
+        if (!barrier()) {
+            throw std::logic_error("allreduce failed: a rank timed out"
+                " waiting for the others at " + name);
+        }
+
+        double total = 0;
+
+        std::fill(buf, buf + nelem, 0);
+
+        for (int r = 0; r < size; ++r) {
+            total += weights[r];
+
+            double const *s = slots + r * nelem;
+
+            for (unsigned long i = 0; i < nelem; ++i) {
+                buf[i] += s[i];
+            }
+        }
+
+        // nobody may overwrite its slot before everybody is done reading
+        if (!barrier()) {
+            throw std::logic_error("allreduce failed: a rank timed out"
+                " waiting for the others at " + name);
+        }
+
+        return total;
+    }
+
+    unsigned long size(std::shared_ptr<tensor_tree::vertex> param)
+    {
+        unsigned long result = 0;
+
+        for (auto& v: tensor_tree::leaves_pre_order(param)) {
+            result += tensor_tree::get_tensor(v).vec_size();
+        }
+
+        return result;
+    }
+
+}
@@ -0,0 +1,64 @@
+#ifndef ALLREDUCE_H
+#define ALLREDUCE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "nn/tensor-tree.h"
+
+namespace allreduce {
+
+    /*
+     * A group of processes on the same host that sum vectors of a
+     * fixed size through a POSIX shared-memory segment.  Rank 0
+     * creates the segment; the other ranks wait for it to appear.
+     *
+     * Every rank adds the slots up in rank order, so all ranks end
+     * up with bit-identical sums and their parameters stay in sync.
+     *
+     * Ranks meet at a barrier in the segment.  A rank that waits there,
+     * or for rank 0 to create the segment, for more than timeout
+     * seconds throws instead of hanging, e.g., when another rank died.
+     * A timeout marks the segment failed, and every later barrier on
+     * any rank fails right away instead of waiting for a rank that
+     * has left.
+     */
+    struct shm_group {
+
+        std::string name;
+        int rank;
+        int size;
+        unsigned long nelem;
+        double timeout;
+
+        shm_group(std::string name, int rank, int size, unsigned long nelem,
+            double timeout = 600);
+        ~shm_group();
+
+        shm_group(shm_group const&) = delete;
+        shm_group& operator=(shm_group const&) = delete;
+
+        /*
+         * Replaces the n values at buf with their sum over all ranks,
+         * and returns the sum of weight over all ranks.  Blocks until
+         * every rank has called it.  buf is usually the arena of a
+         * grad_tree::buffer, which has the same layout on every rank.
+         */
+        double sum(double *buf, unsigned long n, double weight);
+
+    private:
+        char *base;
+        unsigned long bytes;
+
+        // set once a barrier fails on this rank
+        bool failed;
+
+        // false on timeout, or when the segment has failed
+        bool barrier();
+    };
+
+    unsigned long size(std::shared_ptr<tensor_tree::vertex> param);
+
+}
+
+#endif
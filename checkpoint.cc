@@ -0,0 +1,178 @@
+#include "segbin/checkpoint.h"
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <stdexcept>
+
+namespace checkpoint {
+
+    state snapshot(std::shared_ptr<tensor_tree::vertex> param,
+        param_arena::optimizer const& opt)
+    {
+        state result;
+
+        result.epoch = 0;
+        result.nsample = 0;
+        result.param = tensor_tree::copy_tree(param);
+
+        std::ostringstream oss;
+        opt.save_opt_data(oss);
+        result.opt_data = oss.str();
+
+        return result;
+    }
+
+    std::string save_rng(std::default_random_engine const& gen)
+    {
+        std::ostringstream oss;
+        oss << gen;
+        return oss.str();
+    }
+
+    void load_rng(std::default_random_engine& gen, std::string const& s)
+    {
+        std::istringstream iss { s };
+
+        if (!(iss >> gen)) {
+            throw std::logic_error("bad random state in checkpoint");
+        }
+    }
+
+    /*
+     * checkpoint
+     * epoch nsample
+     * number of indices, indices
+     * number of random engines, one engine per line
+     * size of the optimizer data in bytes, the data
+     * parameters as written by save_tensor
+     */
+    void save(std::ostream& os, state const& s)
+    {
+        os << "checkpoint" << std::endl;
+        os << s.epoch << " " << s.nsample << std::endl;
+
+        os << s.indices.size();
+        for (auto& i: s.indices) {
+            os << " " << i;
+        }
+        os << "\n";
+
+        os << s.rng.size() << "\n";
+        for (auto& r: s.rng) {
+            os << r << "\n";
+        }
+
+        os << s.opt_data.size() << "\n";
+        os.write(s.opt_data.data(), s.opt_data.size());
+
+        tensor_tree::save_tensor(s.param, os);
+
+        os.flush();
+    }
+
+    state load(std::istream& is, std::shared_ptr<tensor_tree::vertex> param)
+    {
+        state result;
+
+        std::string magic;
+        std::getline(is, magic);
+
+        if (magic != "checkpoint") {
+            throw std::logic_error("not a checkpoint");
+        }
+
+        int nindex;
+
+        if (!(is >> result.epoch >> result.nsample >> nindex)) {
+            throw std::logic_error("truncated checkpoint");
+        }
+
+        result.indices.resize(nindex);
+        for (auto& i: result.indices) {
+            is >> i;
+        }
+
+        int nrng;
+        is >> nrng;
+        is.ignore();
+
+        result.rng.resize(nrng);
+        for (auto& r: result.rng) {
+            std::getline(is, r);
+        }
+
+        long size;
+        is >> size;
+        is.ignore();
+
+        result.opt_data.resize(size);
+        is.read(&result.opt_data[0], size);
+
+        if (!is) {
+            throw std::logic_error("truncated checkpoint");
+        }
+
+        param_arena::load_tensor(param, is);
+        result.param = param;
+
+        return result;
+    }
+
+    writer::writer(std::string filename)
+        : filename(filename), stop(false)
+    {
+        thread = std::thread { [this]() { loop(); } };
+    }
+
+    writer::~writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            stop = true;
+        }
+
+        cv.notify_all();
+        thread.join();
+    }
+
+    void writer::write(state s)
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            pending = std::make_shared<state>(std::move(s));
+        }
+
+        cv.notify_all();
+    }
+
+    void writer::loop()
+    {
+        while (1) {
+            std::shared_ptr<state> s;
+
+            {
+                std::unique_lock<std::mutex> lock { mutex };
+                cv.wait(lock, [&]() { return stop || pending != nullptr; });
+
+                if (pending == nullptr) {
+                    break;
+                }
+
+                s = pending;
+                pending = nullptr;
+            }
+
+            std::string tmp = filename + ".tmp";
+
+            std::ofstream ofs { tmp };
+            save(ofs, *s);
+            ofs.close();
+
+            if (!ofs || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+                std::cerr << "failed to write checkpoint " << filename << std::endl;
+            }
+        }
+    }
+
+}
@@ -0,0 +1,86 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "nn/tensor-tree.h"
+#include "segbin/param-arena.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <random>
+#include <istream>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace checkpoint {
+
+    /*
+     * Training state at a sample boundary, enough to continue a run
+     * as if it had never stopped.
+     *
+     * nsample is the number of samples (or steps) done in the epoch,
+     * and indices is the order of the samples in the epoch after
+     * shuffling.  rng holds the states of the random engines, written
+     * with operator<<.  param is a copy of the parameters that belongs
+     * to the checkpoint.  opt_data is the text of save_opt_data.
+     */
+    struct state {
+        int epoch;
+        int nsample;
+        std::vector<int> indices;
+        std::vector<std::string> rng;
+        std::shared_ptr<tensor_tree::vertex> param;
+        std::string opt_data;
+    };
+
+    // copies param and the data of opt into a state
+    state snapshot(std::shared_ptr<tensor_tree::vertex> param,
+        param_arena::optimizer const& opt);
+
+    std::string save_rng(std::default_random_engine const& gen);
+    void load_rng(std::default_random_engine& gen, std::string const& s);
+
+    void save(std::ostream& os, state const& s);
+
+    // loads the parameters into the leaves of param, which keep their
+    // place in the arena of the optimizer
+    state load(std::istream& is, std::shared_ptr<tensor_tree::vertex> param);
+
+    /*
+     * Writes checkpoints to filename from a background thread, so
+     * that training only pays for the snapshot.  Each checkpoint is
+     * written to filename.tmp and renamed, so filename always holds a
+     * complete one.
+     *
+     * A checkpoint handed over while the previous one is still being
+     * written replaces any checkpoint that is still waiting, so at most
+     * two snapshots are alive at a time.  The destructor writes the
+     * last waiting checkpoint before returning.
+     */
+    struct writer {
+
+        std::string filename;
+
+        writer(std::string filename);
+        ~writer();
+
+        writer(writer const&) = delete;
+        writer& operator=(writer const&) = delete;
+
+        void write(state s);
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::shared_ptr<state> pending;
+        bool stop;
+
+        std::thread thread;
+
+        void loop();
+    };
+
+}
+
+#endif
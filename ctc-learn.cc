@@ -8,10 +8,21 @@
 #include "seg/ctc.h"
 #include "nn/lstm-frame.h"
 #include <sstream>
+#include "segbin/frame.h"
+#include "segbin/prefetch.h"
+#include "segbin/allreduce.h"
+#include "segbin/grad-tree.h"
+#include "segbin/checkpoint.h"
+#include "segbin/telemetry.h"
+#include "segbin/stage-timer.h"
+
+struct sample : public frame::sample {
+    std::vector<std::string> label_seq;
+};
 
 struct learning_env {
 
-    batch::scp frame_scp;
+    frame::scp frame_scp;
     batch::scp label_scp;
 
     std::string output_param;
@@ -21,6 +32,8 @@ struct learning_env {
     std::shared_ptr<tensor_tree::vertex> param;
     std::shared_ptr<tensor_tree::vertex> opt_data;
 
+    grad_tree::buffer param_grad;
+
     int nepoch;
     double step_size;
     double dropout;
@@ -34,12 +47,46 @@ struct learning_env {
 
     std::vector<int> indices;
 
-    std::shared_ptr<tensor_tree::optimizer> opt;
+    std::shared_ptr<param_arena::optimizer> opt;
+
+    int rank;
+    int world_size;
+    std::shared_ptr<allreduce::shm_group> comm;
+    std::default_random_engine shuffle_gen;
+
+    int prefetch_depth;
+    int loader_threads;
+    std::vector<std::shared_ptr<frame::scp>> loader_frame_scp;
+    std::vector<std::shared_ptr<batch::scp>> loader_label_scp;
+
+    std::shared_ptr<checkpoint::writer> checkpoint_writer;
+    int checkpoint_every;
+    int start_epoch;
+    int start_sample;
+
+    // per-sample lines are printed only without --report-every
+    // and --report-seconds
+    std::shared_ptr<telemetry::recorder> stats;
+
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
 
     std::unordered_map<std::string, std::string> args;
 
     learning_env(std::unordered_map<std::string, std::string> args);
 
+    sample load_sample(frame::scp& f_src, batch::scp& l_src, int i);
+
+    std::shared_ptr<tensor_tree::vertex> make_param_grad();
+
+    std::shared_ptr<tensor_tree::vertex> compute_grad(sample& s, int nsample);
+
+    void update(grad_tree::buffer& grad, double scale = 1);
+
+    std::string checkpoint_file(std::string filename);
+    void save_checkpoint(int epoch, int nsample);
+    void resume(std::string filename);
+
     void run();
 
 };
@@ -61,6 +108,8 @@ int main(int argc, char *argv[])
             {"seed", "", false},
             {"subsampling", "", false},
             {"shuffle", "", false},
+            {"prefetch", "", false},
+            {"loader-threads", "", false},
             {"dyer-lstm", "", false},
             {"type", "ctc,ctc-1b,hmm1s,hmm2s", true},
             {"opt", "const-step,rmsprop,adagrad,adam", true},
@@ -71,7 +120,20 @@ int main(int argc, char *argv[])
             {"momentum", "", false},
             {"beta1", "", false},
             {"beta2", "", false},
-            {"random-state", "", false}
+            {"random-state", "", false},
+            {"rank", "", false},
+            {"world-size", "", false},
+            {"shm-name", "", false},
+            {"allreduce-timeout", "seconds to wait for the other ranks, default: 600", false},
+            {"checkpoint", "", false},
+            {"checkpoint-every", "", false},
+            {"resume", "", false},
+            {"report-every", "", false},
+            {"report-seconds", "", false},
+            {"report-file", "", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -112,6 +174,8 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
     tensor_tree::load_tensor(param, param_ifs);
     param_ifs.close();
 
+    param_grad = grad_tree::buffer { make_param_grad(), param };
+
     step_size = std::stod(args.at("step-size"));
 
     dropout = 0;
@@ -151,205 +215,536 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
         indices[i] = i;
     }
 
-    if (args.at("opt") == "const-step") {
-        opt = std::make_shared<tensor_tree::const_step_opt>(
-            tensor_tree::const_step_opt{param, step_size});
-    } else if (args.at("opt") == "const-step-momentum") {
-        double momentum = std::stod(args.at("momentum"));
-        opt = std::make_shared<tensor_tree::const_step_momentum_opt>(
-            tensor_tree::const_step_momentum_opt{param, step_size, momentum});
-    } else if (args.at("opt") == "adagrad") {
-        opt = std::make_shared<tensor_tree::adagrad_opt>(
-            tensor_tree::adagrad_opt{param, step_size});
+    rank = 0;
+    if (ebt::in(std::string("rank"), args)) {
+        rank = std::stoi(args.at("rank"));
+    }
+
+    world_size = 1;
+    if (ebt::in(std::string("world-size"), args)) {
+        world_size = std::stoi(args.at("world-size"));
+    }
+
+    // all ranks have to shuffle identically, while dropout
+    // should differ from rank to rank
+    shuffle_gen = gen;
+
+    if (world_size > 1) {
+        // derived from the shared state rather than from --seed, so
+        // that --random-state still determines the run
+        std::seed_seq seq { (unsigned int) gen(), (unsigned int) rank };
+        gen.seed(seq);
+
+        std::string shm_name = "/ctc-learn";
+        if (ebt::in(std::string("shm-name"), args)) {
+            shm_name = args.at("shm-name");
+        }
+
+        double timeout = 600;
+        if (ebt::in(std::string("allreduce-timeout"), args)) {
+            timeout = std::stod(args.at("allreduce-timeout"));
+        }
+
+        comm = std::make_shared<allreduce::shm_group>(shm_name,
+            rank, world_size, allreduce::size(param), timeout);
+    }
+
+    prefetch_depth = 0;
+    if (ebt::in(std::string("prefetch"), args)) {
+        prefetch_depth = std::stoi(args.at("prefetch"));
+    }
+
+    loader_threads = 1;
+    if (ebt::in(std::string("loader-threads"), args)) {
+        loader_threads = std::stoi(args.at("loader-threads"));
+    }
+
+    if (prefetch_depth > 0) {
+        for (int i = 0; i < loader_threads; ++i) {
+            loader_frame_scp.push_back(std::make_shared<frame::scp>());
+            loader_frame_scp.back()->open(args.at("frame-scp"));
+
+            loader_label_scp.push_back(std::make_shared<batch::scp>());
+            loader_label_scp.back()->open(args.at("label-scp"));
+        }
+    }
+
+    opt = std::make_shared<param_arena::optimizer>(param, args.at("opt"), step_size);
+
+    if (args.at("opt") == "const-step-momentum") {
+        opt->momentum = std::stod(args.at("momentum"));
     } else if (args.at("opt") == "rmsprop") {
-        double decay = std::stod(args.at("decay"));
-        opt = std::make_shared<tensor_tree::rmsprop_opt>(
-            tensor_tree::rmsprop_opt{param, step_size, decay});
+        opt->decay = std::stod(args.at("decay"));
     } else if (args.at("opt") == "adam") {
-        double beta1 = std::stod(args.at("beta1"));
-        double beta2 = std::stod(args.at("beta2"));
-        opt = std::make_shared<tensor_tree::adam_opt>(
-            tensor_tree::adam_opt{param, step_size, beta1, beta2});
+        opt->beta1 = std::stod(args.at("beta1"));
+        opt->beta2 = std::stod(args.at("beta2"));
     }
 
     std::ifstream opt_data_ifs { args.at("opt-data") };
     opt->load_opt_data(opt_data_ifs);
     opt_data_ifs.close();
+
+    checkpoint_every = 0;
+    if (ebt::in(std::string("checkpoint-every"), args)) {
+        checkpoint_every = std::stoi(args.at("checkpoint-every"));
+    }
+
+    if (ebt::in(std::string("checkpoint"), args)) {
+        checkpoint_writer = std::make_shared<checkpoint::writer>(
+            checkpoint_file(args.at("checkpoint")));
+    }
+
+    start_epoch = 0;
+    start_sample = 0;
+
+    if (ebt::in(std::string("resume"), args)) {
+        resume(checkpoint_file(args.at("resume")));
+    }
+
+    if (ebt::in(std::string("report-every"), args) || ebt::in(std::string("report-seconds"), args)) {
+        int report_every = 0;
+        if (ebt::in(std::string("report-every"), args)) {
+            report_every = std::stoi(args.at("report-every"));
+        }
+
+        double report_seconds = 0;
+        if (ebt::in(std::string("report-seconds"), args)) {
+            report_seconds = std::stod(args.at("report-seconds"));
+        }
+
+        std::string report_file;
+        if (ebt::in(std::string("report-file"), args)) {
+            report_file = checkpoint_file(args.at("report-file"));
+        }
+
+        stats = std::make_shared<telemetry::recorder>(report_file,
+            report_every, report_seconds);
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(
+            checkpoint_file(args.at("trace")), rank);
+    }
 }
 
-void learning_env::run()
+/*
+ * Every rank keeps its own checkpoint, since the dropout generators
+ * differ from rank to rank.  All ranks checkpoint at the same step.
+ */
+std::string learning_env::checkpoint_file(std::string filename)
 {
-    ebt::Timer timer;
+    if (world_size > 1) {
+        return filename + "." + std::to_string(rank);
+    } else {
+        return filename;
+    }
+}
+
+void learning_env::save_checkpoint(int epoch, int nsample)
+{
+    checkpoint::state s = checkpoint::snapshot(param, *opt);
+
+    s.epoch = epoch;
+    s.nsample = nsample;
+    s.indices = indices;
+    s.rng.push_back(checkpoint::save_rng(gen));
+    s.rng.push_back(checkpoint::save_rng(shuffle_gen));
+
+    checkpoint_writer->write(std::move(s));
+}
 
-    for (int epoch = 0; epoch < nepoch; ++epoch) {
+void learning_env::resume(std::string filename)
+{
+    std::ifstream ifs { filename };
+    checkpoint::state s = checkpoint::load(ifs, param);
+
+    if (s.indices.size() != indices.size()) {
+        throw std::logic_error("checkpoint from a different data set");
+    }
+
+    if (s.rng.size() != 2) {
+        throw std::logic_error("checkpoint not written by ctc-learn");
+    }
 
-        if (ebt::in(std::string("shuffle"), args)) {
-            std::shuffle(indices.begin(), indices.end(), gen);
+    std::istringstream opt_data_iss { s.opt_data };
+    opt->load_opt_data(opt_data_iss);
+
+    start_epoch = s.epoch;
+    start_sample = s.nsample;
+    indices = s.indices;
+
+    checkpoint::load_rng(gen, s.rng[0]);
+    checkpoint::load_rng(shuffle_gen, s.rng[1]);
+
+    std::cout << "resuming at epoch " << start_epoch + 1
+        << " step " << start_sample << std::endl;
+}
+
+sample learning_env::load_sample(frame::scp& f_src, batch::scp& l_src, int i)
+{
+    sample result;
+
+    result.key = f_src.entries[i].key;
+
+    stage_timer::utterance utt { profile.get(), timeline.get() };
+    utt.set_key(result.key);
+    stage_timer::scope load_time { "load" };
+
+    result.frames = f_src.at(i, result.buf);
+    result.label_seq = speech::load_label_seq_batch(l_src.at(i));
+
+    utt.set_nframes(result.frames.nframes);
+
+    return result;
+}
+
+std::shared_ptr<tensor_tree::vertex> learning_env::make_param_grad()
+{
+    if (ebt::in(std::string("dyer-lstm"), args)) {
+        return lstm_frame::make_dyer_tensor_tree(layer);
+    } else {
+        return lstm_frame::make_tensor_tree(layer);
+    }
+}
+
+/*
+ * Forward and backward pass of one sample into param_grad.  Returns
+ * the tree of param_grad, or nullptr when the sample is skipped or
+ * has no positive loss.
+ */
+std::shared_ptr<tensor_tree::vertex> learning_env::compute_grad(sample& s, int nsample)
+{
+    frame::view& frames = s.frames;
+    std::vector<std::string>& label_seq = s.label_seq;
+
+    std::vector<int> label_id_seq;
+    for (auto& s: label_seq) {
+        label_id_seq.push_back(label_id.at(s));
+    }
+
+    if (stats == nullptr) {
+        std::cout << "sample: " << nsample << std::endl;
+        std::cout << "gold len: " << label_seq.size() << std::endl;
+    }
+
+    autodiff::computation_graph comp_graph;
+    std::shared_ptr<tensor_tree::vertex> var_tree
+        = tensor_tree::make_var_tree(comp_graph, param);
+
+    param_grad.bind(var_tree);
+
+    stage_timer::scope encoder_time { "encoder" };
+
+    std::shared_ptr<autodiff::op_t> input
+        = comp_graph.var(la::cpu::weak_tensor<double>(
+            frames.data, { frames.nframes, frames.ndim }));
+
+    input->grad_needed = false;
+
+    if (stats == nullptr) {
+        std::cout << "random: " << gen << std::endl;
+    }
+
+    std::shared_ptr<lstm::transcriber> trans;
+
+    if (ebt::in(std::string("subsampling"), args)) {
+        if (ebt::in(std::string("dyer-lstm"), args)) {
+            trans = lstm_frame::make_dyer_transcriber(param->children[0], dropout, &gen, true);
+        } else {
+            trans = lstm_frame::make_transcriber(param->children[0], dropout, &gen, true);
         }
+    } else {
+        if (ebt::in(std::string("dyer-lstm"), args)) {
+            trans = lstm_frame::make_dyer_transcriber(param->children[0], dropout, &gen, false);
+        } else {
+            trans = lstm_frame::make_transcriber(param->children[0], dropout, &gen, false);
+        }
+    }
 
-        int nsample = 0;
+    lstm::trans_seq_t input_seq;
+    input_seq.nframes = frames.nframes;
+    input_seq.batch_size = 1;
+    input_seq.dim = frames.ndim;
+    input_seq.feat = input;
+    input_seq.mask = nullptr;
 
-        while (nsample < indices.size()) {
+    lstm::trans_seq_t feat_seq = (*trans)(var_tree->children[0], input_seq);
+    lstm::fc_transcriber fc_trans { (int) label_id.size() };
+    lstm::logsoftmax_transcriber logsoftmax_trans;
+    auto score_seq = fc_trans(var_tree->children[1], feat_seq);
+    auto output_seq = logsoftmax_trans(nullptr, score_seq);
 
-            std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_scp.at(indices[nsample]));
-            std::vector<std::string> label_seq = speech::load_label_seq_batch(label_scp.at(indices[nsample]));
+    std::shared_ptr<autodiff::op_t> logprob = output_seq.feat;
 
-            std::vector<int> label_id_seq;
-            for (auto& s: label_seq) {
-                label_id_seq.push_back(label_id.at(s));
-            }
+    auto& logprob_t = autodiff::get_output<la::cpu::tensor_like<double>>(logprob);
 
-            std::cout << "sample: " << nsample + 1 << std::endl;
-            std::cout << "gold len: " << label_seq.size() << std::endl;
+    encoder_time.stop();
 
-            autodiff::computation_graph comp_graph;
-            std::shared_ptr<tensor_tree::vertex> var_tree
-                = tensor_tree::make_var_tree(comp_graph, param);
+    if (stats == nullptr) {
+        std::cout << "frames: " << frames.nframes << " downsampled: " << logprob_t.size(0) << std::endl;
+    } else {
+        stats->count("frames", frames.nframes);
+    }
 
-            std::vector<double> frame_cat;
-            frame_cat.reserve(frames.size() * frames.front().size());
+    if (logprob_t.size(0) < label_seq.size()) {
+        if (stats != nullptr) {
+            stats->count("too_short");
+        }
 
-            for (int i = 0; i < frames.size(); ++i) {
-                frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-            }
+        return nullptr;
+    }
 
-            unsigned int nframes = frames.size();
-            unsigned int ndim = frames.front().size();
+    stage_timer::scope graph_time { "make_graph" };
 
-            std::shared_ptr<autodiff::op_t> input
-                = comp_graph.var(la::cpu::weak_tensor<double>(
-                    frame_cat.data(), { nframes, ndim }));
+    ifst::fst graph_fst = ctc::make_frame_fst(logprob_t.size(0), label_id, id_label);
 
-            input->grad_needed = false;
+    auto& logprob_mat = logprob_t.as_matrix();
+    auto logprob_m = autodiff::weak_var(logprob, 0, std::vector<unsigned int> { logprob_mat.rows(), logprob_mat.cols() });
 
-            std::cout << "random: " << gen << std::endl;
+    seg::iseg_data graph_data;
+    graph_data.fst = std::make_shared<ifst::fst>(graph_fst);
+    graph_data.weight_func = std::make_shared<ctc::label_weight>(ctc::label_weight(logprob_m));
 
-            std::shared_ptr<lstm::transcriber> trans;
+    ifst::fst label_fst;
 
-            if (ebt::in(std::string("subsampling"), args)) {
-                if (ebt::in(std::string("dyer-lstm"), args)) {
-                    trans = lstm_frame::make_dyer_transcriber(param->children[0], dropout, &gen, true);
-                } else {
-                    trans = lstm_frame::make_transcriber(param->children[0], dropout, &gen, true);
-                }
-            } else {
-                if (ebt::in(std::string("dyer-lstm"), args)) {
-                    trans = lstm_frame::make_dyer_transcriber(param->children[0], dropout, &gen, false);
-                } else {
-                    trans = lstm_frame::make_transcriber(param->children[0], dropout, &gen, false);
-                }
-            }
+    if (args.at("type") == "ctc") {
+        label_fst = ctc::make_label_fst(label_id_seq, label_id, id_label);
+    } else if (args.at("type") == "ctc-1b") {
+        label_fst = ctc::make_label_fst_1b(label_id_seq, label_id, id_label);
+    } else if (args.at("type") == "hmm1s") {
+        label_fst = ctc::make_label_fst_hmm1s(label_id_seq, label_id, id_label);
+    } else if (args.at("type") == "hmm2s") {
+        label_fst = ctc::make_label_fst_hmm2s(label_id_seq, label_id, id_label);
+    } else {
+        std::cout << "unknown type " << args.at("type") << std::endl;
+        exit(1);
+    }
 
-            lstm::trans_seq_t input_seq;
-            input_seq.nframes = frames.size();
-            input_seq.batch_size = 1;
-            input_seq.dim = frames.front().size();
-            input_seq.feat = input;
-            input_seq.mask = nullptr;
+    ctc::loss_func loss {graph_data, label_fst};
 
-            lstm::trans_seq_t feat_seq = (*trans)(var_tree->children[0], input_seq);
-            lstm::fc_transcriber fc_trans { (int) label_id.size() };
-            lstm::logsoftmax_transcriber logsoftmax_trans;
-            auto score_seq = fc_trans(var_tree->children[1], feat_seq);
-            auto output_seq = logsoftmax_trans(nullptr, score_seq);
+    graph_time.stop();
 
-            std::shared_ptr<autodiff::op_t> logprob = output_seq.feat;
+    stage_timer::scope loss_time { "loss" };
+    double ell = loss.loss();
+    loss_time.stop();
 
-            auto& logprob_t = autodiff::get_output<la::cpu::tensor_like<double>>(logprob);
+    if (stats == nullptr) {
+        std::cout << "loss: " << ell << std::endl;
+        std::cout << "E: " << ell / label_seq.size() << std::endl;
 
-            std::cout << "frames: " << frames.size() << " downsampled: " << logprob_t.size(0) << std::endl;
+        if (ell < 0) {
+            std::cout << "loss is less than zero.  skipping." << std::endl;
+        }
+    } else {
+        stats->observe("loss", ell);
+        stats->observe("E", ell / label_seq.size());
 
-            if (logprob_t.size(0) < label_seq.size()) {
-                continue;
-            }
+        if (ell < 0) {
+            stats->count("negative_loss");
+        }
+    }
+
+    if (ell <= 0) {
+        return nullptr;
+    }
+
+    stage_timer::scope grad_time { "loss_grad" };
+    loss.grad();
+    graph_data.weight_func->grad();
+    grad_time.stop();
+
+    stage_timer::scope backward_time { "backward" };
+    auto topo_order = autodiff::natural_topo_order(comp_graph);
+    autodiff::guarded_grad(topo_order, autodiff::grad_funcs);
+    backward_time.stop();
+
+    if (stats == nullptr) {
+        auto vars = tensor_tree::leaves_pre_order(param_grad.tree);
+        std::cout << vars.back()->name << " "
+            << "analytic grad: " << tensor_tree::get_tensor(vars[0]).data()[0]
+            << std::endl;
+    }
+
+    return param_grad.tree;
+}
+
+/*
+ * Updates with scale times the gradient in grad.  The norm and the
+ * check for nan and inf take one pass over the buffer, clipping folds
+ * into scale, and the optimizer applies scale as it reads the arena.
+ * A gradient that is not finite is dropped rather than fed to the
+ * optimizer.
+ */
+void learning_env::update(grad_tree::buffer& grad, double scale)
+{
+    std::vector<std::shared_ptr<tensor_tree::vertex>> vars = tensor_tree::leaves_pre_order(param);
+
+    double v1 = tensor_tree::get_tensor(vars[0]).data()[0];
+
+    stage_timer::scope update_time { "update" };
 
-            ifst::fst graph_fst = ctc::make_frame_fst(logprob_t.size(0), label_id, id_label);
+    param_arena::grad_stats g = grad.stats();
 
-            auto& logprob_mat = logprob_t.as_matrix();
-            auto logprob_m = autodiff::weak_var(logprob, 0, std::vector<unsigned int> { logprob_mat.rows(), logprob_mat.cols() });
+    if (!g.finite) {
+        if (stats == nullptr) {
+            std::cout << "gradient has nan or inf.  skipping." << std::endl;
+        } else {
+            stats->count("nonfinite_grad");
+        }
+
+        return;
+    }
 
-            seg::iseg_data graph_data;
-            graph_data.fst = std::make_shared<ifst::fst>(graph_fst);
-            graph_data.weight_func = std::make_shared<ctc::label_weight>(ctc::label_weight(logprob_m));
+    if (ebt::in(std::string("clip"), args)) {
+        double n = scale * g.norm;
+
+        if (stats != nullptr) {
+            stats->observe("grad_norm", n);
+        }
 
-            ifst::fst label_fst;
+        if (n > clip) {
+            scale *= clip / n;
 
-            if (args.at("type") == "ctc") {
-                label_fst = ctc::make_label_fst(label_id_seq, label_id, id_label);
-            } else if (args.at("type") == "ctc-1b") {
-                label_fst = ctc::make_label_fst_1b(label_id_seq, label_id, id_label);
-            } else if (args.at("type") == "hmm1s") {
-                label_fst = ctc::make_label_fst_hmm1s(label_id_seq, label_id, id_label);
-            } else if (args.at("type") == "hmm2s") {
-                label_fst = ctc::make_label_fst_hmm2s(label_id_seq, label_id, id_label);
+            if (stats == nullptr) {
+                std::cout << "grad norm: " << n
+                    << " clip: " << clip << " gradient clipped" << std::endl;
             } else {
-                std::cout << "unknown type " << args.at("type") << std::endl;
-                exit(1);
+                stats->count("clipped");
             }
+        }
+    }
 
-            ctc::loss_func loss {graph_data, label_fst};
+    opt->update(grad.data(), grad.size(), scale);
 
-            double ell = loss.loss();
+    update_time.stop();
 
-            std::cout << "loss: " << ell << std::endl;
-            std::cout << "E: " << ell / label_seq.size() << std::endl;
+    double v2 = tensor_tree::get_tensor(vars[0]).data()[0];
 
-            std::shared_ptr<tensor_tree::vertex> param_grad;
+    if (stats == nullptr) {
+        std::cout << "weight: " << v1 << " update: " << v2 - v1
+            << " ratio: " << (v2 - v1) / v1 << std::endl;
+    } else {
+        stats->gauge("update_ratio", (v2 - v1) / v1);
+    }
+}
 
-            if (ebt::in(std::string("dyer-lstm"), args)) {
-                param_grad = lstm_frame::make_dyer_tensor_tree(layer);
+void learning_env::run()
+{
+    for (int epoch = start_epoch; epoch < nepoch; ++epoch) {
+
+        int nsample = 0;
+
+        // a resumed epoch keeps the order of the checkpoint
+        if (epoch == start_epoch && ebt::in(std::string("resume"), args)) {
+            nsample = start_sample;
+        } else if (ebt::in(std::string("shuffle"), args)) {
+            if (world_size > 1) {
+                std::shuffle(indices.begin(), indices.end(), shuffle_gen);
             } else {
-                param_grad = lstm_frame::make_tensor_tree(layer);
+                std::shuffle(indices.begin(), indices.end(), gen);
             }
+        }
 
-            if (ell > 0) {
-                loss.grad();
-                graph_data.weight_func->grad();
+        // every rank shuffles the same way and takes every
+        // world_size-th sample starting from its rank
+        std::vector<int> shard;
+        for (int i = rank; i < indices.size(); i += world_size) {
+            shard.push_back(indices[i]);
+        }
 
-                auto topo_order = autodiff::natural_topo_order(comp_graph);
-                autodiff::guarded_grad(topo_order, autodiff::grad_funcs);
-                tensor_tree::copy_grad(param_grad, var_tree);
+        int nstep = (indices.size() + world_size - 1) / world_size;
 
-                {
-                    auto vars = tensor_tree::leaves_pre_order(param_grad);
-                    std::cout << vars.back()->name << " "
-                        << "analytic grad: " << tensor_tree::get_tensor(vars[0]).data()[0]
-                        << std::endl;
+        int last_checkpoint = nsample;
+
+        std::vector<int> order {
+            shard.begin() + std::min<int>(nsample, shard.size()), shard.end() };
+
+        prefetch::loader<sample> loader { order, prefetch_depth,
+            prefetch_depth > 0 ? loader_threads : 0,
+            [&](int thread, int i) -> sample {
+                if (prefetch_depth > 0) {
+                    return load_sample(*loader_frame_scp[thread], *loader_label_scp[thread], i);
+                } else {
+                    return load_sample(frame_scp, label_scp, i);
                 }
+            }};
 
-                std::vector<std::shared_ptr<tensor_tree::vertex>> vars = tensor_tree::leaves_pre_order(param);
+        while (nsample < nstep) {
 
-                double v1 = tensor_tree::get_tensor(vars[0]).data()[0];
+            if (checkpoint_writer != nullptr && checkpoint_every > 0
+                    && nsample - last_checkpoint >= checkpoint_every) {
+                save_checkpoint(epoch, nsample);
+                last_checkpoint = nsample;
+            }
 
-                if (ebt::in(std::string("clip"), args)) {
-                    double n = tensor_tree::norm(param_grad);
+            std::shared_ptr<tensor_tree::vertex> grad;
 
-                    if (n > clip) {
-                        tensor_tree::axpy(param_grad, clip / n - 1, param_grad);
+            // a rank past the end of its shard still times the
+            // reduction, as an utterance of no frames
+            stage_timer::utterance utt { profile.get(), timeline.get() };
 
-                        std::cout << "grad norm: " << n
-                            << " clip: " << clip << " gradient clipped" << std::endl;
-                    }
-                }
+            if (nsample < shard.size()) {
+                sample s = loader.next();
+                utt.set_nframes(s.frames.nframes);
+                utt.set_key(s.key);
+                grad = compute_grad(s, nsample * world_size + rank + 1);
+            }
+
+            // the optimizer averages the sum of the ranks as it reads it
+            double scale = 1;
+
+            if (world_size > 1) {
+                stage_timer::scope allreduce_time { "allreduce" };
 
-                opt->update(param_grad);
+                // ranks without a gradient contribute zeros with weight 0,
+                // so that every rank takes part in every reduction
+                double weight = 0;
 
-                double v2 = tensor_tree::get_tensor(vars[0]).data()[0];
+                if (grad != nullptr) {
+                    weight = 1;
+                } else {
+                    param_grad.zero();
+                }
 
-                std::cout << "weight: " << v1 << " update: " << v2 - v1
-                    << " ratio: " << (v2 - v1) / v1 << std::endl;
+                // the leaves of param_grad are views into its arena,
+                // so the sum lands in the tree without a copy
+                double total = comm->sum(param_grad.data(), param_grad.size(), weight);
 
+                if (total > 0) {
+                    scale = 1.0 / total;
+                    grad = param_grad.tree;
+                } else {
+                    grad = nullptr;
+                }
             }
 
-            if (ell < 0) {
-                std::cout << "loss is less than zero.  skipping." << std::endl;
+            if (grad != nullptr) {
+                update(param_grad, scale);
             }
 
-            double n = tensor_tree::norm(param);
+            if (stats == nullptr) {
+                double n = tensor_tree::norm(param);
 
-            std::cout << "norm: " << n << std::endl;
+                std::cout << "norm: " << n << std::endl;
 
-            std::cout << std::endl;
+                std::cout << std::endl;
+            } else {
+                // a full pass over the model, only for reports
+                if (stats->due()) {
+                    stats->gauge("param_norm", tensor_tree::norm(param));
+                }
+
+                stats->step();
+            }
 
             ++nsample;
 
@@ -361,6 +756,28 @@ void learning_env::run()
 
         }
 
+        if (prefetch_depth > 0) {
+            std::cout << "prefetch stalls: " << loader.stalls
+                << " wait: " << loader.stall_time << std::endl;
+        }
+
+        // resuming from the end of an epoch shuffles for the next one
+        if (checkpoint_writer != nullptr) {
+            save_checkpoint(epoch, nsample);
+        }
+
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cout);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
+
+    if (rank != 0) {
+        return;
     }
 
     std::ofstream param_ofs { args.at("output-param") };
@@ -373,4 +790,3 @@ void learning_env::run()
     opt_data_ofs.close();
 
 }
-
@@ -7,10 +7,15 @@
 #include "seg/loss.h"
 #include "seg/ctc.h"
 #include "nn/lstm-frame.h"
+#include "segbin/frame.h"
+#include "segbin/minibatch.h"
+#include "segbin/param-file.h"
+#include "segbin/stage-timer.h"
+#include <sstream>
 
 struct prediction_env {
 
-    batch::scp frame_scp;
+    frame::scp frame_scp;
 
     int layer;
     std::shared_ptr<tensor_tree::vertex> param;
@@ -18,11 +23,24 @@ struct prediction_env {
     std::unordered_map<std::string, int> label_id;
     std::vector<std::string> id_label;
 
+    int batch_size;
+    int bucket_window;
+
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
+
     std::unordered_map<std::string, std::string> args;
 
     prediction_env(std::unordered_map<std::string, std::string> args);
 
+    std::shared_ptr<lstm::transcriber> make_transcriber();
+
+    void search(std::shared_ptr<autodiff::op_t> logprob_m,
+        unsigned int nframes, int nsample, std::ostream& out);
+
     void run();
+    void run_single();
+    void run_batch();
 
 };
 
@@ -41,6 +59,11 @@ int main(int argc, char *argv[])
             {"beam-search", "", false},
             {"beam-width", "", false},
             {"type", "ctc,hmm1s,hmm2s", true},
+            {"batch-size", "", false},
+            {"bucket-window", "", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -68,72 +91,260 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
 {
     frame_scp.open(args.at("frame-scp"));
 
-    std::ifstream param_ifs { args.at("param") };
+    param_file::reader param_src;
+    param_src.open(args.at("param"));
     std::string line;
-    std::getline(param_ifs, line);
+    std::getline(param_src.header(), line);
     layer = std::stoi(line);
     if (ebt::in(std::string("dyer-lstm"), args)) {
         param = lstm_frame::make_dyer_tensor_tree(layer);
     } else {
         param = lstm_frame::make_tensor_tree(layer);
     }
-    tensor_tree::load_tensor(param, param_ifs);
-    param_ifs.close();
+    param_src.load(param);
 
     id_label = util::load_label_set(args.at("label"));
     for (int i = 0; i < id_label.size(); ++i) {
         label_id[id_label[i]] = i;
     }
+
+    batch_size = 1;
+    if (ebt::in(std::string("batch-size"), args)) {
+        batch_size = std::stoi(args.at("batch-size"));
+    }
+
+    bucket_window = 16;
+    if (ebt::in(std::string("bucket-window"), args)) {
+        bucket_window = std::stoi(args.at("bucket-window"));
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(args.at("trace"));
+    }
 }
 
-void prediction_env::run()
+std::shared_ptr<lstm::transcriber> prediction_env::make_transcriber()
 {
-    ebt::Timer timer;
+    std::shared_ptr<lstm::transcriber> trans;
 
-    int nsample = 0;
+    if (ebt::in(std::string("subsampling"), args)) {
+        if (ebt::in(std::string("dyer-lstm"), args)) {
+            trans = lstm_frame::make_dyer_transcriber(param->children[0], 0.0, nullptr, true);
+        } else {
+            trans = lstm_frame::make_transcriber(param->children[0], 0.0, nullptr, true);
+        }
+    } else {
+        if (ebt::in(std::string("dyer-lstm"), args)) {
+            trans = lstm_frame::make_dyer_transcriber(param->children[0], 0.0, nullptr, false);
+        } else {
+            trans = lstm_frame::make_transcriber(param->children[0], 0.0, nullptr, false);
+        }
+    }
 
-    while (nsample < frame_scp.entries.size()) {
+    return trans;
+}
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_scp.at(nsample));
+void prediction_env::search(std::shared_ptr<autodiff::op_t> logprob_m,
+    unsigned int nframes, int nsample, std::ostream& out)
+{
+    stage_timer::scope graph_time { "make_graph" };
 
-        autodiff::computation_graph comp_graph;
-        std::shared_ptr<tensor_tree::vertex> var_tree
-            = tensor_tree::make_var_tree(comp_graph, param);
+    ifst::fst graph_fst = ctc::make_frame_fst(nframes, label_id, id_label);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
+    seg::iseg_data graph_data;
+    graph_data.fst = std::make_shared<ifst::fst>(graph_fst);
+    graph_data.weight_func = std::make_shared<ctc::label_weight>(
+        ctc::label_weight(logprob_m));
 
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
+    seg::seg_fst<seg::iseg_data> graph { graph_data };
 
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
+    graph_time.stop();
 
-        std::shared_ptr<autodiff::op_t> input
-            = comp_graph.var(la::cpu::weak_tensor<double>(
-                frame_cat.data(), { nframes, ndim }));
+    stage_timer::scope search_time { "search" };
+
+    if (ebt::in(std::string("beam-search"), args)) {
+        int beam_width = std::stoi(args.at("beam-width"));
 
-        std::shared_ptr<lstm::transcriber> trans;
+        ctc::beam_search<seg::seg_fst<seg::iseg_data>> beam_search;
 
-        if (ebt::in(std::string("subsampling"), args)) {
-            if (ebt::in(std::string("dyer-lstm"), args)) {
-                trans = lstm_frame::make_dyer_transcriber(param->children[0], 0.0, nullptr, true);
-            } else {
-                trans = lstm_frame::make_transcriber(param->children[0], 0.0, nullptr, true);
+        beam_search.search(graph, label_id.at("<blk>"), beam_width);
+
+        std::unordered_map<int, double> path_score;
+
+        if (args.at("type") == "ctc" && beam_search.heap.size() > 0) {
+            double inf = std::numeric_limits<double>::infinity();
+            double max = -inf;
+            int argmax = -1;
+
+            for (auto& k: beam_search.path_score) {
+                if (!ebt::in(k.first.second, path_score)) {
+                    path_score[k.first.second] = -inf;
+                }
+
+                path_score[k.first.second] = ebt::log_add(path_score[k.first.second], k.second);
             }
+
+            for (auto& k: path_score) {
+                if (k.second > max) {
+                    max = k.second;
+                    argmax = k.first;
+                }
+            }
+
+            for (auto& p: beam_search.id_seq[argmax]) {
+                out << id_label.at(p) << " ";
+            }
+            out << "(" << nsample << ".dot)" << std::endl;
         } else {
-            if (ebt::in(std::string("dyer-lstm"), args)) {
-                trans = lstm_frame::make_dyer_transcriber(param->children[0], 0.0, nullptr, false);
-            } else {
-                trans = lstm_frame::make_transcriber(param->children[0], 0.0, nullptr, false);
+            out << "(" << nsample << ".dot)" << std::endl;
+        }
+    } else if (args.at("type") == "ctc" && ebt::in(std::string("rmdup"), args)) {
+        fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+
+        for (auto& i: graph.initials()) {
+            one_best.extra[i] = {-1, 0};
+        }
+
+        auto topo_order = fst::topo_order(graph);
+
+        one_best.merge(graph, topo_order);
+
+        std::vector<int> path = one_best.best_path(graph);
+
+        int last = -1;
+        for (int i = 0; i < path.size(); ++i) {
+            int o_i = graph.output(path[i]);
+
+            if (last != o_i && o_i != label_id.at("<blk>")) {
+                out << id_label.at(o_i) << " ";
+                last = o_i;
+            } else if (i >= 1 && graph.output(path[i-1]) == label_id.at("<blk>")
+                    && o_i != label_id.at("<blk>")) {
+                out << id_label.at(o_i) << " ";
+                last = o_i;
             }
         }
+        out << "(" << nsample << ".dot)" << std::endl;
+    } else if (args.at("type") == "hmm1s" && ebt::in(std::string("rmdup"), args)) {
+        fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+
+        for (auto& i: graph.initials()) {
+            one_best.extra[i] = {-1, 0};
+        }
+
+        auto topo_order = fst::topo_order(graph);
+
+        one_best.merge(graph, topo_order);
+
+        std::vector<int> path = one_best.best_path(graph);
+
+        int last = -1;
+        for (int i = 0; i < path.size(); ++i) {
+            int o_i = graph.output(path[i]);
+
+            if (last != o_i) {
+                out << id_label.at(o_i) << " ";
+                last = o_i;
+            }
+        }
+        out << "(" << nsample << ".dot)" << std::endl;
+    } else if (args.at("type") == "hmm2s" && ebt::in(std::string("rmdup"), args)) {
+        fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+
+        for (auto& i: graph.initials()) {
+            one_best.extra[i] = {-1, 0};
+        }
+
+        auto topo_order = fst::topo_order(graph);
+
+        one_best.merge(graph, topo_order);
+
+        std::vector<int> path = one_best.best_path(graph);
+
+        for (int i = 0; i < path.size(); ++i) {
+            auto& o_i = graph.output(path[i]);
+
+            if (!ebt::endswith(id_label.at(o_i), "-")) {
+                out << id_label.at(o_i) << " ";
+            }
+        }
+        out << "(" << nsample << ".dot)" << std::endl;
+    } else {
+        fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+
+        for (auto& i: graph.initials()) {
+            one_best.extra[i] = {-1, 0};
+        }
+
+        auto topo_order = fst::topo_order(graph);
+
+        one_best.merge(graph, topo_order);
+
+        std::vector<int> path = one_best.best_path(graph);
+
+        for (auto& e: path) {
+            out << id_label.at(graph.output(e)) << " ";
+        }
+        out << "(" << nsample << ".dot)" << std::endl;
+    }
+}
+
+void prediction_env::run()
+{
+    if (batch_size > 1) {
+        run_batch();
+    } else {
+        run_single();
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cerr);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
+}
+
+void prediction_env::run_single()
+{
+    int nsample = 0;
+
+    while (nsample < frame_scp.entries.size()) {
+
+        stage_timer::utterance utt { profile.get(), timeline.get() };
+        utt.set_key(frame_scp.entries[nsample].key);
+
+        stage_timer::scope load_time { "load" };
+        frame::view frames = frame_scp.at(nsample);
+        utt.set_nframes(frames.nframes);
+        load_time.stop();
+
+        stage_timer::scope encoder_time { "encoder" };
+
+        autodiff::computation_graph comp_graph;
+        std::shared_ptr<tensor_tree::vertex> var_tree
+            = tensor_tree::make_var_tree(comp_graph, param);
+
+        std::shared_ptr<autodiff::op_t> input
+            = comp_graph.var(la::cpu::weak_tensor<double>(
+                frames.data, { frames.nframes, frames.ndim }));
+
+        std::shared_ptr<lstm::transcriber> trans = make_transcriber();
 
         lstm::trans_seq_t input_seq;
-        input_seq.nframes = frames.size();
+        input_seq.nframes = frames.nframes;
         input_seq.batch_size = 1;
-        input_seq.dim = frames.front().size();
+        input_seq.dim = frames.ndim;
         input_seq.feat = input;
         input_seq.mask = nullptr;
 
@@ -147,153 +358,135 @@ void prediction_env::run()
 
         auto& logprob_t = autodiff::get_output<la::cpu::tensor_like<double>>(logprob);
 
-        ifst::fst graph_fst = ctc::make_frame_fst(logprob_t.size(0), label_id, id_label);
-
         auto& logprob_mat = logprob_t.as_matrix();
         auto logprob_m = autodiff::weak_var(logprob, 0, std::vector<unsigned int> { logprob_mat.rows(), logprob_mat.cols() });
 
-        seg::iseg_data graph_data;
-        graph_data.fst = std::make_shared<ifst::fst>(graph_fst);
-        graph_data.weight_func = std::make_shared<ctc::label_weight>(
-            ctc::label_weight(logprob_m));
-
-        seg::seg_fst<seg::iseg_data> graph { graph_data };
+        encoder_time.stop();
 
-        if (ebt::in(std::string("beam-search"), args)) {
-            int beam_width = std::stoi(args.at("beam-width"));
+        std::ostringstream oss;
+        search(logprob_m, logprob_t.size(0), nsample, oss);
 
-            ctc::beam_search<seg::seg_fst<seg::iseg_data>> beam_search;
+        stage_timer::scope output_time { "output" };
+        std::cout << oss.str();
+        output_time.stop();
 
-            beam_search.search(graph, label_id.at("<blk>"), beam_width);
-
-            std::unordered_map<int, double> path_score;
+#if DEBUG_TOP
+        if (nsample == DEBUG_TOP) {
+            break;
+        }
+#endif
 
-            if (args.at("type") == "ctc" && beam_search.heap.size() > 0) {
-                double inf = std::numeric_limits<double>::infinity();
-                double max = -inf;
-                int argmax = -1;
+        ++nsample;
 
-                for (auto& k: beam_search.path_score) {
-                    if (!ebt::in(k.first.second, path_score)) {
-                        path_score[k.first.second] = -inf;
-                    }
+    }
 
-                    path_score[k.first.second] = ebt::log_add(path_score[k.first.second], k.second);
-                }
+}
 
-                for (auto& k: path_score) {
-                    if (k.second > max) {
-                        max = k.second;
-                        argmax = k.first;
-                    }
-                }
+/*
+ * Read batch_size * bucket_window utterances at a time, run the encoder
+ * on batches of utterances of similar length, and search each utterance
+ * on its own slice of the output.  Hypotheses are printed in the order
+ * of the frame scp.
+ */
+void prediction_env::run_batch()
+{
+    int window = batch_size * bucket_window;
+    unsigned int nlabel = label_id.size();
 
-                for (auto& p: beam_search.id_seq[argmax]) {
-                    std::cout << id_label.at(p) << " ";
-                }
-                std::cout << "(" << nsample << ".dot)" << std::endl;
-            } else {
-                std::cout << "(" << nsample << ".dot)" << std::endl;
-            }
-        } else if (args.at("type") == "ctc" && ebt::in(std::string("rmdup"), args)) {
-            fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+    std::vector<frame::mat> bufs;
+    bufs.resize(window);
 
-            for (auto& i: graph.initials()) {
-                one_best.extra[i] = {-1, 0};
-            }
+    for (int start = 0; start < frame_scp.entries.size(); start += window) {
+        int end = std::min<int>(start + window, frame_scp.entries.size());
 
-            auto topo_order = fst::topo_order(graph);
+        std::vector<frame::view> utts;
+        std::vector<unsigned int> lengths;
 
-            one_best.merge(graph, topo_order);
+        for (int i = start; i < end; ++i) {
+            stage_timer::utterance utt { profile.get(), timeline.get() };
+            utt.set_key(frame_scp.entries[i].key);
 
-            std::vector<int> path = one_best.best_path(graph);
+            stage_timer::scope load_time { "load" };
+            utts.push_back(frame_scp.at(i, bufs[i - start]));
+            lengths.push_back(utts.back().nframes);
+            utt.set_nframes(lengths.back());
+        }
 
-            int last = -1;
-            for (int i = 0; i < path.size(); ++i) {
-                int o_i = graph.output(path[i]);
+        std::vector<std::string> output;
+        output.resize(end - start);
 
-                if (last != o_i && o_i != label_id.at("<blk>")) {
-                    std::cout << id_label.at(o_i) << " ";
-                    last = o_i;
-                } else if (i >= 1 && graph.output(path[i-1]) == label_id.at("<blk>")
-                        && o_i != label_id.at("<blk>")) {
-                    std::cout << id_label.at(o_i) << " ";
-                    last = o_i;
-                }
+        for (auto& group: minibatch::bucket(lengths, batch_size)) {
+            std::vector<frame::view> group_utts;
+            for (auto& k: group) {
+                group_utts.push_back(utts[k]);
             }
-            std::cout << "(" << nsample << ".dot)" << std::endl;
-        } else if (args.at("type") == "hmm1s" && ebt::in(std::string("rmdup"), args)) {
-            fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
 
-            for (auto& i: graph.initials()) {
-                one_best.extra[i] = {-1, 0};
-            }
+            minibatch::padded_batch batch;
+            minibatch::pad(batch, group_utts);
 
-            auto topo_order = fst::topo_order(graph);
+            int total_frames = 0;
+            for (auto& n: batch.lengths) {
+                total_frames += n;
+            }
 
-            one_best.merge(graph, topo_order);
+            stage_timer::utterance batch_utt { profile.get(), timeline.get(), total_frames };
+            batch_utt.set_batch(group.size());
 
-            std::vector<int> path = one_best.best_path(graph);
+            stage_timer::scope encoder_time { "encoder" };
 
-            int last = -1;
-            for (int i = 0; i < path.size(); ++i) {
-                int o_i = graph.output(path[i]);
+            autodiff::computation_graph comp_graph;
+            std::shared_ptr<tensor_tree::vertex> var_tree
+                = tensor_tree::make_var_tree(comp_graph, param);
 
-                if (last != o_i) {
-                    std::cout << id_label.at(o_i) << " ";
-                    last = o_i;
-                }
-            }
-            std::cout << "(" << nsample << ".dot)" << std::endl;
-        } else if (args.at("type") == "hmm2s" && ebt::in(std::string("rmdup"), args)) {
-            fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+            lstm::trans_seq_t input_seq = minibatch::make_input_seq(comp_graph, batch);
 
-            for (auto& i: graph.initials()) {
-                one_best.extra[i] = {-1, 0};
-            }
+            std::shared_ptr<lstm::transcriber> trans = make_transcriber();
 
-            auto topo_order = fst::topo_order(graph);
+            lstm::trans_seq_t feat_seq = (*trans)(var_tree->children[0], input_seq);
+            lstm::fc_transcriber fc_trans { (int) nlabel };
+            lstm::logsoftmax_transcriber logsoftmax_trans;
+            auto score_seq = fc_trans(var_tree->children[1], feat_seq);
+            auto output_seq = logsoftmax_trans(nullptr, score_seq);
 
-            one_best.merge(graph, topo_order);
+            auto& logprob_t = autodiff::get_output<la::cpu::tensor_like<double>>(output_seq.feat);
 
-            std::vector<int> path = one_best.best_path(graph);
+            unsigned int out_nframes = logprob_t.size(0);
 
-            for (int i = 0; i < path.size(); ++i) {
-                auto& o_i = graph.output(path[i]);
+            encoder_time.stop();
 
-                if (!ebt::endswith(id_label.at(o_i), "-")) {
-                    std::cout << id_label.at(o_i) << " ";
-                }
-            }
-            std::cout << "(" << nsample << ".dot)" << std::endl;
-        } else {
-            fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+            std::vector<double> utt_logprob;
 
-            for (auto& i: graph.initials()) {
-                one_best.extra[i] = {-1, 0};
-            }
+            for (int b = 0; b < group.size(); ++b) {
+                unsigned int len = minibatch::output_length(batch.lengths[b],
+                    batch.nframes, out_nframes);
 
-            auto topo_order = fst::topo_order(graph);
+                minibatch::split(utt_logprob, logprob_t.data(), group.size(), nlabel, b, len);
 
-            one_best.merge(graph, topo_order);
+                auto logprob_m = comp_graph.var(la::cpu::weak_tensor<double>(
+                    utt_logprob.data(), { len, nlabel }));
 
-            std::vector<int> path = one_best.best_path(graph);
+                stage_timer::utterance utt { profile.get(), timeline.get(), (int) batch.lengths[b] };
+                utt.set_key(frame_scp.entries[start + group[b]].key);
 
-            for (auto& e: path) {
-                std::cout << id_label.at(graph.output(e)) << " ";
+                std::ostringstream oss;
+                search(logprob_m, len, start + group[b], oss);
+                output[group[b]] = oss.str();
             }
-            std::cout << "(" << nsample << ".dot)" << std::endl;
         }
 
-#if DEBUG_TOP
-        if (nsample == DEBUG_TOP) {
-            break;
+        int window_frames = 0;
+        for (auto& n: lengths) {
+            window_frames += n;
         }
-#endif
 
-        ++nsample;
+        stage_timer::utterance window_utt { profile.get(), timeline.get(), window_frames };
+        window_utt.set_batch(end - start);
 
-    }
+        stage_timer::scope output_time { "output" };
 
+        for (auto& s: output) {
+            std::cout << s;
+        }
+        std::cout << std::flush;
+    }
 }
-
@@ -70,8 +70,6 @@ forced_alignment_env::forced_alignment_env(std::unordered_map<std::string, std::
 
 void forced_alignment_env::run()
 {
-    ebt::Timer timer;
-
     int i = 0;
 
     while (1) {
@@ -0,0 +1,103 @@
+#include "util/speech.h"
+#include "util/batch.h"
+#include "ebt/ebt.h"
+#include "segbin/frame.h"
+#include <fstream>
+#include <iomanip>
+#include <limits>
+
+int main(int argc, char *argv[])
+{
+    ebt::ArgumentSpec spec {
+        "frame-archive",
+        "Convert frame batches to and from a binary frame archive",
+        {
+            {"frame-scp", "", false},
+            {"frame-batch", "", false},
+            {"archive", "", false},
+            {"output", "", true},
+        }
+    };
+
+    if (argc == 1) {
+        ebt::usage(spec);
+        exit(1);
+    }
+
+    auto args = ebt::parse_args(argc, argv, spec);
+
+    for (int i = 0; i < argc; ++i) {
+        std::cout << argv[i] << " ";
+    }
+    std::cout << std::endl;
+
+    if (ebt::in(std::string("archive"), args)) {
+        frame::archive ar;
+        ar.open(args.at("archive"));
+
+        std::ofstream ofs { args.at("output") };
+        ofs << std::setprecision(std::numeric_limits<double>::max_digits10);
+
+        for (int i = 0; i < ar.entries.size(); ++i) {
+            frame::view v = ar.at(i);
+
+            ofs << ar.entries[i].key << "\n";
+
+            for (int t = 0; t < v.nframes; ++t) {
+                double const *row = v.data + t * v.ndim;
+
+                for (int d = 0; d < v.ndim; ++d) {
+                    if (d != 0) {
+                        ofs << " ";
+                    }
+                    ofs << row[d];
+                }
+                ofs << "\n";
+            }
+
+            ofs << ".\n";
+        }
+
+        ofs.close();
+
+        std::cout << "utterances: " << ar.entries.size() << std::endl;
+
+        return 0;
+    }
+
+    frame::archive_writer writer;
+    writer.open(args.at("output"));
+
+    frame::mat m;
+
+    if (ebt::in(std::string("frame-scp"), args)) {
+        batch::scp frame_scp;
+        frame_scp.open(args.at("frame-scp"));
+
+        for (int i = 0; i < frame_scp.entries.size(); ++i) {
+            frame::load_frame_mat(m, frame_scp.at(i));
+            writer.write(frame_scp.entries[i].key, m.data.data(), m.nframes, m.ndim);
+        }
+    } else if (ebt::in(std::string("frame-batch"), args)) {
+        std::ifstream frame_batch { args.at("frame-batch") };
+
+        while (1) {
+            frame::load_frame_mat(m, frame_batch);
+
+            if (!frame_batch) {
+                break;
+            }
+
+            writer.write(m.key, m.data.data(), m.nframes, m.ndim);
+        }
+    } else {
+        std::cerr << "either --frame-scp or --frame-batch is required" << std::endl;
+        exit(1);
+    }
+
+    std::cout << "utterances: " << writer.entries.size() << std::endl;
+
+    writer.close();
+
+    return 0;
+}
@@ -0,0 +1,306 @@
+#include "segbin/frame.h"
+#include <string>
+#include <cstdlib>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace frame {
+
+    void load_frame_mat(mat& m, std::istream& is)
+    {
+        m.data.clear();
+        m.nframes = 0;
+        m.ndim = 0;
+
+        std::string line;
+
+        std::getline(is, line);
+        m.key = line;
+
+        while (std::getline(is, line) && line != ".") {
+            char const *p = line.c_str();
+            char *end;
+
+            unsigned int dim = 0;
+
+            while (1) {
+                double v = std::strtod(p, &end);
+
+                if (end == p) {
+                    break;
+                }
+
+                m.data.push_back(v);
+                p = end;
+                ++dim;
+            }
+
+            if (dim == 0) {
+                continue;
+            }
+
+            if (m.nframes == 0) {
+                m.ndim = dim;
+            } else if (dim != m.ndim) {
+                throw std::logic_error("frame " + std::to_string(m.nframes)
+                    + " has dimension " + std::to_string(dim)
+                    + ", expecting " + std::to_string(m.ndim));
+            }
+
+            ++m.nframes;
+        }
+    }
+
+    mat load_frame_mat(std::istream& is)
+    {
+        mat result;
+        load_frame_mat(result, is);
+        return result;
+    }
+
+    view make_view(mat& m)
+    {
+        return view { m.data.data(), m.nframes, m.ndim };
+    }
+
+    namespace {
+
+        char const archive_magic[8] = { 's', 'e', 'g', 'f', 'r', 'm', '0', '1' };
+
+        template <class T>
+        T read_value(char const *p)
+        {
+            T v;
+            std::memcpy(&v, p, sizeof(T));
+            return v;
+        }
+
+        template <class T>
+        void write_value(std::ostream& os, T v)
+        {
+            os.write(reinterpret_cast<char const*>(&v), sizeof(T));
+        }
+
+    }
+
+    archive::archive()
+        : base(nullptr), size(0)
+    {}
+
+    archive::~archive()
+    {
+        if (base != nullptr) {
+            munmap(base, size);
+        }
+    }
+
+    void archive::open(std::string filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+
+        if (fd == -1) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            throw std::logic_error("unable to stat " + filename);
+        }
+
+        size = st.st_size;
+
+        if (size < sizeof(archive_magic) + sizeof(uint64_t)) {
+            ::close(fd);
+            throw std::logic_error(filename + " is not a frame archive");
+        }
+
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED) {
+            throw std::logic_error("unable to map " + filename);
+        }
+
+        base = static_cast<char*>(p);
+
+        if (std::memcmp(base, archive_magic, sizeof(archive_magic)) != 0) {
+            throw std::logic_error(filename + " is not a frame archive");
+        }
+
+        // everything read from the file is checked against its size,
+        // so that a truncated or corrupt archive fails here instead of
+        // reading past the mapping later
+        auto need = [&](char const *q, uint64_t n) {
+            if (n > size - (q - base)) {
+                throw std::logic_error(filename + " is truncated or corrupt");
+            }
+        };
+
+        uint64_t index_offset = read_value<uint64_t>(base + sizeof(archive_magic));
+
+        if (index_offset < sizeof(archive_magic) + sizeof(uint64_t) || index_offset > size) {
+            throw std::logic_error(filename + " is truncated or corrupt");
+        }
+
+        char const *q = base + index_offset;
+
+        need(q, sizeof(uint64_t));
+        uint64_t nentries = read_value<uint64_t>(q);
+        q += sizeof(uint64_t);
+
+        // an entry takes at least 20 bytes
+        if (nentries > (size - (q - base)) / 20) {
+            throw std::logic_error(filename + " is truncated or corrupt");
+        }
+
+        entries.resize(nentries);
+
+        for (auto& e: entries) {
+            need(q, sizeof(uint32_t));
+            uint32_t len = read_value<uint32_t>(q);
+            q += sizeof(uint32_t);
+            need(q, len);
+            e.key = std::string(q, len);
+            q += len;
+            need(q, sizeof(uint64_t) + 2 * sizeof(uint32_t));
+            e.offset = read_value<uint64_t>(q);
+            q += sizeof(uint64_t);
+            e.nframes = read_value<uint32_t>(q);
+            q += sizeof(uint32_t);
+            e.ndim = read_value<uint32_t>(q);
+            q += sizeof(uint32_t);
+
+            uint64_t bytes = (uint64_t) e.nframes * e.ndim * sizeof(double);
+
+            if (e.offset % sizeof(double) != 0 || e.offset > index_offset
+                    || bytes > index_offset - e.offset) {
+                throw std::logic_error(filename + ": bad offset for " + e.key);
+            }
+        }
+    }
+
+    view archive::at(int i) const
+    {
+        archive_entry const& e = entries.at(i);
+
+        return view { reinterpret_cast<double*>(base + e.offset), e.nframes, e.ndim };
+    }
+
+    void archive_writer::open(std::string filename)
+    {
+        ofs.open(filename, std::ios::binary);
+
+        if (!ofs) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        ofs.write(archive_magic, sizeof(archive_magic));
+
+        // placeholder for the index offset
+        write_value<uint64_t>(ofs, 0);
+
+        offset = sizeof(archive_magic) + sizeof(uint64_t);
+    }
+
+    void archive_writer::write(std::string const& key, double const *data,
+        unsigned int nframes, unsigned int ndim)
+    {
+        entries.push_back(archive_entry { key, offset, nframes, ndim });
+
+        unsigned long bytes = (unsigned long) nframes * ndim * sizeof(double);
+        ofs.write(reinterpret_cast<char const*>(data), bytes);
+        offset += bytes;
+    }
+
+    void archive_writer::close()
+    {
+        unsigned long index_offset = offset;
+
+        write_value<uint64_t>(ofs, entries.size());
+
+        for (auto& e: entries) {
+            write_value<uint32_t>(ofs, e.key.size());
+            ofs.write(e.key.data(), e.key.size());
+            write_value<uint64_t>(ofs, e.offset);
+            write_value<uint32_t>(ofs, e.nframes);
+            write_value<uint32_t>(ofs, e.ndim);
+        }
+
+        ofs.seekp(sizeof(archive_magic));
+        write_value<uint64_t>(ofs, index_offset);
+
+        ofs.close();
+
+        if (!ofs) {
+            throw std::logic_error("unable to write frame archive");
+        }
+    }
+
+    bool is_archive(std::string const& filename)
+    {
+        std::ifstream ifs { filename, std::ios::binary };
+
+        char magic[sizeof(archive_magic)];
+        ifs.read(magic, sizeof(magic));
+
+        return ifs && std::memcmp(magic, archive_magic, sizeof(magic)) == 0;
+    }
+
+    void scp::open(std::string filename)
+    {
+        if (is_archive(filename)) {
+            bin = std::make_shared<archive>();
+            bin->open(filename);
+            entries = bin->entries;
+        } else {
+            text_scp = std::make_shared<batch::scp>();
+            text_scp->open(filename);
+
+            for (auto& e: text_scp->entries) {
+                entries.push_back(archive_entry { e.key, 0, 0, 0 });
+            }
+        }
+    }
+
+    void scp::open_batch(std::string filename)
+    {
+        if (is_archive(filename)) {
+            bin = std::make_shared<archive>();
+            bin->open(filename);
+            entries = bin->entries;
+        } else {
+            text_batch = std::make_shared<speech::batch_indices>();
+            text_batch->open(filename);
+
+            for (int i = 0; i < text_batch->pos.size(); ++i) {
+                entries.push_back(archive_entry { std::to_string(i), 0, 0, 0 });
+            }
+        }
+    }
+
+    view scp::at(int i)
+    {
+        return at(i, buf);
+    }
+
+    view scp::at(int i, mat& m)
+    {
+        if (bin != nullptr) {
+            return bin->at(i);
+        } else if (text_scp != nullptr) {
+            load_frame_mat(m, text_scp->at(i));
+        } else {
+            load_frame_mat(m, text_batch->at(i));
+        }
+
+        return make_view(m);
+    }
+
+}
@@ -0,0 +1,148 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <vector>
+#include <string>
+#include <istream>
+#include <fstream>
+#include <memory>
+#include "util/batch.h"
+#include "util/speech.h"
+
+namespace frame {
+
+    /*
+     * Frames of one utterance stored row-major in a single buffer, so that
+     * the buffer can be handed to la::cpu::weak_tensor without copying.
+     */
+    struct mat {
+        std::string key;
+        std::vector<double> data;
+        unsigned int nframes;
+        unsigned int ndim;
+    };
+
+    /*
+     * Read one frame batch (key line, one frame per line, terminated
+     * by ".") in the same format as speech::load_frame_batch.
+     * The buffer of m is reused across calls.
+     */
+    void load_frame_mat(mat& m, std::istream& is);
+
+    mat load_frame_mat(std::istream& is);
+
+    /*
+     * Non-owning row-major frames, either pointing into a mat or
+     * into a memory-mapped archive.
+     */
+    struct view {
+        double *data;
+        unsigned int nframes;
+        unsigned int ndim;
+    };
+
+    view make_view(mat& m);
+
+    struct archive_entry {
+        std::string key;
+        unsigned long offset;
+        unsigned int nframes;
+        unsigned int ndim;
+    };
+
+    /*
+     * Binary frame archive.
+     *
+     * header: magic (8 bytes), index offset (uint64)
+     * data:   nframes * ndim native doubles per utterance, 8-byte aligned
+     * index:  number of entries (uint64), and for each entry
+     *         key length (uint32), key, offset (uint64),
+     *         nframes (uint32), ndim (uint32)
+     *
+     * The whole file is mapped, and at(i) points into the mapping.
+     * The mapping is private, so pages are shared between processes
+     * reading the same archive as long as nobody writes to them.
+     */
+    struct archive {
+        std::vector<archive_entry> entries;
+
+        char *base;
+        unsigned long size;
+
+        archive();
+        ~archive();
+
+        archive(archive const&) = delete;
+        archive& operator=(archive const&) = delete;
+
+        void open(std::string filename);
+
+        view at(int i) const;
+    };
+
+    struct archive_writer {
+        std::ofstream ofs;
+        std::vector<archive_entry> entries;
+        unsigned long offset;
+
+        void open(std::string filename);
+
+        void write(std::string const& key, double const *data,
+            unsigned int nframes, unsigned int ndim);
+
+        void close();
+    };
+
+    bool is_archive(std::string const& filename);
+
+    /*
+     * Frame source that reads either a binary archive or text frame
+     * batches, depending on the magic of the file.
+     *
+     * The view returned by at(i) stays valid until the next call to at()
+     * for text input, and for the lifetime of the scp for archives.
+     * at(i, m) parses text input into m instead, so the view stays valid
+     * as long as m does.
+     */
+    struct scp {
+        std::vector<archive_entry> entries;
+
+        std::shared_ptr<archive> bin;
+        std::shared_ptr<batch::scp> text_scp;
+        std::shared_ptr<speech::batch_indices> text_batch;
+
+        mat buf;
+
+        // archive or scp of frame batches
+        void open(std::string filename);
+
+        // archive or a single file of frame batches
+        void open_batch(std::string filename);
+
+        view at(int i);
+        view at(int i, mat& m);
+    };
+
+    /*
+     * Frames of one utterance together with the buffer they are parsed
+     * into by scp::at(i, buf), so that loader threads can hand them to
+     * the trainer.  Trainers derive from it to add the labels.
+     */
+    struct sample {
+        std::string key;
+        mat buf;
+        view frames;
+
+        sample() = default;
+
+        // frames points into buf, so copies would point into the original
+        sample(sample const&) = delete;
+        sample& operator=(sample const&) = delete;
+
+        sample(sample&&) = default;
+        sample& operator=(sample&&) = default;
+    };
+
+}
+
+#endif
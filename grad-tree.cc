@@ -0,0 +1,68 @@
+#include "segbin/grad-tree.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace grad_tree {
+
+    buffer::buffer()
+    {}
+
+    buffer::buffer(std::shared_ptr<tensor_tree::vertex> tree,
+            std::shared_ptr<tensor_tree::vertex> param)
+        : tree(tree)
+    {
+        tensor_tree::resize_as(tree, param);
+        leaves = tensor_tree::leaves_pre_order(tree);
+        mem = std::make_shared<param_arena::arena>(
+            std::vector<std::shared_ptr<tensor_tree::vertex>> { tree });
+    }
+
+    void buffer::zero()
+    {
+        std::fill(mem->data.begin(), mem->data.end(), 0);
+    }
+
+    void buffer::imul(double a)
+    {
+        param_arena::imul(mem->data.data(), mem->data.size(), a);
+    }
+
+    param_arena::grad_stats buffer::stats() const
+    {
+        return param_arena::stats(mem->data.data(), mem->data.size());
+    }
+
+    double* buffer::data()
+    {
+        return mem->begin();
+    }
+
+    long buffer::size() const
+    {
+        return mem->size();
+    }
+
+    void buffer::bind(std::shared_ptr<tensor_tree::vertex> var_tree)
+    {
+        std::vector<std::shared_ptr<tensor_tree::vertex>> vars
+            = tensor_tree::leaves_pre_order(var_tree);
+
+        if (vars.size() != leaves.size()) {
+            throw std::logic_error("gradient buffer and variables of different shapes");
+        }
+
+        zero();
+
+        for (int i = 0; i < vars.size(); ++i) {
+            auto& t = tensor_tree::get_tensor(leaves[i]);
+            auto op = tensor_tree::get_var(vars[i]);
+
+            if (autodiff::get_output<la::cpu::tensor_like<double>>(op).vec_size() != t.vec_size()) {
+                throw std::logic_error("gradient buffer and variables of different shapes");
+            }
+
+            op->grad = std::make_shared<la::cpu::weak_tensor<double>>(t.data(), t.sizes());
+        }
+    }
+
+}
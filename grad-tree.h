@@ -0,0 +1,57 @@
+#ifndef GRAD_TREE_H
+#define GRAD_TREE_H
+
+#include "nn/tensor-tree.h"
+#include "segbin/param-arena.h"
+#include <memory>
+#include <vector>
+
+namespace grad_tree {
+
+    /*
+     * Gradient of the parameters, allocated once with the shape of
+     * param and reused for every step instead of a fresh tree from
+     * make_tensor_tree and copy_grad per sample.
+     *
+     * bind(var_tree) zeroes the buffer and makes the gradients of the
+     * variables of var_tree point into it.  Backprop then accumulates
+     * straight into the buffer, and tree can go to the optimizer
+     * without a copy.  bind has to be called before anything is
+     * backpropagated into var_tree.  Variables that receive no
+     * gradient leave zeros behind.
+     *
+     * The leaves live in one param_arena::arena, so zeroing, scaling
+     * and stats() run over a single array.
+     *
+     * A buffer is owned by one thread at a time.
+     */
+    struct buffer {
+
+        std::shared_ptr<tensor_tree::vertex> tree;
+
+        buffer();
+
+        // tree has the layout of param, e.g., from make_tensor_tree
+        buffer(std::shared_ptr<tensor_tree::vertex> tree,
+            std::shared_ptr<tensor_tree::vertex> param);
+
+        void zero();
+
+        void bind(std::shared_ptr<tensor_tree::vertex> var_tree);
+
+        void imul(double a);
+
+        param_arena::grad_stats stats() const;
+
+        // the arena, for passes over all leaves such as an allreduce
+        double *data();
+        long size() const;
+
+    private:
+        std::vector<std::shared_ptr<tensor_tree::vertex>> leaves;
+        std::shared_ptr<param_arena::arena> mem;
+    };
+
+}
+
+#endif
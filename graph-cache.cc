@@ -0,0 +1,179 @@
+#include "segbin/graph-cache.h"
+#include "segbin/stage-timer.h"
+#include "fst/fst-algo.h"
+#include <stdexcept>
+#include <algorithm>
+
+namespace graph_cache {
+
+    lru::lru(std::unordered_map<std::string, int> const& label_id,
+            std::vector<std::string> const& id_label,
+            int min_seg, int max_seg, int stride, int capacity)
+        : capacity(capacity), hits(0), misses(0)
+        , label_id(label_id), id_label(id_label)
+        , min_seg(min_seg), max_seg(max_seg), stride(stride)
+    {}
+
+    entry lru::at(int nframes)
+    {
+        entry result;
+
+        {
+            std::lock_guard<std::mutex> guard { mutex };
+
+            auto g = graphs.find(nframes);
+
+            if (g != graphs.end()) {
+                recent.splice(recent.begin(), recent, g->second.second);
+                ++hits;
+
+                result.fst = g->second.first;
+                result.topo_order = orders.at(nframes);
+
+                return result;
+            }
+
+            ++misses;
+
+            auto o = orders.find(nframes);
+
+            if (o != orders.end()) {
+                result.topo_order = o->second;
+            }
+        }
+
+        // build outside of the lock; two threads missing on the same
+        // length at the same time simply build the graph twice
+
+        {
+            stage_timer::scope t { "make_graph" };
+            result.fst = seg::make_graph(nframes, label_id, id_label, min_seg, max_seg, stride);
+        }
+
+        if (result.topo_order == nullptr) {
+            stage_timer::scope t { "topo_order" };
+            result.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*result.fst));
+        }
+
+        if (capacity <= 0) {
+            return result;
+        }
+
+        std::lock_guard<std::mutex> guard { mutex };
+
+        orders.insert(std::make_pair(nframes, result.topo_order));
+
+        if (graphs.find(nframes) != graphs.end()) {
+            return result;
+        }
+
+        if (graphs.size() >= capacity) {
+            graphs.erase(recent.back());
+            recent.pop_back();
+        }
+
+        recent.push_front(nframes);
+        graphs[nframes] = std::make_pair(result.fst, recent.begin());
+
+        return result;
+    }
+
+    /*
+     * The file starts with a line of min_seg, max_seg, stride and the
+     * number of labels and a line of the labels in the order of their
+     * ids, followed by one line per length with the number of frames,
+     * the number of vertices, and the vertices in topological order.
+     */
+    void lru::load(std::istream& is)
+    {
+        int file_min_seg, file_max_seg, file_stride, nlabel;
+
+        if (!(is >> file_min_seg >> file_max_seg >> file_stride >> nlabel)) {
+            return;
+        }
+
+        if (file_min_seg != min_seg || file_max_seg != max_seg
+                || file_stride != stride || nlabel != id_label.size()) {
+            throw std::logic_error("graph cache built with different segment settings");
+        }
+
+        // the graphs number their edges by label id
+        for (int i = 0; i < nlabel; ++i) {
+            std::string label;
+
+            if (!(is >> label)) {
+                throw std::logic_error("truncated graph cache");
+            }
+
+            if (label != id_label[i]) {
+                throw std::logic_error("graph cache built with a different label set");
+            }
+        }
+
+        std::lock_guard<std::mutex> guard { mutex };
+
+        int nframes;
+        int size;
+
+        while (is >> nframes >> size) {
+            auto order = std::make_shared<std::vector<int>>(size);
+
+            for (int i = 0; i < size; ++i) {
+                is >> (*order)[i];
+            }
+
+            if (!is) {
+                throw std::logic_error("truncated graph cache");
+            }
+
+            orders[nframes] = order;
+        }
+    }
+
+    void lru::save(std::ostream& os)
+    {
+        std::lock_guard<std::mutex> guard { mutex };
+
+        os << min_seg << " " << max_seg << " " << stride
+            << " " << id_label.size() << std::endl;
+
+        for (int i = 0; i < id_label.size(); ++i) {
+            os << (i == 0 ? "" : " ") << id_label[i];
+        }
+        os << std::endl;
+
+        std::vector<int> lengths;
+        for (auto& p: orders) {
+            lengths.push_back(p.first);
+        }
+        std::sort(lengths.begin(), lengths.end());
+
+        for (auto& n: lengths) {
+            auto& order = *orders.at(n);
+
+            os << n << " " << order.size();
+            for (auto& v: order) {
+                os << " " << v;
+            }
+            os << "\n";
+        }
+
+        os.flush();
+    }
+
+    void lru::report(std::ostream& os)
+    {
+        std::lock_guard<std::mutex> guard { mutex };
+
+        int total = hits + misses;
+
+        os << "graph cache: " << hits << " hits, " << misses << " misses";
+
+        if (total > 0) {
+            os << ", hit rate " << double(hits) / total;
+        }
+
+        os << std::endl;
+    }
+
+}
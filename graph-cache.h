@@ -0,0 +1,74 @@
+#ifndef GRAPH_CACHE_H
+#define GRAPH_CACHE_H
+
+#include "seg/seg-util.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <istream>
+#include <ostream>
+
+namespace graph_cache {
+
+    struct entry {
+        std::shared_ptr<ifst::fst> fst;
+        std::shared_ptr<std::vector<int>> topo_order;
+    };
+
+    /*
+     * The segment graph only depends on the number of frames once the
+     * label set, min_seg, max_seg and stride are fixed.  This cache
+     * hands out shared graphs for lengths seen before, keeping at most
+     * capacity of them and dropping the least recently used one.
+     *
+     * Topological orders are small, one int per vertex, and are kept
+     * for every length.  They can be saved and loaded, so that later
+     * runs skip the sort even when the graph has to be rebuilt.  The
+     * file records the segment settings and the labels in order, and
+     * load() refuses a file made with different ones.
+     *
+     * The returned graphs are shared and must not be modified.
+     */
+    struct lru {
+
+        int capacity;
+
+        int hits;
+        int misses;
+
+        lru(std::unordered_map<std::string, int> const& label_id,
+            std::vector<std::string> const& id_label,
+            int min_seg, int max_seg, int stride, int capacity);
+
+        // thread-safe
+        entry at(int nframes);
+
+        void load(std::istream& is);
+        void save(std::ostream& os);
+
+        // prints the hits and misses
+        void report(std::ostream& os);
+
+    private:
+        std::unordered_map<std::string, int> label_id;
+        std::vector<std::string> id_label;
+        int min_seg;
+        int max_seg;
+        int stride;
+
+        std::mutex mutex;
+
+        // most recently used first
+        std::list<int> recent;
+        std::unordered_map<int, std::pair<std::shared_ptr<ifst::fst>,
+            std::list<int>::iterator>> graphs;
+
+        std::unordered_map<int, std::shared_ptr<std::vector<int>>> orders;
+    };
+
+}
+
+#endif
@@ -0,0 +1,614 @@
+#include "segbin/lat-archive.h"
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace lat_archive {
+
+    lattice make_lattice(std::string const& key, ifst::fst& f, int time_scale)
+    {
+        lattice result;
+
+        result.key = key;
+
+        for (int i = 0; i < f.vertices().size(); ++i) {
+            result.time.push_back(f.time(i) * time_scale);
+        }
+
+        for (int e = 0; e < f.edges().size(); ++e) {
+            result.tail.push_back(f.tail(e));
+            result.head.push_back(f.head(e));
+            result.label.push_back(f.output(e));
+            result.weight.push_back(f.weight(e));
+        }
+
+        return result;
+    }
+
+    ifst::fst make_fst(lattice const& lat, std::vector<std::string> const& symbols,
+        std::unordered_map<std::string, int> const& label_id)
+    {
+        std::vector<int> label_map;
+        for (auto& s: symbols) {
+            auto it = label_id.find(s);
+            label_map.push_back(it == label_id.end() ? -1 : it->second);
+        }
+
+        ifst::fst_data data;
+        data.symbol_id = std::make_shared<std::unordered_map<std::string, int>>(label_id);
+        data.id_symbol = std::make_shared<std::vector<std::string>>(label_id.size());
+        for (auto& p: label_id) {
+            (*data.id_symbol)[p.second] = p.first;
+        }
+
+        for (int v = 0; v < lat.time.size(); ++v) {
+            ifst::add_vertex(data, v, ifst::vertex_data { lat.time[v] });
+        }
+
+        std::vector<int> in_degree(lat.time.size());
+        std::vector<int> out_degree(lat.time.size());
+
+        for (int e = 0; e < lat.tail.size(); ++e) {
+            int label = label_map.at(lat.label[e]);
+
+            if (label == -1) {
+                throw std::logic_error("unknown label " + symbols[lat.label[e]]
+                    + " in lattice " + lat.key);
+            }
+
+            ifst::add_edge(data, e, ifst::edge_data { lat.tail[e], lat.head[e],
+                lat.weight[e], label, label });
+
+            ++out_degree[lat.tail[e]];
+            ++in_degree[lat.head[e]];
+        }
+
+        for (int v = 0; v < lat.time.size(); ++v) {
+            if (in_degree[v] == 0) {
+                data.initials.push_back(v);
+            }
+
+            if (out_degree[v] == 0) {
+                data.finals.push_back(v);
+            }
+        }
+
+        ifst::fst result;
+        result.data = std::make_shared<ifst::fst_data>(data);
+
+        return result;
+    }
+
+    void save_text(std::ostream& os, lattice const& lat,
+        std::vector<std::string> const& symbols)
+    {
+        std::string buf;
+        save_text(buf, lat, symbols);
+        os.write(buf.data(), buf.size());
+    }
+
+    void save_text(std::string& buf, lattice const& lat,
+        std::vector<std::string> const& symbols)
+    {
+        char num[32];
+
+        buf += lat.key;
+        buf += "\n";
+
+        for (int v = 0; v < lat.time.size(); ++v) {
+            std::snprintf(num, sizeof(num), "%d time=%d\n", v, lat.time[v]);
+            buf += num;
+        }
+
+        buf += "#\n";
+
+        for (int e = 0; e < lat.tail.size(); ++e) {
+            std::snprintf(num, sizeof(num), "%d %d label=", lat.tail[e], lat.head[e]);
+            buf += num;
+            buf += symbols.at(lat.label[e]);
+
+            // %g matches the default formatting of ostream
+            std::snprintf(num, sizeof(num), ";weight=%g\n", lat.weight[e]);
+            buf += num;
+        }
+
+        buf += ".\n";
+    }
+
+    namespace {
+
+        // value of the attribute name in a list of name=value pairs
+        // separated by ';'
+        std::string attribute(std::string const& attrs, std::string const& name)
+        {
+            std::string::size_type pos = 0;
+
+            while (pos < attrs.size()) {
+                std::string::size_type end = attrs.find(';', pos);
+                if (end == std::string::npos) {
+                    end = attrs.size();
+                }
+
+                std::string::size_type eq = attrs.find('=', pos);
+
+                if (eq < end && attrs.compare(pos, eq - pos, name) == 0) {
+                    return attrs.substr(eq + 1, end - eq - 1);
+                }
+
+                pos = end + 1;
+            }
+
+            throw std::logic_error("no " + name + " in " + attrs);
+        }
+
+    }
+
+    bool load_text(lattice& lat, std::istream& is,
+        std::unordered_map<std::string, int>& symbol_id,
+        std::vector<std::string>& symbols)
+    {
+        lat.time.clear();
+        lat.tail.clear();
+        lat.head.clear();
+        lat.label.clear();
+        lat.weight.clear();
+
+        if (!std::getline(is, lat.key)) {
+            return false;
+        }
+
+        std::string line;
+
+        while (std::getline(is, line) && line != "#") {
+            std::string::size_type pos = line.find("time=");
+
+            if (pos == std::string::npos) {
+                throw std::logic_error("no time in vertex " + line);
+            }
+
+            lat.time.push_back(std::atoi(line.c_str() + pos + 5));
+        }
+
+        while (std::getline(is, line) && line != ".") {
+            char const *p = line.c_str();
+            char *end;
+
+            int tail = std::strtol(p, &end, 10);
+            p = end;
+            int head = std::strtol(p, &end, 10);
+            p = end;
+
+            while (*p == ' ') {
+                ++p;
+            }
+
+            std::string attrs { p };
+            std::string label = attribute(attrs, "label");
+
+            auto it = symbol_id.find(label);
+
+            if (it == symbol_id.end()) {
+                it = symbol_id.insert(std::make_pair(label, (int) symbols.size())).first;
+                symbols.push_back(label);
+            }
+
+            lat.tail.push_back(tail);
+            lat.head.push_back(head);
+            lat.label.push_back(it->second);
+            lat.weight.push_back(std::stod(attribute(attrs, "weight")));
+        }
+
+        return true;
+    }
+
+    namespace {
+
+        char const archive_magic[8] = { 's', 'e', 'g', 'l', 'a', 't', '0', '1' };
+
+        template <class T>
+        T read_value(char const *p)
+        {
+            T v;
+            std::memcpy(&v, p, sizeof(T));
+            return v;
+        }
+
+        template <class T>
+        void write_value(std::ostream& os, T v)
+        {
+            os.write(reinterpret_cast<char const*>(&v), sizeof(T));
+        }
+
+        unsigned long align8(unsigned long offset)
+        {
+            return (offset + 7) / 8 * 8;
+        }
+
+        // reads a string that has to end by end
+        std::string read_string(char const *& p, char const *end)
+        {
+            if (end - p < sizeof(uint32_t)) {
+                throw std::logic_error("truncated lattice archive");
+            }
+
+            uint32_t len = read_value<uint32_t>(p);
+            p += sizeof(uint32_t);
+
+            if (end - p < len) {
+                throw std::logic_error("truncated lattice archive");
+            }
+
+            std::string result { p, len };
+            p += len;
+            return result;
+        }
+
+        void write_string(std::ostream& os, std::string const& s)
+        {
+            write_value<uint32_t>(os, s.size());
+            os.write(s.data(), s.size());
+        }
+
+    }
+
+    archive::archive()
+        : base(nullptr), size(0)
+    {}
+
+    archive::~archive()
+    {
+        if (base != nullptr) {
+            munmap(base, size);
+        }
+    }
+
+    void archive::open(std::string filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+
+        if (fd == -1) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            throw std::logic_error("unable to stat " + filename);
+        }
+
+        size = st.st_size;
+
+        if (size < sizeof(archive_magic) + sizeof(uint64_t)) {
+            ::close(fd);
+            throw std::logic_error(filename + " is not a lattice archive");
+        }
+
+        void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED) {
+            throw std::logic_error("unable to map " + filename);
+        }
+
+        base = static_cast<char*>(p);
+
+        if (std::memcmp(base, archive_magic, sizeof(archive_magic)) != 0) {
+            throw std::logic_error(filename + " is not a lattice archive");
+        }
+
+        // counts and offsets are checked against the size of the file,
+        // so that at() never reads past the mapping
+        char const *end = base + size;
+
+        auto need = [&](char const *q, uint64_t n) {
+            if (n > end - q) {
+                throw std::logic_error(filename + " is truncated or corrupt");
+            }
+        };
+
+        uint64_t index_offset = read_value<uint64_t>(base + sizeof(archive_magic));
+
+        if (index_offset < sizeof(archive_magic) + sizeof(uint64_t) || index_offset > size) {
+            throw std::logic_error(filename + " is truncated or corrupt");
+        }
+
+        char const *q = base + index_offset;
+
+        // a symbol takes at least 4 bytes and an entry at least 20
+        need(q, sizeof(uint64_t));
+        uint64_t nsymbols = read_value<uint64_t>(q);
+        q += sizeof(uint64_t);
+
+        if (nsymbols > (end - q) / sizeof(uint32_t)) {
+            throw std::logic_error(filename + " is truncated or corrupt");
+        }
+
+        symbols.resize(nsymbols);
+
+        for (auto& s: symbols) {
+            s = read_string(q, end);
+        }
+
+        need(q, sizeof(uint64_t));
+        uint64_t nentries = read_value<uint64_t>(q);
+        q += sizeof(uint64_t);
+
+        if (nentries > (end - q) / 20) {
+            throw std::logic_error(filename + " is truncated or corrupt");
+        }
+
+        entries.resize(nentries);
+
+        for (int i = 0; i < entries.size(); ++i) {
+            archive_entry& e = entries[i];
+
+            e.key = read_string(q, end);
+            need(q, sizeof(uint64_t) + 2 * sizeof(uint32_t));
+            e.offset = read_value<uint64_t>(q);
+            q += sizeof(uint64_t);
+            e.nvertices = read_value<uint32_t>(q);
+            q += sizeof(uint32_t);
+            e.nedges = read_value<uint32_t>(q);
+            q += sizeof(uint32_t);
+
+            uint64_t bytes = align8((e.nvertices + 3 * (uint64_t) e.nedges) * sizeof(int32_t))
+                + (uint64_t) e.nedges * sizeof(double);
+
+            if (e.offset % 8 != 0 || e.offset > index_offset
+                    || bytes > index_offset - e.offset) {
+                throw std::logic_error(filename + ": bad offset for " + e.key);
+            }
+
+            key_index[e.key] = i;
+        }
+    }
+
+    void archive::at(int i, lattice& lat) const
+    {
+        archive_entry const& e = entries.at(i);
+
+        char const *p = base + e.offset;
+
+        lat.key = e.key;
+
+        int32_t const *ints = reinterpret_cast<int32_t const*>(p);
+
+        lat.time.assign(ints, ints + e.nvertices);
+        ints += e.nvertices;
+        lat.tail.assign(ints, ints + e.nedges);
+        ints += e.nedges;
+        lat.head.assign(ints, ints + e.nedges);
+        ints += e.nedges;
+        lat.label.assign(ints, ints + e.nedges);
+        ints += e.nedges;
+
+        double const *weights = reinterpret_cast<double const*>(
+            p + align8((e.nvertices + 3 * (unsigned long) e.nedges) * sizeof(int32_t)));
+
+        lat.weight.assign(weights, weights + e.nedges);
+    }
+
+    lattice archive::at(int i) const
+    {
+        lattice result;
+        at(i, result);
+        return result;
+    }
+
+    int archive::find(std::string const& key) const
+    {
+        auto it = key_index.find(key);
+
+        if (it == key_index.end()) {
+            return -1;
+        }
+
+        return it->second;
+    }
+
+    void archive_writer::open(std::string filename, std::vector<std::string> const& symbols)
+    {
+        this->symbols = symbols;
+
+        ofs.open(filename, std::ios::binary);
+
+        if (!ofs) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        ofs.write(archive_magic, sizeof(archive_magic));
+
+        // placeholder for the index offset
+        write_value<uint64_t>(ofs, 0);
+
+        offset = sizeof(archive_magic) + sizeof(uint64_t);
+    }
+
+    void archive_writer::write(lattice const& lat)
+    {
+        entries.push_back(archive_entry { lat.key, offset,
+            (unsigned int) lat.time.size(), (unsigned int) lat.tail.size() });
+
+        auto write_ints = [&](std::vector<int> const& v) {
+            for (auto& i: v) {
+                write_value<int32_t>(ofs, i);
+            }
+        };
+
+        write_ints(lat.time);
+        write_ints(lat.tail);
+        write_ints(lat.head);
+        write_ints(lat.label);
+
+        unsigned long bytes = (lat.time.size() + 3 * lat.tail.size()) * sizeof(int32_t);
+
+        for (; bytes < align8(bytes); ++bytes) {
+            ofs.put(0);
+        }
+
+        ofs.write(reinterpret_cast<char const*>(lat.weight.data()),
+            lat.weight.size() * sizeof(double));
+        bytes += lat.weight.size() * sizeof(double);
+
+        offset += bytes;
+    }
+
+    void archive_writer::close()
+    {
+        unsigned long index_offset = offset;
+
+        write_value<uint64_t>(ofs, symbols.size());
+
+        for (auto& s: symbols) {
+            write_string(ofs, s);
+        }
+
+        write_value<uint64_t>(ofs, entries.size());
+
+        for (auto& e: entries) {
+            write_string(ofs, e.key);
+            write_value<uint64_t>(ofs, e.offset);
+            write_value<uint32_t>(ofs, e.nvertices);
+            write_value<uint32_t>(ofs, e.nedges);
+        }
+
+        ofs.seekp(sizeof(archive_magic));
+        write_value<uint64_t>(ofs, index_offset);
+
+        ofs.close();
+
+        if (!ofs) {
+            throw std::logic_error("unable to write lattice archive");
+        }
+    }
+
+    bool is_archive(std::string const& filename)
+    {
+        std::ifstream ifs { filename, std::ios::binary };
+
+        char magic[sizeof(archive_magic)];
+        ifs.read(magic, sizeof(magic));
+
+        return ifs && std::memcmp(magic, archive_magic, sizeof(magic)) == 0;
+    }
+
+    void reader::open(std::string filename)
+    {
+        next = 0;
+
+        if (is_archive(filename)) {
+            bin = std::make_shared<archive>();
+            bin->open(filename);
+            symbols = bin->symbols;
+        } else {
+            text.open(filename);
+
+            if (!text) {
+                throw std::logic_error("unable to open " + filename);
+            }
+        }
+    }
+
+    bool reader::read(lattice& lat)
+    {
+        if (bin != nullptr) {
+            if (next == bin->entries.size()) {
+                return false;
+            }
+
+            bin->at(next, lat);
+            ++next;
+
+            return true;
+        } else {
+            return load_text(lat, text, symbol_id, symbols);
+        }
+    }
+
+    writer::writer(std::string filename, std::vector<std::string> const& symbols,
+        bool binary, long flush_bytes)
+        : symbols(symbols), next(0), closed(false)
+    {
+        if (binary) {
+            bin = std::make_shared<archive_writer>();
+            bin->open(filename, symbols);
+        } else {
+            // the buffer has to be set before the file is opened
+            file_buf.resize(flush_bytes);
+            ofs.rdbuf()->pubsetbuf(file_buf.data(), file_buf.size());
+            ofs.open(filename);
+
+            if (!ofs) {
+                throw std::logic_error("unable to open " + filename);
+            }
+
+            text = std::make_shared<reorder::buffer>(ofs, flush_bytes);
+        }
+    }
+
+    writer::~writer()
+    {
+        // errors can only be reported by calling close()
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    void writer::put(int k, lattice lat)
+    {
+        if (text != nullptr) {
+            std::string buf;
+            save_text(buf, lat, symbols);
+            text->put(k, std::move(buf));
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock { mutex };
+
+        if (k != next) {
+            held[k] = std::move(lat);
+            return;
+        }
+
+        bin->write(lat);
+        ++next;
+
+        auto it = held.find(next);
+
+        while (it != held.end()) {
+            bin->write(it->second);
+            held.erase(it);
+            ++next;
+            it = held.find(next);
+        }
+    }
+
+    void writer::close()
+    {
+        if (closed) {
+            return;
+        }
+
+        closed = true;
+
+        if (text != nullptr) {
+            text->flush();
+            ofs.close();
+
+            if (!ofs) {
+                throw std::logic_error("unable to write lattices");
+            }
+        } else {
+            bin->close();
+        }
+    }
+
+}
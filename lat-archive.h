@@ -0,0 +1,196 @@
+#ifndef LAT_ARCHIVE_H
+#define LAT_ARCHIVE_H
+
+#include "fst/ifst.h"
+#include "segbin/reorder.h"
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+
+namespace lat_archive {
+
+    /*
+     * A lattice as written by the prune tools, independent of the fst
+     * library.  Vertices are numbered 0 to time.size() - 1, and labels
+     * are indices into a symbol table kept next to the lattice, either
+     * the one of the archive or the one built while reading text.
+     */
+    struct lattice {
+        std::string key;
+        std::vector<int> time;
+        std::vector<int> tail;
+        std::vector<int> head;
+        std::vector<int> label;
+        std::vector<double> weight;
+    };
+
+    // lattice of f with the output labels of its edges and the times
+    // of its vertices multiplied by time_scale
+    lattice make_lattice(std::string const& key, ifst::fst& f, int time_scale);
+
+    /*
+     * Fills an fst with the lattice, mapping the symbols of the lattice
+     * to the ids of label_id.  Vertices without incoming edges are
+     * initial and vertices without outgoing edges are final.
+     */
+    ifst::fst make_fst(lattice const& lat, std::vector<std::string> const& symbols,
+        std::unordered_map<std::string, int> const& label_id);
+
+    /*
+     * Text format of the prune tools:
+     *
+     *   key
+     *   vertex time=t     (one line per vertex)
+     *   #
+     *   tail head label=l;weight=w     (one line per edge)
+     *   .
+     */
+    void save_text(std::ostream& os, lattice const& lat,
+        std::vector<std::string> const& symbols);
+
+    // appends the text of the lattice to buf
+    void save_text(std::string& buf, lattice const& lat,
+        std::vector<std::string> const& symbols);
+
+    /*
+     * Reads one lattice in the text format.  Labels not yet in
+     * symbol_id are appended to symbols.  Returns false at the end of
+     * the input.
+     */
+    bool load_text(lattice& lat, std::istream& is,
+        std::unordered_map<std::string, int>& symbol_id,
+        std::vector<std::string>& symbols);
+
+    struct archive_entry {
+        std::string key;
+        unsigned long offset;
+        unsigned int nvertices;
+        unsigned int nedges;
+    };
+
+    /*
+     * Binary lattice archive.
+     *
+     * header: magic (8 bytes), index offset (uint64)
+     * data:   per lattice, 8-byte aligned, times (int32 per vertex),
+     *         tails, heads and labels (int32 per edge), padding to
+     *         8 bytes, and weights (double per edge)
+     * index:  number of symbols (uint64), and for each symbol
+     *         length (uint32) and name, followed by the number of
+     *         entries (uint64), and for each entry key length (uint32),
+     *         key, offset (uint64), nvertices (uint32), nedges (uint32)
+     *
+     * The whole file is mapped read-only.  Lattices can be read in
+     * order with at(i) or by key with find().
+     */
+    struct archive {
+        std::vector<std::string> symbols;
+        std::vector<archive_entry> entries;
+        std::unordered_map<std::string, int> key_index;
+
+        char *base;
+        unsigned long size;
+
+        archive();
+        ~archive();
+
+        archive(archive const&) = delete;
+        archive& operator=(archive const&) = delete;
+
+        void open(std::string filename);
+
+        void at(int i, lattice& lat) const;
+        lattice at(int i) const;
+
+        // index of the lattice with the key, or -1
+        int find(std::string const& key) const;
+    };
+
+    /*
+     * Writes lattices with labels indexing symbols.  The symbols are
+     * written with the index by close(), so they can still be extended
+     * while writing.
+     */
+    struct archive_writer {
+        std::ofstream ofs;
+        std::vector<std::string> symbols;
+        std::vector<archive_entry> entries;
+        unsigned long offset;
+
+        void open(std::string filename, std::vector<std::string> const& symbols);
+
+        void write(lattice const& lat);
+
+        void close();
+    };
+
+    bool is_archive(std::string const& filename);
+
+    /*
+     * Lattice output shared by worker threads.  put(k, lat) can be
+     * called from any thread, and lattices are written in the order of
+     * k, starting from 0.
+     *
+     * Text is formatted by the calling thread outside of the lock and
+     * goes to the file in blocks of about flush_bytes, so the file is
+     * flushed at most once per lattice.  Archives take the lattices as
+     * they become due.  The destructor closes the writer if close() was
+     * not called, but only close() reports write errors.
+     */
+    struct writer {
+
+        writer(std::string filename, std::vector<std::string> const& symbols,
+            bool binary, long flush_bytes = 1 << 20);
+        ~writer();
+
+        writer(writer const&) = delete;
+        writer& operator=(writer const&) = delete;
+
+        // thread-safe
+        void put(int k, lattice lat);
+
+        void close();
+
+    private:
+        std::vector<std::string> symbols;
+
+        std::vector<char> file_buf;
+        std::ofstream ofs;
+        std::shared_ptr<reorder::buffer> text;
+
+        std::shared_ptr<archive_writer> bin;
+        std::mutex mutex;
+        int next;
+        std::unordered_map<int, lattice> held;
+
+        bool closed;
+    };
+
+    /*
+     * Lattice source that reads either an archive or text lattices in
+     * order, depending on the magic of the file.  symbols is the symbol
+     * table of the lattices read so far.
+     */
+    struct reader {
+        std::shared_ptr<archive> bin;
+        std::ifstream text;
+
+        std::vector<std::string> symbols;
+        std::unordered_map<std::string, int> symbol_id;
+
+        int next;
+
+        void open(std::string filename);
+
+        // false at the end of the input
+        bool read(lattice& lat);
+    };
+
+}
+
+#endif
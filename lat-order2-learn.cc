@@ -149,8 +149,6 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 
 void learning_env::run()
 {
-    ebt::Timer timer;
-
     int i = 0;
 
     while (1) {
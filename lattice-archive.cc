@@ -0,0 +1,90 @@
+#include "ebt/ebt.h"
+#include "segbin/lat-archive.h"
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+    ebt::ArgumentSpec spec {
+        "lattice-archive",
+        "Convert text lattices to and from a binary lattice archive",
+        {
+            {"lattice-batch", "", false},
+            {"archive", "", false},
+            {"key", "print only the lattice with the key", false},
+            {"output", "", true},
+        }
+    };
+
+    if (argc == 1) {
+        ebt::usage(spec);
+        exit(1);
+    }
+
+    auto args = ebt::parse_args(argc, argv, spec);
+
+    for (int i = 0; i < argc; ++i) {
+        std::cout << argv[i] << " ";
+    }
+    std::cout << std::endl;
+
+    if (ebt::in(std::string("archive"), args)) {
+        lat_archive::archive ar;
+        ar.open(args.at("archive"));
+
+        std::ofstream ofs { args.at("output") };
+
+        lat_archive::lattice lat;
+
+        if (ebt::in(std::string("key"), args)) {
+            int i = ar.find(args.at("key"));
+
+            if (i == -1) {
+                std::cerr << "no lattice with key " << args.at("key") << std::endl;
+                exit(1);
+            }
+
+            ar.at(i, lat);
+            lat_archive::save_text(ofs, lat, ar.symbols);
+        } else {
+            for (int i = 0; i < ar.entries.size(); ++i) {
+                ar.at(i, lat);
+                lat_archive::save_text(ofs, lat, ar.symbols);
+            }
+        }
+
+        ofs.close();
+
+        std::cout << "lattices: " << ar.entries.size() << std::endl;
+
+        return 0;
+    }
+
+    if (!ebt::in(std::string("lattice-batch"), args)) {
+        std::cerr << "either --lattice-batch or --archive is required" << std::endl;
+        exit(1);
+    }
+
+    std::ifstream lattice_batch { args.at("lattice-batch") };
+
+    std::unordered_map<std::string, int> symbol_id;
+    std::vector<std::string> symbols;
+
+    lat_archive::archive_writer writer;
+    writer.open(args.at("output"), symbols);
+
+    lat_archive::lattice lat;
+
+    while (lat_archive::load_text(lat, lattice_batch, symbol_id, symbols)) {
+        writer.write(lat);
+    }
+
+    // the symbol table goes into the index, so it can grow until close
+    writer.symbols = symbols;
+
+    std::cout << "lattices: " << writer.entries.size() << std::endl;
+
+    writer.close();
+
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include "seg/scrf_weight.h"
 #include "seg/util.h"
 #include "nn/lstm-tensor-tree.h"
+#include "segbin/param-arena.h"
 #include <fstream>
 
 struct learning_env {
@@ -157,8 +158,6 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 
 void learning_env::run()
 {
-    ebt::Timer timer;
-
     int i = 0;
 
     std::shared_ptr<tensor_tree::vertex> accu_param_grad
@@ -176,6 +175,48 @@ void learning_env::run()
         tensor_tree::resize_as(accu_pred_grad, l_args.pred_param);
     }
 
+    // parameters, accumulated gradients and optimizer state each in
+    // one buffer with the same layout, so that an update is a single
+    // pass over flat arrays
+    std::vector<std::shared_ptr<tensor_tree::vertex>> param_trees { l_args.param };
+    std::vector<std::shared_ptr<tensor_tree::vertex>> grad_trees { accu_param_grad };
+    std::vector<std::shared_ptr<tensor_tree::vertex>> opt_trees;
+    std::vector<std::shared_ptr<tensor_tree::vertex>> second_moment_trees;
+
+    if (ebt::in(std::string("adam-beta1"), l_args.args)) {
+        opt_trees.push_back(l_args.first_moment);
+        second_moment_trees.push_back(l_args.second_moment);
+    } else {
+        opt_trees.push_back(l_args.opt_data);
+    }
+
+    if (ebt::in(std::string("nn-param"), args)) {
+        param_trees.push_back(l_args.nn_param);
+        param_trees.push_back(l_args.pred_param);
+        grad_trees.push_back(accu_nn_param_grad);
+        grad_trees.push_back(accu_pred_grad);
+
+        if (ebt::in(std::string("adam-beta1"), l_args.args)) {
+            opt_trees.push_back(l_args.nn_first_moment);
+            opt_trees.push_back(l_args.pred_first_moment);
+            second_moment_trees.push_back(l_args.nn_second_moment);
+            second_moment_trees.push_back(l_args.pred_second_moment);
+        } else {
+            opt_trees.push_back(l_args.nn_opt_data);
+            opt_trees.push_back(l_args.pred_opt_data);
+        }
+    }
+
+    param_arena::arena param_mem { param_trees };
+    param_arena::arena grad_mem { grad_trees };
+    param_arena::arena opt_mem { opt_trees };
+    param_arena::arena second_moment_mem { second_moment_trees };
+
+    if (grad_mem.size() != param_mem.size() || opt_mem.size() != param_mem.size()
+            || (second_moment_trees.size() > 0 && second_moment_mem.size() != param_mem.size())) {
+        throw std::logic_error("parameters, gradients and optimizer data of different sizes");
+    }
+
     while (1) {
 
         fscrf::learning_sample s { l_args };
@@ -343,14 +384,24 @@ void learning_env::run()
 
             if ((i + 1) % mini_batch == 0) {
 
-                tensor_tree::imul(accu_param_grad, 1.0 / mini_batch);
-                if (ebt::in(std::string("nn-param"), args)) {
-                    tensor_tree::imul(accu_nn_param_grad, 1.0 / mini_batch);
-                    tensor_tree::imul(accu_pred_grad, 1.0 / mini_batch);
-                }
+                param_arena::grad_stats grad = param_arena::stats(grad_mem.begin(), grad_mem.size());
+
+                // nothing has been updated yet, so what is saved here is
+                // the state that produced the nan, without a backup copy
+                if (!grad.finite) {
+                    std::cout << "grad has nan" << std::endl;
 
-                std::shared_ptr<tensor_tree::vertex> param_bak = tensor_tree::copy_tree(l_args.param);
-                std::shared_ptr<tensor_tree::vertex> opt_data_bak = tensor_tree::copy_tree(l_args.opt_data);
+                    std::ofstream ofs;
+                    ofs.open("param-debug");
+                    tensor_tree::save_tensor(l_args.param, ofs);
+                    ofs.close();
+
+                    ofs.open("opt-data-debug");
+                    tensor_tree::save_tensor(opt_trees.front(), ofs);
+                    ofs.close();
+
+                    exit(1);
+                }
 
                 double v1 = tensor_tree::get_matrix(l_args.param->children[0])(l_args.label_id.at("sil") - 1, 0);
                 double w1 = 0;
@@ -359,46 +410,23 @@ void learning_env::run()
                     w1 = tensor_tree::get_matrix(l_args.nn_param->children[0]->children[0]->children[0])(0, 0);
                 }
 
+                double scale = 1.0 / mini_batch;
+
+                std::cout << "minibatch grad norm: " << scale * grad.norm << std::endl;
+
                 if (ebt::in(std::string("decay"), l_args.args)) {
-                    tensor_tree::rmsprop_update(l_args.param, accu_param_grad, l_args.opt_data,
-                        l_args.decay, l_args.step_size);
-
-                    if (ebt::in(std::string("nn-param"), l_args.args)) {
-                        tensor_tree::rmsprop_update(l_args.nn_param, accu_nn_param_grad, l_args.nn_opt_data,
-                            l_args.decay, l_args.step_size);
-                        tensor_tree::rmsprop_update(l_args.pred_param, accu_pred_grad, l_args.pred_opt_data,
-                            l_args.decay, l_args.step_size);
-                    }
+                    param_arena::rmsprop_update(param_mem.begin(), grad_mem.begin(), opt_mem.begin(),
+                        param_mem.size(), scale, l_args.decay, l_args.step_size);
                 } else if (ebt::in(std::string("adam-beta1"), l_args.args)) {
-                    tensor_tree::adam_update(l_args.param, accu_param_grad, l_args.first_moment, l_args.second_moment,
+                    param_arena::adam_update(param_mem.begin(), grad_mem.begin(), opt_mem.begin(),
+                        second_moment_mem.begin(), param_mem.size(), scale,
                         l_args.time, l_args.step_size, l_args.adam_beta1, l_args.adam_beta2);
-
-                    if (ebt::in(std::string("nn-param"), l_args.args)) {
-                        tensor_tree::adam_update(l_args.nn_param, accu_nn_param_grad, l_args.nn_first_moment, l_args.nn_second_moment,
-                            l_args.time, l_args.step_size, l_args.adam_beta1, l_args.adam_beta2);
-                        tensor_tree::adam_update(l_args.pred_param, accu_pred_grad, l_args.pred_first_moment, l_args.pred_second_moment,
-                            l_args.time, l_args.step_size, l_args.adam_beta1, l_args.adam_beta2);
-                    }
                 } else if (ebt::in(std::string("momentum"), l_args.args)) {
-                    tensor_tree::const_step_update_momentum(l_args.param, accu_param_grad, l_args.opt_data,
-                        l_args.step_size, l_args.momentum);
-
-                    if (ebt::in(std::string("nn-param"), l_args.args)) {
-                        tensor_tree::const_step_update_momentum(l_args.nn_param, accu_nn_param_grad, l_args.nn_opt_data,
-                            l_args.step_size, l_args.momentum);
-                        tensor_tree::const_step_update_momentum(l_args.pred_param, accu_pred_grad, l_args.pred_opt_data,
-                            l_args.step_size, l_args.momentum);
-                    }
+                    param_arena::momentum_update(param_mem.begin(), grad_mem.begin(), opt_mem.begin(),
+                        param_mem.size(), scale, l_args.step_size, l_args.momentum);
                 } else {
-                    tensor_tree::adagrad_update(l_args.param, accu_param_grad, l_args.opt_data,
-                        l_args.step_size);
-
-                    if (ebt::in(std::string("nn-param"), l_args.args)) {
-                        tensor_tree::adagrad_update(l_args.nn_param, accu_nn_param_grad, l_args.nn_opt_data,
-                            l_args.step_size);
-                        tensor_tree::adagrad_update(l_args.pred_param, accu_pred_grad, l_args.pred_opt_data,
-                            l_args.step_size);
-                    }
+                    param_arena::adagrad_update(param_mem.begin(), grad_mem.begin(), opt_mem.begin(),
+                        param_mem.size(), scale, l_args.step_size);
                 }
 
                 double v2 = tensor_tree::get_matrix(l_args.param->children[0])(l_args.label_id.at("sil") - 1, 0);
@@ -414,29 +442,25 @@ void learning_env::run()
                     std::cout << "weight: " << w1 << " update: " << w2 - w1 << " ratio: " << (w2 - w1) / w1 << std::endl;
                 }
 
-                if (tensor_tree::has_nan(l_args.opt_data)) {
-
-                    if (tensor_tree::has_nan(accu_param_grad)) {
-                        std::cout << "grad has nan" << std::endl;
-                    }
+                // a finite gradient can still overflow the optimizer
+                // data; the state saved is the one after the update
+                if (!param_arena::stats(opt_mem.begin(), opt_mem.size()).finite
+                        || !param_arena::stats(second_moment_mem.begin(), second_moment_mem.size()).finite) {
+                    std::cout << "opt data has nan" << std::endl;
 
                     std::ofstream ofs;
                     ofs.open("param-debug");
-                    tensor_tree::save_tensor(param_bak, ofs);
+                    tensor_tree::save_tensor(l_args.param, ofs);
                     ofs.close();
 
                     ofs.open("opt-data-debug");
-                    tensor_tree::save_tensor(opt_data_bak, ofs);
+                    tensor_tree::save_tensor(opt_trees.front(), ofs);
                     ofs.close();
 
                     exit(1);
                 }
 
-                tensor_tree::zero(accu_param_grad);
-                if (ebt::in(std::string("nn-param"), args)) {
-                    tensor_tree::zero(accu_nn_param_grad);
-                    tensor_tree::zero(accu_pred_grad);
-                }
+                std::fill(grad_mem.data.begin(), grad_mem.data.end(), 0);
 
             }
 
@@ -193,8 +193,6 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 
 void learning_env::run()
 {
-    ebt::Timer timer;
-
     int i = 0;
 
     std::default_random_engine gen { seed };
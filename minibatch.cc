@@ -0,0 +1,158 @@
+#include "segbin/minibatch.h"
+#include <algorithm>
+#include <numeric>
+
+namespace minibatch {
+
+    void pad(padded_batch& batch, std::vector<frame::view> const& utts)
+    {
+        batch.batch_size = utts.size();
+        batch.ndim = utts.front().ndim;
+        batch.nframes = 0;
+        batch.lengths.clear();
+
+        for (auto& u: utts) {
+            batch.nframes = std::max(batch.nframes, u.nframes);
+            batch.lengths.push_back(u.nframes);
+        }
+
+        unsigned int B = batch.batch_size;
+        unsigned int D = batch.ndim;
+
+        batch.feat.assign(batch.nframes * B * D, 0);
+        batch.mask.assign(batch.nframes * B, 0);
+
+        for (int b = 0; b < B; ++b) {
+            frame::view const& u = utts[b];
+
+            for (int t = 0; t < u.nframes; ++t) {
+                std::copy(u.data + t * D, u.data + (t + 1) * D,
+                    batch.feat.begin() + (t * B + b) * D);
+                batch.mask[t * B + b] = 1;
+            }
+        }
+    }
+
+    lstm::trans_seq_t make_input_seq(autodiff::computation_graph& comp_graph,
+        padded_batch& batch)
+    {
+        std::shared_ptr<autodiff::op_t> feat = comp_graph.var(la::cpu::weak_tensor<double>(
+            batch.feat.data(), { batch.nframes, batch.batch_size, batch.ndim }));
+        feat->grad_needed = false;
+
+        std::shared_ptr<autodiff::op_t> mask = comp_graph.var(la::cpu::weak_tensor<double>(
+            batch.mask.data(), { batch.nframes, batch.batch_size }));
+        mask->grad_needed = false;
+
+        lstm::trans_seq_t result;
+        result.nframes = batch.nframes;
+        result.batch_size = batch.batch_size;
+        result.dim = batch.ndim;
+        result.feat = feat;
+        result.mask = mask;
+
+        return result;
+    }
+
+    std::vector<std::vector<int>> bucket(std::vector<unsigned int> const& lengths,
+        int batch_size)
+    {
+        std::vector<int> order;
+        order.resize(lengths.size());
+        std::iota(order.begin(), order.end(), 0);
+
+        std::stable_sort(order.begin(), order.end(),
+            [&](int i, int j) { return lengths[i] < lengths[j]; });
+
+        std::vector<std::vector<int>> result;
+
+        for (int i = 0; i < order.size(); i += batch_size) {
+            int end = std::min<int>(i + batch_size, order.size());
+            result.push_back(std::vector<int> { order.begin() + i, order.begin() + end });
+        }
+
+        return result;
+    }
+
+    unsigned int output_length(unsigned int len, unsigned int nframes,
+        unsigned int out_nframes)
+    {
+        while (nframes > out_nframes) {
+            nframes = (nframes + 1) / 2;
+            len = (len + 1) / 2;
+        }
+
+        return len;
+    }
+
+    void split(std::vector<double>& result, double const *data,
+        unsigned int batch_size, unsigned int dim,
+        unsigned int b, unsigned int len)
+    {
+        result.resize(len * dim);
+
+        for (int t = 0; t < len; ++t) {
+            double const *row = data + (t * batch_size + b) * dim;
+            std::copy(row, row + dim, result.begin() + t * dim);
+        }
+    }
+
+    slices::slices(autodiff::computation_graph& comp_graph,
+            std::shared_ptr<autodiff::op_t> seq,
+            unsigned int batch_size, unsigned int dim,
+            std::vector<unsigned int> const& lengths)
+        : seq(seq), batch_size(batch_size), dim(dim), lengths(lengths)
+    {
+        auto& seq_t = autodiff::get_output<la::cpu::tensor_like<double>>(seq);
+
+        data.resize(std::accumulate(lengths.begin(), lengths.end(), 0ul) * dim);
+
+        double *p = data.data();
+
+        for (int b = 0; b < lengths.size(); ++b) {
+            if (lengths[b] == 0) {
+                vars.push_back(nullptr);
+                continue;
+            }
+
+            for (int t = 0; t < lengths[b]; ++t) {
+                double const *row = seq_t.data() + (t * batch_size + b) * dim;
+                std::copy(row, row + dim, p + t * dim);
+            }
+
+            vars.push_back(comp_graph.var(la::cpu::weak_tensor<double>(
+                p, { lengths[b], dim })));
+
+            p += lengths[b] * dim;
+        }
+    }
+
+    void slices::scatter_grad()
+    {
+        if (seq->grad == nullptr) {
+            auto& t = autodiff::get_output<la::cpu::tensor_like<double>>(seq);
+            la::cpu::tensor<double> g;
+            la::cpu::resize_as(g, t);
+            seq->grad = std::make_shared<la::cpu::tensor<double>>(g);
+        }
+
+        double *seq_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(seq).data();
+
+        for (int b = 0; b < lengths.size(); ++b) {
+            if (vars[b] == nullptr || vars[b]->grad == nullptr) {
+                continue;
+            }
+
+            double const *g = autodiff::get_grad<la::cpu::tensor_like<double>>(vars[b]).data();
+
+            for (int t = 0; t < lengths[b]; ++t) {
+                double *row = seq_grad + (t * batch_size + b) * dim;
+
+                for (int d = 0; d < dim; ++d) {
+                    row[d] += g[t * dim + d];
+                }
+            }
+        }
+    }
+
+}
@@ -0,0 +1,90 @@
+#ifndef MINIBATCH_H
+#define MINIBATCH_H
+
+#include <vector>
+#include "nn/lstm-frame.h"
+#include "segbin/frame.h"
+
+namespace minibatch {
+
+    /*
+     * Utterances padded to the longest one, laid out time-major as
+     * nframes x batch_size x ndim, the layout lstm::trans_seq_t expects
+     * when batch_size > 1.  mask is nframes x batch_size, with 1 for
+     * real frames and 0 for padding.
+     */
+    struct padded_batch {
+        std::vector<double> feat;
+        std::vector<double> mask;
+
+        unsigned int nframes;
+        unsigned int batch_size;
+        unsigned int ndim;
+
+        std::vector<unsigned int> lengths;
+    };
+
+    void pad(padded_batch& batch, std::vector<frame::view> const& utts);
+
+    /*
+     * Wrap the padded buffers in the graph.  The buffers are not copied,
+     * so batch has to outlive comp_graph.
+     */
+    lstm::trans_seq_t make_input_seq(autodiff::computation_graph& comp_graph,
+        padded_batch& batch);
+
+    /*
+     * Group the positions 0 .. lengths.size() - 1 into batches of
+     * at most batch_size utterances of similar length.
+     */
+    std::vector<std::vector<int>> bucket(std::vector<unsigned int> const& lengths,
+        int batch_size);
+
+    /*
+     * Number of output frames of an utterance of length len, given
+     * that a padded batch of nframes frames comes out with out_nframes
+     * frames.  Each subsampling layer keeps ceil(n / 2) frames.
+     */
+    unsigned int output_length(unsigned int len, unsigned int nframes,
+        unsigned int out_nframes);
+
+    /*
+     * Copy the first len rows of utterance b out of a time-major
+     * nframes x batch_size x dim tensor into a len x dim matrix.
+     */
+    void split(std::vector<double>& result, double const *data,
+        unsigned int batch_size, unsigned int dim,
+        unsigned int b, unsigned int len);
+
+    /*
+     * The first lengths[b] frames of every utterance b of a time-major
+     * nframes x batch_size x dim op, gathered into one buffer and
+     * wrapped as a lengths[b] x dim var per utterance, or null where
+     * lengths[b] is zero.  The vars are leaves of the graph, so once
+     * their gradients are in, scatter_grad() adds them into the
+     * gradient of seq, and backprop goes on from seq.  The buffer is
+     * not copied, so the slices have to outlive comp_graph.
+     */
+    struct slices {
+        std::shared_ptr<autodiff::op_t> seq;
+        unsigned int batch_size;
+        unsigned int dim;
+        std::vector<unsigned int> lengths;
+
+        std::vector<double> data;
+        std::vector<std::shared_ptr<autodiff::op_t>> vars;
+
+        slices(autodiff::computation_graph& comp_graph,
+            std::shared_ptr<autodiff::op_t> seq,
+            unsigned int batch_size, unsigned int dim,
+            std::vector<unsigned int> const& lengths);
+
+        slices(slices const&) = delete;
+        slices& operator=(slices const&) = delete;
+
+        void scatter_grad();
+    };
+
+}
+
+#endif
@@ -67,8 +67,6 @@ oracle_env::oracle_env(std::unordered_map<std::string, std::string> args)
 
 void oracle_env::run()
 {
-    ebt::Timer timer;
-
     int i = 1;
 
     double min_cost_sum = 0;
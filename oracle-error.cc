@@ -4,14 +4,14 @@
 #include "util/speech.h"
 #include "util/util.h"
 #include "fst/fst-algo.h"
-#include "seg/lat.h"
+#include "segbin/lat-archive.h"
 #include <fstream>
 
 struct oracle_env {
 
     std::ifstream label_batch;
 
-    std::ifstream lattice_batch;
+    lat_archive::reader lattices;
 
     seg::inference_args i_args;
 
@@ -72,7 +72,7 @@ oracle_env::oracle_env(std::unordered_map<std::string, std::string> args)
 
     label_batch.open(args.at("label-batch"));
 
-    lattice_batch.open(args.at("lattice-batch"));
+    lattices.open(args.at("lattice-batch"));
 
     i_args.label_id = util::load_label_id(args.at("label"));
 
@@ -89,8 +89,6 @@ oracle_env::oracle_env(std::unordered_map<std::string, std::string> args)
 
 void oracle_env::run()
 {
-    ebt::Timer timer;
-
     int i = 1;
 
     int total_len = 0;
@@ -111,12 +109,14 @@ void oracle_env::run()
             break;
         }
 
-        ifst::fst lat = lat::load_lattice(lattice_batch, i_args.label_id);
+        lat_archive::lattice lat_buf;
 
-        if (!lattice_batch) {
+        if (!lattices.read(lat_buf)) {
             break;
         }
 
+        ifst::fst lat = lat_archive::make_fst(lat_buf, lattices.symbols, i_args.label_id);
+
         for (auto& e: lat.data->edges) {
             e.weight = 0;
         }
@@ -110,8 +110,6 @@ oracle_env::oracle_env(std::unordered_map<std::string, std::string> args)
 
 void oracle_env::run()
 {
-    ebt::Timer timer;
-
     int i = 1;
 
     int total_len = 0;
@@ -146,8 +146,6 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 
 void learning_env::run()
 {
-    ebt::Timer timer;
-
     int i = 0;
 
     segcost::overlap_cost<int> cost_func { sils };
@@ -0,0 +1,222 @@
+#include "segbin/param-arena.h"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+namespace param_arena {
+
+    arena::arena(std::vector<std::shared_ptr<tensor_tree::vertex>> const& trees)
+    {
+        std::vector<std::shared_ptr<tensor_tree::vertex>> leaves;
+
+        for (auto& t: trees) {
+            auto order = tensor_tree::leaves_pre_order(t);
+            leaves.insert(leaves.end(), order.begin(), order.end());
+        }
+
+        long total = 0;
+
+        for (auto& v: leaves) {
+            total += tensor_tree::get_tensor(v).vec_size();
+        }
+
+        // sized once, so that the views below stay valid
+        data.resize(total);
+
+        long offset = 0;
+
+        for (auto& v: leaves) {
+            auto& t = tensor_tree::get_tensor(v);
+            double *p = data.data() + offset;
+
+            std::copy(t.data(), t.data() + t.vec_size(), p);
+            offset += t.vec_size();
+
+            v->data = std::make_shared<la::cpu::weak_tensor<double>>(p, t.sizes());
+        }
+    }
+
+    double* arena::begin()
+    {
+        return data.data();
+    }
+
+    long arena::size() const
+    {
+        return data.size();
+    }
+
+    void load_tensor(std::shared_ptr<tensor_tree::vertex> tree, std::istream& is)
+    {
+        std::shared_ptr<tensor_tree::vertex> tmp = tensor_tree::copy_tree(tree);
+        tensor_tree::load_tensor(tmp, is);
+
+        auto src = tensor_tree::leaves_pre_order(tmp);
+        auto dst = tensor_tree::leaves_pre_order(tree);
+
+        for (int i = 0; i < dst.size(); ++i) {
+            auto& s = tensor_tree::get_tensor(src[i]);
+            auto& d = tensor_tree::get_tensor(dst[i]);
+
+            if (s.vec_size() != d.vec_size()) {
+                throw std::logic_error("tensor of a different size than its leaf");
+            }
+
+            std::copy(s.data(), s.data() + s.vec_size(), d.data());
+        }
+    }
+
+    grad_stats stats(double const *grad, long n)
+    {
+        double sum = 0;
+        bool finite = true;
+
+        for (long i = 0; i < n; ++i) {
+            sum += grad[i] * grad[i];
+            finite &= std::isfinite(grad[i]);
+        }
+
+        return grad_stats { std::sqrt(sum), finite };
+    }
+
+    void imul(double *v, long n, double a)
+    {
+        for (long i = 0; i < n; ++i) {
+            v[i] *= a;
+        }
+    }
+
+    void const_step_update(double *param, double const *grad, long n,
+        double scale, double step_size)
+    {
+        for (long i = 0; i < n; ++i) {
+            param[i] -= step_size * scale * grad[i];
+        }
+    }
+
+    void adagrad_update(double *param, double const *grad, double *accu, long n,
+        double scale, double step_size)
+    {
+        for (long i = 0; i < n; ++i) {
+            double g = scale * grad[i];
+
+            accu[i] += g * g;
+            param[i] -= step_size * g / std::sqrt(accu[i] + 1e-16);
+        }
+    }
+
+    void rmsprop_update(double *param, double const *grad, double *opt_data, long n,
+        double scale, double decay, double step_size)
+    {
+        for (long i = 0; i < n; ++i) {
+            double g = scale * grad[i];
+
+            opt_data[i] = decay * opt_data[i] + (1 - decay) * g * g;
+            param[i] -= step_size * g / std::sqrt(opt_data[i] + 1e-16);
+        }
+    }
+
+    void adam_update(double *param, double const *grad, double *first_moment,
+        double *second_moment, long n, double scale, int time,
+        double step_size, double beta1, double beta2)
+    {
+        double b1 = 1 - std::pow(beta1, time);
+        double b2 = 1 - std::pow(beta2, time);
+
+        for (long i = 0; i < n; ++i) {
+            double g = scale * grad[i];
+
+            first_moment[i] = beta1 * first_moment[i] + (1 - beta1) * g;
+            second_moment[i] = beta2 * second_moment[i] + (1 - beta2) * g * g;
+
+            param[i] -= step_size * (first_moment[i] / b1)
+                / (std::sqrt(second_moment[i] / b2) + 1e-8);
+        }
+    }
+
+    void momentum_update(double *param, double const *grad, double *update, long n,
+        double scale, double step_size, double momentum)
+    {
+        for (long i = 0; i < n; ++i) {
+            update[i] = momentum * update[i] - step_size * scale * grad[i];
+            param[i] += update[i];
+        }
+    }
+
+    optimizer::optimizer(std::shared_ptr<tensor_tree::vertex> param,
+            std::string type, double step_size)
+        : param(param), type(type), step_size(step_size)
+        , momentum(0), decay(0), beta1(0), beta2(0), time(0)
+    {
+        int nopt;
+
+        if (type == "const-step") {
+            nopt = 0;
+        } else if (type == "const-step-momentum" || type == "rmsprop"
+                || type == "adagrad") {
+            nopt = 1;
+        } else if (type == "adam") {
+            nopt = 2;
+        } else {
+            throw std::logic_error("unknown optimizer " + type);
+        }
+
+        param_mem = std::make_shared<arena>(
+            std::vector<std::shared_ptr<tensor_tree::vertex>> { param });
+
+        for (int i = 0; i < nopt; ++i) {
+            opt_data.push_back(tensor_tree::copy_tree(param));
+            opt_mem.push_back(std::make_shared<arena>(
+                std::vector<std::shared_ptr<tensor_tree::vertex>> { opt_data.back() }));
+            std::fill(opt_mem.back()->data.begin(), opt_mem.back()->data.end(), 0);
+        }
+    }
+
+    void optimizer::update(double const *grad, long n, double scale)
+    {
+        if (n != param_mem->size()) {
+            throw std::logic_error("gradient and parameters of different sizes");
+        }
+
+        double *p = param_mem->begin();
+
+        if (type == "const-step") {
+            const_step_update(p, grad, n, scale, step_size);
+        } else if (type == "const-step-momentum") {
+            momentum_update(p, grad, opt_mem[0]->begin(), n, scale, step_size, momentum);
+        } else if (type == "rmsprop") {
+            rmsprop_update(p, grad, opt_mem[0]->begin(), n, scale, decay, step_size);
+        } else if (type == "adagrad") {
+            adagrad_update(p, grad, opt_mem[0]->begin(), n, scale, step_size);
+        } else if (type == "adam") {
+            ++time;
+            adam_update(p, grad, opt_mem[0]->begin(), opt_mem[1]->begin(), n, scale,
+                time, step_size, beta1, beta2);
+        }
+    }
+
+    void optimizer::save_opt_data(std::ostream& os) const
+    {
+        if (type == "adam") {
+            os << time << std::endl;
+        }
+
+        for (auto& t: opt_data) {
+            tensor_tree::save_tensor(t, os);
+        }
+    }
+
+    void optimizer::load_opt_data(std::istream& is)
+    {
+        if (type == "adam") {
+            std::string line;
+            std::getline(is, line);
+            time = std::stoi(line);
+        }
+
+        for (auto& t: opt_data) {
+            param_arena::load_tensor(t, is);
+        }
+    }
+
+}
@@ -0,0 +1,137 @@
+#ifndef PARAM_ARENA_H
+#define PARAM_ARENA_H
+
+#include "nn/tensor-tree.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+
+namespace param_arena {
+
+    /*
+     * One contiguous buffer behind the leaves of a list of tensor trees.
+     * The values of the leaves are copied into the buffer in pre-order,
+     * tree after tree, and every leaf is replaced with a view into it,
+     * so code that walks the trees keeps working while whole-model
+     * passes can run over a flat array.
+     *
+     * Arenas built from trees with the same shapes have the same
+     * layout, and the i-th element of one corresponds to the i-th
+     * element of the other.  This is what the kernels below rely on.
+     *
+     * The leaves must already be allocated, e.g., by load_tensor or
+     * resize_as.  Anything that replaces the tensor of a leaf, such as
+     * load_tensor, detaches it from the arena.  The arena must outlive
+     * the trees.
+     */
+    struct arena {
+
+        std::vector<double> data;
+
+        arena(std::vector<std::shared_ptr<tensor_tree::vertex>> const& trees);
+
+        arena(arena const&) = delete;
+        arena& operator=(arena const&) = delete;
+
+        double *begin();
+        long size() const;
+    };
+
+    /*
+     * load_tensor for a tree whose leaves live in an arena.  The values
+     * are read into a copy of the tree and copied into the leaves, so
+     * that they stay views into the arena.
+     */
+    void load_tensor(std::shared_ptr<tensor_tree::vertex> tree, std::istream& is);
+
+    struct grad_stats {
+        double norm;
+        bool finite;
+    };
+
+    /*
+     * Norm of the gradient and whether every element is finite, in one
+     * pass.  Finiteness is checked per element, since the sum of
+     * squares can overflow for a finite gradient.
+     */
+    grad_stats stats(double const *grad, long n);
+
+    // multiplies the n elements of v by a
+    void imul(double *v, long n, double a);
+
+    /*
+     * Optimizer steps over flat arrays, with the gradient multiplied by
+     * scale on the fly, so that minibatch averaging and clipping do not
+     * need a pass of their own.  The updates follow
+     * tensor_tree::adagrad_update, rmsprop_update, adam_update and
+     * const_step_update_momentum.
+     */
+    void const_step_update(double *param, double const *grad, long n,
+        double scale, double step_size);
+
+    void adagrad_update(double *param, double const *grad, double *accu, long n,
+        double scale, double step_size);
+
+    void rmsprop_update(double *param, double const *grad, double *opt_data, long n,
+        double scale, double decay, double step_size);
+
+    void adam_update(double *param, double const *grad, double *first_moment,
+        double *second_moment, long n, double scale, int time,
+        double step_size, double beta1, double beta2);
+
+    void momentum_update(double *param, double const *grad, double *update, long n,
+        double scale, double step_size, double momentum);
+
+    /*
+     * The optimizers of tensor_tree, with the parameters and the
+     * optimizer data each in an arena, so that an update is one pass of
+     * the kernels above instead of a walk over the leaves.  type is one
+     * of const-step, const-step-momentum, rmsprop, adagrad and adam;
+     * momentum, decay, beta1 and beta2 are set by the caller for the
+     * types that have them.
+     *
+     * The leaves of param become views into the arena of the optimizer,
+     * which has to outlive param.  Optimizer data is saved and loaded
+     * in the format of the tensor_tree optimizers: nothing for
+     * const-step, a tree with the shape of param for the others, and
+     * for adam the time step followed by the first and second moments.
+     *
+     * update() takes the arena of a gradient with the layout of param,
+     * such as that of a grad_tree::buffer, and multiplies it by scale
+     * on the fly.
+     */
+    struct optimizer {
+
+        std::shared_ptr<tensor_tree::vertex> param;
+
+        std::string type;
+        double step_size;
+        double momentum;
+        double decay;
+        double beta1;
+        double beta2;
+        int time;
+
+        optimizer(std::shared_ptr<tensor_tree::vertex> param,
+            std::string type, double step_size);
+
+        optimizer(optimizer const&) = delete;
+        optimizer& operator=(optimizer const&) = delete;
+
+        void update(double const *grad, long n, double scale = 1);
+
+        void save_opt_data(std::ostream& os) const;
+        void load_opt_data(std::istream& is);
+
+    private:
+        std::shared_ptr<arena> param_mem;
+
+        std::vector<std::shared_ptr<tensor_tree::vertex>> opt_data;
+        std::vector<std::shared_ptr<arena>> opt_mem;
+    };
+
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "ebt/ebt.h"
+#include "nn/tensor-tree.h"
+#include "segbin/param-file.h"
+#include <fstream>
+#include <iostream>
+
+/*
+ * The text format has no index, so tensors are read one at a time
+ * into a tree with a single leaf until the input runs out.
+ */
+std::shared_ptr<tensor_tree::vertex> make_leaf_tree()
+{
+    tensor_tree::vertex root;
+    root.children.push_back(tensor_tree::make_tensor("tensor"));
+    return std::make_shared<tensor_tree::vertex>(root);
+}
+
+int main(int argc, char *argv[])
+{
+    ebt::ArgumentSpec spec {
+        "param-convert",
+        "Convert parameters to and from a binary parameter file",
+        {
+            {"param", "", true},
+            {"header-lines", "number of text lines before the tensors", false},
+            {"output", "", true},
+        }
+    };
+
+    if (argc == 1) {
+        ebt::usage(spec);
+        exit(1);
+    }
+
+    auto args = ebt::parse_args(argc, argv, spec);
+
+    for (int i = 0; i < argc; ++i) {
+        std::cout << argv[i] << " ";
+    }
+    std::cout << std::endl;
+
+    if (param_file::is_param_file(args.at("param"))) {
+        auto m = std::make_shared<param_file::mapped>();
+        m->open(args.at("param"));
+
+        std::ofstream ofs { args.at("output") };
+        ofs << m->header;
+
+        for (int i = 0; i < m->leaves.size(); ++i) {
+            std::shared_ptr<tensor_tree::vertex> root = make_leaf_tree();
+            param_file::leaf_entry const& e = m->leaves[i];
+
+            root->children[0]->data = std::make_shared<la::cpu::weak_tensor<double>>(
+                reinterpret_cast<double*>(m->base + e.offset), e.sizes);
+
+            tensor_tree::save_tensor(root, ofs);
+        }
+
+        ofs.close();
+
+        std::cout << "tensors: " << m->leaves.size() << std::endl;
+
+        return 0;
+    }
+
+    int header_lines = 0;
+    if (ebt::in(std::string("header-lines"), args)) {
+        header_lines = std::stoi(args.at("header-lines"));
+    }
+
+    std::ifstream ifs { args.at("param") };
+
+    std::string header;
+    std::string line;
+
+    for (int i = 0; i < header_lines; ++i) {
+        std::getline(ifs, line);
+        header += line + "\n";
+    }
+
+    std::vector<std::shared_ptr<tensor_tree::vertex>> leaves;
+
+    while (ifs >> std::ws && ifs.peek() != std::char_traits<char>::eof()) {
+        std::shared_ptr<tensor_tree::vertex> root = make_leaf_tree();
+        tensor_tree::load_tensor(root, ifs);
+
+        if (!ifs) {
+            std::cerr << "unable to read tensor " << leaves.size() << std::endl;
+            exit(1);
+        }
+
+        leaves.push_back(root->children[0]);
+    }
+
+    param_file::save(args.at("output"), header, leaves);
+
+    std::cout << "tensors: " << leaves.size() << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "segbin/param-file.h"
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace param_file {
+
+    namespace {
+
+        char const param_magic[8] = { 's', 'e', 'g', 'p', 'r', 'm', '0', '1' };
+
+        unsigned long const alignment = 64;
+
+        template <class T>
+        T read_value(char const *p)
+        {
+            T v;
+            std::memcpy(&v, p, sizeof(T));
+            return v;
+        }
+
+        template <class T>
+        void write_value(std::ostream& os, T v)
+        {
+            os.write(reinterpret_cast<char const*>(&v), sizeof(T));
+        }
+
+        unsigned long align(unsigned long offset)
+        {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+    }
+
+    mapped::mapped()
+        : base(nullptr), size(0)
+    {}
+
+    mapped::~mapped()
+    {
+        if (base != nullptr) {
+            munmap(base, size);
+        }
+    }
+
+    void mapped::open(std::string filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+
+        if (fd == -1) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            throw std::logic_error("unable to stat " + filename);
+        }
+
+        size = st.st_size;
+
+        if (size < sizeof(param_magic) + sizeof(uint64_t)) {
+            ::close(fd);
+            throw std::logic_error(filename + " is not a binary parameter file");
+        }
+
+        void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED) {
+            throw std::logic_error("unable to map " + filename);
+        }
+
+        base = static_cast<char*>(p);
+
+        if (std::memcmp(base, param_magic, sizeof(param_magic)) != 0) {
+            throw std::logic_error(filename + " is not a binary parameter file");
+        }
+
+        // every count and offset is checked against the size of the
+        // file before it is used
+        char const *end = base + size;
+
+        auto need = [&](char const *q, uint64_t n) {
+            if (n > end - q) {
+                throw std::logic_error(filename + " is truncated or corrupt");
+            }
+        };
+
+        char const *q = base + sizeof(param_magic);
+
+        uint64_t header_size = read_value<uint64_t>(q);
+        q += sizeof(uint64_t);
+        need(q, header_size);
+        header = std::string(q, header_size);
+        q += header_size;
+
+        need(q, sizeof(uint64_t));
+        uint64_t nleaves = read_value<uint64_t>(q);
+        q += sizeof(uint64_t);
+
+        // a leaf takes at least 12 bytes of index
+        if (nleaves > (end - q) / 12) {
+            throw std::logic_error(filename + " is truncated or corrupt");
+        }
+
+        leaves.resize(nleaves);
+
+        for (auto& e: leaves) {
+            need(q, sizeof(uint32_t));
+            uint32_t ndim = read_value<uint32_t>(q);
+            q += sizeof(uint32_t);
+
+            need(q, (uint64_t) ndim * sizeof(uint32_t) + sizeof(uint64_t));
+
+            e.sizes.resize(ndim);
+            for (auto& s: e.sizes) {
+                s = read_value<uint32_t>(q);
+                q += sizeof(uint32_t);
+            }
+
+            e.offset = read_value<uint64_t>(q);
+            q += sizeof(uint64_t);
+
+            if (e.offset % sizeof(double) != 0 || e.offset > size) {
+                throw std::logic_error(filename + " is truncated or corrupt");
+            }
+
+            // the number of doubles that fit, so the product cannot overflow
+            uint64_t room = (size - e.offset) / sizeof(double);
+            uint64_t n = 1;
+
+            for (auto& s: e.sizes) {
+                if (s != 0 && n > room / s) {
+                    throw std::logic_error(filename + " is truncated or corrupt");
+                }
+
+                n *= s;
+            }
+        }
+    }
+
+    void bind(std::shared_ptr<mapped> m, std::shared_ptr<tensor_tree::vertex> param)
+    {
+        auto order = tensor_tree::leaves_pre_order(param);
+
+        if (order.size() != m->leaves.size()) {
+            throw std::logic_error("parameter file has " + std::to_string(m->leaves.size())
+                + " tensors, expecting " + std::to_string(order.size()));
+        }
+
+        for (int i = 0; i < order.size(); ++i) {
+            leaf_entry const& e = m->leaves[i];
+
+            order[i]->data = std::shared_ptr<la::cpu::weak_tensor<double>>(
+                new la::cpu::weak_tensor<double>(
+                    reinterpret_cast<double*>(m->base + e.offset), e.sizes),
+                [m](la::cpu::weak_tensor<double> *t) { delete t; });
+        }
+    }
+
+    void save(std::string filename, std::string const& header,
+        std::vector<std::shared_ptr<tensor_tree::vertex>> const& leaves)
+    {
+        std::ofstream ofs { filename, std::ios::binary };
+
+        if (!ofs) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        unsigned long offset = sizeof(param_magic) + sizeof(uint64_t)
+            + header.size() + sizeof(uint64_t);
+
+        for (auto& v: leaves) {
+            offset += sizeof(uint32_t) * (1 + tensor_tree::get_tensor(v).dim())
+                + sizeof(uint64_t);
+        }
+
+        ofs.write(param_magic, sizeof(param_magic));
+        write_value<uint64_t>(ofs, header.size());
+        ofs.write(header.data(), header.size());
+        write_value<uint64_t>(ofs, leaves.size());
+
+        unsigned long pos = offset;
+
+        std::vector<unsigned long> data_offset;
+
+        for (auto& v: leaves) {
+            auto& t = tensor_tree::get_tensor(v);
+
+            offset = align(offset);
+            data_offset.push_back(offset);
+
+            write_value<uint32_t>(ofs, t.dim());
+            for (int d = 0; d < t.dim(); ++d) {
+                write_value<uint32_t>(ofs, t.size(d));
+            }
+            write_value<uint64_t>(ofs, offset);
+
+            offset += t.vec_size() * sizeof(double);
+        }
+
+        for (int i = 0; i < leaves.size(); ++i) {
+            auto& t = tensor_tree::get_tensor(leaves[i]);
+
+            // zero padding up to the aligned offset
+            for (; pos < data_offset[i]; ++pos) {
+                ofs.put(0);
+            }
+
+            ofs.write(reinterpret_cast<char const*>(t.data()),
+                t.vec_size() * sizeof(double));
+            pos += t.vec_size() * sizeof(double);
+        }
+
+        ofs.close();
+
+        if (!ofs) {
+            throw std::logic_error("unable to write " + filename);
+        }
+    }
+
+    void save(std::string filename, std::string const& header,
+        std::shared_ptr<tensor_tree::vertex> param)
+    {
+        save(filename, header, tensor_tree::leaves_pre_order(param));
+    }
+
+    bool is_param_file(std::string const& filename)
+    {
+        std::ifstream ifs { filename, std::ios::binary };
+
+        char magic[sizeof(param_magic)];
+        ifs.read(magic, sizeof(magic));
+
+        return ifs && std::memcmp(magic, param_magic, sizeof(magic)) == 0;
+    }
+
+    void reader::open(std::string filename)
+    {
+        if (is_param_file(filename)) {
+            bin = std::make_shared<mapped>();
+            bin->open(filename);
+            header_text.str(bin->header);
+        } else {
+            text.open(filename);
+
+            if (!text) {
+                throw std::logic_error("unable to open " + filename);
+            }
+        }
+    }
+
+    std::istream& reader::header()
+    {
+        if (bin != nullptr) {
+            return header_text;
+        } else {
+            return text;
+        }
+    }
+
+    void reader::load(std::shared_ptr<tensor_tree::vertex> param)
+    {
+        if (bin != nullptr) {
+            bind(bin, param);
+        } else {
+            tensor_tree::load_tensor(param, text);
+            text.close();
+        }
+    }
+
+}
@@ -0,0 +1,86 @@
+#ifndef PARAM_FILE_H
+#define PARAM_FILE_H
+
+#include "nn/tensor-tree.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <istream>
+#include <fstream>
+#include <sstream>
+
+namespace param_file {
+
+    struct leaf_entry {
+        std::vector<unsigned int> sizes;
+        unsigned long offset;
+    };
+
+    /*
+     * Binary parameter file.
+     *
+     * header: magic (8 bytes), header text length (uint64), header text
+     * index:  number of leaves (uint64), and for each leaf in pre-order
+     *         ndim (uint32), sizes (uint32 each), offset (uint64)
+     * data:   native doubles per leaf, 64-byte aligned
+     *
+     * The header text holds the lines that precede the tensors in the
+     * text format, such as the number of layers.
+     *
+     * The file is mapped read-only and shared, so every process
+     * decoding with the same model uses the same physical pages, and
+     * opening a model costs a page fault per page actually touched.
+     */
+    struct mapped {
+        std::string header;
+        std::vector<leaf_entry> leaves;
+
+        char *base;
+        unsigned long size;
+
+        mapped();
+        ~mapped();
+
+        mapped(mapped const&) = delete;
+        mapped& operator=(mapped const&) = delete;
+
+        void open(std::string filename);
+    };
+
+    /*
+     * Replaces the leaves of param with views into the mapping.  The
+     * views keep the mapping alive, and writing to them faults.
+     */
+    void bind(std::shared_ptr<mapped> m, std::shared_ptr<tensor_tree::vertex> param);
+
+    void save(std::string filename, std::string const& header,
+        std::vector<std::shared_ptr<tensor_tree::vertex>> const& leaves);
+
+    void save(std::string filename, std::string const& header,
+        std::shared_ptr<tensor_tree::vertex> param);
+
+    bool is_param_file(std::string const& filename);
+
+    /*
+     * Parameter source that reads either a binary parameter file or
+     * text, depending on the magic of the file.
+     *
+     * header() is the stream of the leading lines, from which the tools
+     * read what they need to build the tree, and load(param) then fills
+     * the tree.
+     */
+    struct reader {
+        std::shared_ptr<mapped> bin;
+        std::ifstream text;
+        std::istringstream header_text;
+
+        void open(std::string filename);
+
+        std::istream& header();
+
+        void load(std::shared_ptr<tensor_tree::vertex> param);
+    };
+
+}
+
+#endif
@@ -90,8 +90,6 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
 
 void prediction_env::run()
 {
-    ebt::Timer timer;
-
     int i = 0;
 
     while (1) {
@@ -0,0 +1,167 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+
+namespace prefetch {
+
+    /*
+     * Loads samples in the order given by `order' with a pool of loader
+     * threads, keeping at most `depth' samples ahead of the consumer.
+     * Samples are handed out by next() in the same order.
+     *
+     * load(thread, index) is called with the id of the loader thread,
+     * so that each thread can keep its own streams.  With nthread == 0,
+     * samples are loaded synchronously in next() with thread id 0.
+     *
+     * stalls counts the calls to next() that had to wait for a loader,
+     * and stall_time is the total time spent waiting in seconds.
+     */
+    template <class T>
+    struct loader {
+
+        std::vector<int> order;
+        int depth;
+        std::function<T(int, int)> load;
+
+        int stalls;
+        double stall_time;
+
+        loader(std::vector<int> const& order, int depth, int nthread,
+            std::function<T(int, int)> load);
+
+        ~loader();
+
+        loader(loader const&) = delete;
+        loader& operator=(loader const&) = delete;
+
+        T next();
+
+    private:
+        std::vector<std::thread> threads;
+
+        std::mutex mutex;
+        std::condition_variable produced;
+        std::condition_variable consumed;
+
+        int next_load;
+        int next_consume;
+        bool stop;
+
+        std::unordered_map<int, T> ready;
+        std::exception_ptr error;
+
+        void work(int thread);
+    };
+
+    template <class T>
+    loader<T>::loader(std::vector<int> const& order, int depth, int nthread,
+            std::function<T(int, int)> load)
+        : order(order), depth(depth), load(load), stalls(0), stall_time(0)
+        , next_load(0), next_consume(0), stop(false)
+    {
+        for (int i = 0; i < nthread; ++i) {
+            threads.push_back(std::thread { &loader<T>::work, this, i });
+        }
+    }
+
+    template <class T>
+    loader<T>::~loader()
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            stop = true;
+        }
+
+        consumed.notify_all();
+
+        for (auto& t: threads) {
+            t.join();
+        }
+    }
+
+    template <class T>
+    void loader<T>::work(int thread)
+    {
+        while (1) {
+            int k;
+
+            {
+                std::unique_lock<std::mutex> lock { mutex };
+
+                consumed.wait(lock, [&]() {
+                    return stop || next_load >= order.size()
+                        || next_load < next_consume + depth;
+                });
+
+                if (stop || next_load >= order.size()) {
+                    return;
+                }
+
+                k = next_load;
+                ++next_load;
+            }
+
+            try {
+                T sample = load(thread, order[k]);
+
+                std::lock_guard<std::mutex> lock { mutex };
+                ready.emplace(k, std::move(sample));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock { mutex };
+                if (error == nullptr) {
+                    error = std::current_exception();
+                }
+            }
+
+            produced.notify_all();
+        }
+    }
+
+    template <class T>
+    T loader<T>::next()
+    {
+        if (threads.size() == 0) {
+            return load(0, order.at(next_consume++));
+        }
+
+        std::unique_lock<std::mutex> lock { mutex };
+
+        if (error == nullptr && ready.find(next_consume) == ready.end()) {
+            ++stalls;
+
+            auto start = std::chrono::steady_clock::now();
+
+            produced.wait(lock, [&]() {
+                return error != nullptr || ready.find(next_consume) != ready.end();
+            });
+
+            stall_time += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+
+        auto it = ready.find(next_consume);
+        T sample = std::move(it->second);
+        ready.erase(it);
+        ++next_consume;
+
+        lock.unlock();
+        consumed.notify_all();
+
+        return sample;
+    }
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include "segbin/reorder.h"
+
+namespace reorder {
+
+    buffer::buffer(std::ostream& os, long flush_bytes)
+        : os(os), flush_bytes(flush_bytes), next(0), unflushed(0)
+    {}
+
+    void buffer::put(int k, std::string s)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        if (k != next) {
+            held[k] = std::move(s);
+            return;
+        }
+
+        os.write(s.data(), s.size());
+        unflushed += s.size();
+        ++next;
+
+        auto it = held.find(next);
+
+        while (it != held.end()) {
+            os.write(it->second.data(), it->second.size());
+            unflushed += it->second.size();
+            held.erase(it);
+            ++next;
+            it = held.find(next);
+        }
+
+        if (unflushed >= flush_bytes) {
+            os.flush();
+            unflushed = 0;
+        }
+    }
+
+    void buffer::flush()
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        os.flush();
+        unflushed = 0;
+    }
+
+    int buffer::pending()
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        return held.size();
+    }
+
+}
@@ -0,0 +1,43 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+namespace reorder {
+
+    /*
+     * Collects the output of utterances finished out of order by
+     * several threads and writes it to the stream in the order of
+     * the utterance index, starting from 0.
+     *
+     * The stream is flushed once at least flush_bytes have been written
+     * since the last flush, or after every put when flush_bytes is 0.
+     */
+    struct buffer {
+
+        std::ostream& os;
+        long flush_bytes;
+
+        buffer(std::ostream& os, long flush_bytes = 0);
+
+        // thread-safe
+        void put(int k, std::string s);
+
+        void flush();
+
+        // number of utterances that are held back
+        int pending();
+
+    private:
+        std::mutex mutex;
+        int next;
+        long unflushed;
+        std::unordered_map<int, std::string> held;
+    };
+
+}
+
+#endif
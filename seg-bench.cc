@@ -0,0 +1,444 @@
+#include "seg/seg-util.h"
+#include "seg/loss.h"
+#include "seg/ctc.h"
+#include "fst/fst-algo.h"
+#include "ebt/ebt.h"
+#include "segbin/param-file.h"
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+
+/*
+ * Microbenchmarks of the segment graph kernels on synthetic inputs,
+ * swept over the number of frames, max_seg, stride and the size of the
+ * label set.  Every kernel is reported in ms per call, ns per edge of
+ * the graph it runs on, and the growth of the peak resident size while
+ * it runs.
+ *
+ * Edges are scored by a random frame-by-label matrix through
+ * ctc::label_weight, so that the search kernels are timed apart from
+ * the features.  make_weights needs a linear model in --param and
+ * scores every edge through seg::make_weights instead.
+ */
+
+namespace {
+
+    std::vector<int> parse_list(std::string const& s)
+    {
+        std::vector<int> result;
+
+        for (auto& p: ebt::split(s, ",")) {
+            result.push_back(std::stoi(p));
+        }
+
+        return result;
+    }
+
+    /*
+     * Writing 5 to clear_refs resets the peak resident size of the
+     * process (Linux 4.0 and later), so the peak after a kernel
+     * belongs to that kernel.
+     */
+    void reset_peak()
+    {
+        std::ofstream ofs { "/proc/self/clear_refs" };
+        ofs << "5";
+    }
+
+    // in kB, or -1 without /proc
+    long status_kb(std::string const& field)
+    {
+        std::ifstream ifs { "/proc/self/status" };
+        std::string line;
+
+        while (std::getline(ifs, line)) {
+            if (line.compare(0, field.size(), field) == 0 && line[field.size()] == ':') {
+                std::istringstream iss { line.substr(field.size() + 1) };
+                long kb;
+                iss >> kb;
+                return kb;
+            }
+        }
+
+        return -1;
+    }
+
+    struct result {
+        double seconds;
+        long peak_kb;
+    };
+
+    template <class F>
+    result measure(int repeat, F f)
+    {
+        reset_peak();
+        long base = status_kb("VmRSS");
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < repeat; ++i) {
+            f();
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        long peak = status_kb("VmHWM");
+
+        return result { std::chrono::duration<double>(end - start).count() / repeat,
+            base < 0 || peak < 0 ? -1 : peak - base };
+    }
+
+    struct config {
+        int nframes;
+        int max_seg;
+        int stride;
+        int nlabel;
+    };
+
+    void print_header(std::ostream& os)
+    {
+        os << std::left << std::setw(16) << "kernel"
+            << std::right << std::setw(8) << "frames"
+            << std::setw(8) << "max-seg"
+            << std::setw(8) << "stride"
+            << std::setw(8) << "labels"
+            << std::setw(12) << "edges"
+            << std::setw(12) << "ms"
+            << std::setw(10) << "ns/edge"
+            << std::setw(10) << "peak-mb" << std::endl;
+    }
+
+    void print(std::ostream& os, std::string const& kernel, config const& c,
+        long nedge, result const& r)
+    {
+        os << std::left << std::setw(16) << kernel
+            << std::right << std::setw(8) << c.nframes
+            << std::setw(8) << c.max_seg
+            << std::setw(8) << c.stride
+            << std::setw(8) << c.nlabel
+            << std::setw(12) << nedge
+            << std::setw(12) << std::fixed << std::setprecision(3) << 1000 * r.seconds
+            << std::setw(10) << std::setprecision(2) << 1e9 * r.seconds / nedge
+            << std::setw(10);
+
+        if (r.peak_kb < 0) {
+            os << "-";
+        } else {
+            os << std::setprecision(1) << r.peak_kb / 1024.0;
+        }
+
+        os << std::defaultfloat << std::endl;
+    }
+
+    struct label_set {
+        std::vector<std::string> id_label;
+        std::unordered_map<std::string, int> label_id;
+
+        label_set(std::string const& first, int nlabel)
+        {
+            id_label.push_back(first);
+            for (int i = 1; i <= nlabel; ++i) {
+                id_label.push_back("l" + std::to_string(i));
+            }
+
+            for (int i = 0; i < id_label.size(); ++i) {
+                label_id[id_label[i]] = i;
+            }
+        }
+    };
+
+}
+
+int main(int argc, char *argv[])
+{
+    ebt::ArgumentSpec spec {
+        "seg-bench",
+        "Benchmark the segment graph kernels on synthetic inputs",
+        {
+            {"frames", "comma-separated, default: 100,300,1000", false},
+            {"max-seg", "comma-separated, default: 10,20", false},
+            {"stride", "comma-separated, default: 1,2", false},
+            {"labels", "comma-separated, default: 50", false},
+            {"min-seg", "default: 1", false},
+            {"kernels", "comma-separated, default: all", false},
+            {"alpha", "beam_prune threshold, default: 0.5", false},
+            {"min-edges", "beam_prune, default: 1", false},
+            {"beam-width", "ctc_beam_search, default: 10", false},
+            {"param", "linear model for make_weights", false},
+            {"features", "features of the model in --param", false},
+            {"input-dim", "frame dimension for make_weights, default: 40", false},
+            {"repeat", "default: 3", false},
+            {"seed", "default: 1", false},
+        }
+    };
+
+    if (argc == 1) {
+        ebt::usage(spec);
+        exit(1);
+    }
+
+    auto args = ebt::parse_args(argc, argv, spec);
+
+    std::vector<int> frames_list { 100, 300, 1000 };
+    if (ebt::in(std::string("frames"), args)) {
+        frames_list = parse_list(args.at("frames"));
+    }
+
+    std::vector<int> max_seg_list { 10, 20 };
+    if (ebt::in(std::string("max-seg"), args)) {
+        max_seg_list = parse_list(args.at("max-seg"));
+    }
+
+    std::vector<int> stride_list { 1, 2 };
+    if (ebt::in(std::string("stride"), args)) {
+        stride_list = parse_list(args.at("stride"));
+    }
+
+    std::vector<int> labels_list { 50 };
+    if (ebt::in(std::string("labels"), args)) {
+        labels_list = parse_list(args.at("labels"));
+    }
+
+    int min_seg = 1;
+    if (ebt::in(std::string("min-seg"), args)) {
+        min_seg = std::stoi(args.at("min-seg"));
+    }
+
+    std::vector<std::string> kernels { "make_graph", "topo_order", "make_weights",
+        "loss_grad", "shortest_path", "beam_prune", "max_marginal", "ctc_beam_search" };
+    if (ebt::in(std::string("kernels"), args)) {
+        kernels = ebt::split(args.at("kernels"), ",");
+    }
+
+    auto enabled = [&](std::string const& k) {
+        return std::find(kernels.begin(), kernels.end(), k) != kernels.end();
+    };
+
+    double alpha = 0.5;
+    if (ebt::in(std::string("alpha"), args)) {
+        alpha = std::stod(args.at("alpha"));
+    }
+
+    int min_edges = 1;
+    if (ebt::in(std::string("min-edges"), args)) {
+        min_edges = std::stoi(args.at("min-edges"));
+    }
+
+    int beam_width = 10;
+    if (ebt::in(std::string("beam-width"), args)) {
+        beam_width = std::stoi(args.at("beam-width"));
+    }
+
+    int input_dim = 40;
+    if (ebt::in(std::string("input-dim"), args)) {
+        input_dim = std::stoi(args.at("input-dim"));
+    }
+
+    int repeat = 3;
+    if (ebt::in(std::string("repeat"), args)) {
+        repeat = std::stoi(args.at("repeat"));
+    }
+
+    int seed = 1;
+    if (ebt::in(std::string("seed"), args)) {
+        seed = std::stoi(args.at("seed"));
+    }
+
+    std::vector<std::string> features;
+    std::shared_ptr<tensor_tree::vertex> param;
+
+    if (ebt::in(std::string("param"), args)) {
+        features = ebt::split(args.at("features"), ",");
+        param = seg::make_tensor_tree(features);
+
+        param_file::reader param_src;
+        param_src.open(args.at("param"));
+        param_src.load(param);
+    } else if (enabled("make_weights")) {
+        std::cerr << "make_weights skipped without --param" << std::endl;
+    }
+
+    std::default_random_engine gen { (unsigned int) seed };
+    std::normal_distribution<double> normal;
+
+    std::vector<config> configs;
+
+    for (int nlabel: labels_list) {
+        for (int nframes: frames_list) {
+            for (int max_seg: max_seg_list) {
+                for (int stride: stride_list) {
+                    configs.push_back(config { nframes, max_seg, stride, nlabel });
+                }
+            }
+        }
+    }
+
+    print_header(std::cout);
+
+    for (auto& c: configs) {
+
+        int nframes = c.nframes;
+        int max_seg = c.max_seg;
+        int stride = c.stride;
+        int nlabel = c.nlabel;
+
+        label_set seg_labels { "<eps>", nlabel };
+
+        std::shared_ptr<ifst::fst> graph_fst;
+
+        result r = measure(repeat, [&]() {
+            graph_fst = seg::make_graph(nframes, seg_labels.label_id, seg_labels.id_label,
+                min_seg, max_seg, stride);
+        });
+
+        long nedge = graph_fst->edges().size();
+
+        if (enabled("make_graph")) {
+            print(std::cout, "make_graph", c, nedge, r);
+        }
+
+        std::shared_ptr<std::vector<int>> topo_order;
+
+        r = measure(repeat, [&]() {
+            topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_fst));
+        });
+
+        if (enabled("topo_order")) {
+            print(std::cout, "topo_order", c, nedge, r);
+        }
+
+        // log probabilities of every label at every frame
+        std::vector<double> scores;
+        scores.resize(nframes * (nlabel + 1));
+        for (auto& s: scores) {
+            s = normal(gen);
+        }
+
+        autodiff::computation_graph comp_graph;
+        std::shared_ptr<autodiff::op_t> score_mat = comp_graph.var(la::cpu::weak_tensor<double>(
+            scores.data(), { (unsigned int) nframes, (unsigned int) nlabel + 1 }));
+
+        seg::iseg_data graph_data;
+        graph_data.fst = graph_fst;
+        graph_data.topo_order = topo_order;
+        graph_data.weight_func = std::make_shared<ctc::label_weight>(ctc::label_weight(score_mat));
+
+        seg::seg_fst<seg::iseg_data> graph { graph_data };
+
+        if (enabled("make_weights") && param != nullptr) {
+            std::vector<double> frame_data;
+            frame_data.resize(nframes * input_dim);
+            for (auto& v: frame_data) {
+                v = normal(gen);
+            }
+
+            double sum = 0;
+
+            r = measure(repeat, [&]() {
+                autodiff::computation_graph g;
+                std::shared_ptr<tensor_tree::vertex> var_tree
+                    = tensor_tree::make_var_tree(g, param);
+
+                std::shared_ptr<autodiff::op_t> frame_mat = g.var(la::cpu::weak_tensor<double>(
+                    frame_data.data(), { (unsigned int) nframes, (unsigned int) input_dim }));
+
+                seg::iseg_data data;
+                data.fst = graph_fst;
+                data.topo_order = topo_order;
+                data.weight_func = seg::make_weights(features, var_tree, frame_mat);
+
+                seg::seg_fst<seg::iseg_data> weighted { data };
+
+                // the weights are computed lazily, so ask for all of them
+                for (auto& e: weighted.edges()) {
+                    sum += weighted.weight(e);
+                }
+            });
+
+            print(std::cout, "make_weights", c, nedge, r);
+        }
+
+        if (enabled("loss_grad")) {
+            std::uniform_int_distribution<int> uniform { 1, nlabel };
+            std::vector<int> label_seq;
+            for (int i = 0; i < std::max(1, nframes / (4 * stride)); ++i) {
+                label_seq.push_back(uniform(gen));
+            }
+
+            ifst::fst label_fst = seg::make_label_fst(label_seq,
+                seg_labels.label_id, seg_labels.id_label);
+
+            r = measure(repeat, [&]() {
+                seg::marginal_log_loss loss_func { graph_data, label_fst };
+                loss_func.loss();
+                loss_func.grad();
+                graph_data.weight_func->grad();
+            });
+
+            print(std::cout, "loss_grad", c, nedge, r);
+        }
+
+        if (enabled("shortest_path")) {
+            r = measure(repeat, [&]() {
+                fst::shortest_path(graph, *topo_order);
+            });
+
+            print(std::cout, "shortest_path", c, nedge, r);
+        }
+
+        if (enabled("beam_prune")) {
+            r = measure(repeat, [&]() {
+                fst::beam_prune<seg::seg_fst<seg::iseg_data>> beam_prune;
+                beam_prune.merge(graph, *topo_order, alpha, min_edges);
+            });
+
+            print(std::cout, "beam_prune", c, nedge, r);
+        }
+
+        // the forward and backward passes of cascade::compute_marginal
+        if (enabled("max_marginal")) {
+            r = measure(repeat, [&]() {
+                fst::forward_one_best<seg::seg_fst<seg::iseg_data>> forward;
+                for (auto v: graph.initials()) {
+                    forward.extra[v] = {-1, 0};
+                }
+                forward.merge(graph, *topo_order);
+
+                fst::backward_one_best<seg::seg_fst<seg::iseg_data>> backward;
+                for (auto v: graph.finals()) {
+                    backward.extra[v] = {-1, 0};
+                }
+                backward.merge(graph, *topo_order);
+            });
+
+            print(std::cout, "max_marginal", c, nedge, r);
+        }
+
+        // the frame graph of ctc does not depend on max_seg and stride
+        if (enabled("ctc_beam_search") && max_seg == max_seg_list.front()
+                && stride == stride_list.front()) {
+            label_set ctc_labels { "<blk>", nlabel };
+
+            seg::iseg_data ctc_data;
+            ctc_data.fst = std::make_shared<ifst::fst>(
+                ctc::make_frame_fst(nframes, ctc_labels.label_id, ctc_labels.id_label));
+            ctc_data.weight_func = std::make_shared<ctc::label_weight>(ctc::label_weight(score_mat));
+
+            seg::seg_fst<seg::iseg_data> ctc_graph { ctc_data };
+
+            r = measure(repeat, [&]() {
+                ctc::beam_search<seg::seg_fst<seg::iseg_data>> beam_search;
+                beam_search.search(ctc_graph, ctc_labels.label_id.at("<blk>"), beam_width);
+            });
+
+            print(std::cout, "ctc_beam_search", c, ctc_data.fst->edges().size(), r);
+        }
+
+    }
+
+    return 0;
+}
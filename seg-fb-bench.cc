@@ -0,0 +1,537 @@
+#include "seg/seg-util.h"
+#include "seg/loss.h"
+#include "ebt/ebt.h"
+#include "segbin/seg-graph.h"
+#include "segbin/seg-fb.h"
+#include "segbin/seg-viterbi.h"
+#include "fst/fst-algo.h"
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <utility>
+#include <unordered_map>
+#include <iostream>
+
+/*
+ * Checks that seg_graph::fst has the vertices, edges and edge order of
+ * seg::make_graph, then compares seg_fb::marginal_log_loss against
+ * seg::marginal_log_loss over the graph of seg::make_graph, and against
+ * an edge-by-edge forward-backward over the implicit graph, the way the
+ * generic fst algorithms walk it: one log_add per edge, with forward
+ * and backward scores kept in hash maps.  Scores are random.  Also
+ * checks that seg_viterbi::best_path finds the same path as
+ * fst::shortest_path, on the random scores and on rounded and zero
+ * scores where paths tie.
+ */
+
+namespace {
+
+    double const inf = std::numeric_limits<double>::infinity();
+
+    double log_add(double a, double b)
+    {
+        if (a == -inf) {
+            return b;
+        } else if (b == -inf) {
+            return a;
+        } else if (a > b) {
+            return a + std::log1p(std::exp(b - a));
+        } else {
+            return b + std::log1p(std::exp(a - b));
+        }
+    }
+
+    double get(std::unordered_map<long, double> const& m, long k)
+    {
+        auto i = m.find(k);
+        return i == m.end() ? -inf : i->second;
+    }
+
+    struct edge_walk {
+
+        seg_graph::fst const& graph;
+        std::vector<double> const& scores;
+        std::vector<int> const& label_seq;
+
+        std::unordered_map<long, double> alpha;
+        std::unordered_map<long, double> beta;
+        std::unordered_map<long, double> gold_alpha;
+        std::unordered_map<long, double> gold_beta;
+
+        double log_z;
+        double gold_log_z;
+
+        int nstate;
+
+        edge_walk(seg_graph::fst const& graph, std::vector<double> const& scores,
+                std::vector<int> const& label_seq)
+            : graph(graph), scores(scores), label_seq(label_seq)
+        {
+            nstate = label_seq.size() + 1;
+
+            std::vector<int> order = seg_graph::topo_order(graph);
+            int final = graph.finals().front();
+
+            alpha[0] = 0;
+            gold_alpha[0] = 0;
+
+            for (auto& v: order) {
+                for (auto e: graph.in_edges(v)) {
+                    int u = graph.tail(e);
+                    int l = e % graph.labels.size();
+                    double w = weight(e);
+
+                    alpha[v] = log_add(get(alpha, v), get(alpha, u) + w);
+
+                    for (int k = 0; k < label_seq.size(); ++k) {
+                        if (label_seq[k] == l) {
+                            long s = v * nstate + k + 1;
+                            gold_alpha[s] = log_add(get(gold_alpha, s),
+                                get(gold_alpha, u * nstate + k) + w);
+                        }
+                    }
+                }
+            }
+
+            beta[final] = 0;
+            gold_beta[final * nstate + label_seq.size()] = 0;
+
+            for (int i = order.size() - 1; i >= 0; --i) {
+                int u = order[i];
+
+                for (auto e: graph.out_edges(u)) {
+                    int v = graph.head(e);
+                    int l = e % graph.labels.size();
+                    double w = weight(e);
+
+                    beta[u] = log_add(get(beta, u), w + get(beta, v));
+
+                    for (int k = 0; k < label_seq.size(); ++k) {
+                        if (label_seq[k] == l) {
+                            long s = u * nstate + k;
+                            gold_beta[s] = log_add(get(gold_beta, s),
+                                w + get(gold_beta, v * nstate + k + 1));
+                        }
+                    }
+                }
+            }
+
+            log_z = get(alpha, final);
+            gold_log_z = get(gold_alpha, final * nstate + label_seq.size());
+        }
+
+        int index(int e) const
+        {
+            int u = graph.tail(e);
+            int len = graph.time(graph.head(e)) - graph.time(u);
+            return (u * graph.max_seg + len - 1) * graph.labels.size() + e % graph.labels.size();
+        }
+
+        double weight(int e) const
+        {
+            return scores[index(e)];
+        }
+
+        void grad(std::vector<double>& score_grad) const
+        {
+            for (auto e: graph.edges()) {
+                int u = graph.tail(e);
+                int v = graph.head(e);
+                int l = e % graph.labels.size();
+                double w = weight(e);
+
+                double g = std::exp(get(alpha, u) + w + get(beta, v) - log_z);
+
+                for (int k = 0; k < label_seq.size(); ++k) {
+                    if (label_seq[k] == l) {
+                        g -= std::exp(get(gold_alpha, u * nstate + k) + w
+                            + get(gold_beta, v * nstate + k + 1) - gold_log_z);
+                    }
+                }
+
+                score_grad[index(e)] += g;
+            }
+        }
+    };
+
+    /*
+     * Weights of the edges of seg::make_graph read from the dense
+     * scores, with the gradient added back into score_grad.  The
+     * vertices of seg::make_graph are numbered the same as those of
+     * seg_graph::fst.
+     */
+    struct dense_weight : public seg::seg_weight<ifst::fst> {
+
+        std::vector<double> const& scores;
+        std::vector<double>& score_grad;
+        int max_seg;
+        int nlabel;
+
+        dense_weight(std::vector<double> const& scores, std::vector<double>& score_grad,
+                int max_seg, int nlabel)
+            : scores(scores), score_grad(score_grad), max_seg(max_seg), nlabel(nlabel)
+        {}
+
+        int index(ifst::fst const& f, int e) const
+        {
+            int u = f.tail(e);
+            int len = f.time(f.head(e)) - f.time(u);
+            return (u * max_seg + len - 1) * nlabel + f.input(e) - 1;
+        }
+
+        virtual double operator()(ifst::fst const& f, int e) const override
+        {
+            return scores[index(f, e)];
+        }
+
+        virtual void accumulate_grad(double g, ifst::fst const& f, int e) const override
+        {
+            score_grad[index(f, e)] += g;
+        }
+    };
+
+    /*
+     * The graph with edge weights read from the dense scores, for the
+     * generic fst algorithms.
+     */
+    struct dense_fst {
+
+        using vertex = int;
+        using edge = int;
+        using symbol = int;
+
+        seg_graph::fst const& graph;
+        std::vector<double> const& scores;
+
+        seg_graph::int_range vertices() const { return graph.vertices(); }
+        seg_graph::int_range edges() const { return graph.edges(); }
+
+        double weight(int e) const
+        {
+            int u = graph.tail(e);
+            int len = graph.time(graph.head(e)) - graph.time(u);
+            return scores[(u * graph.max_seg + len - 1) * graph.labels.size()
+                + e % graph.labels.size()];
+        }
+
+        seg_graph::int_range out_edges(int v) const { return graph.out_edges(v); }
+        seg_graph::in_edge_range in_edges(int v) const { return graph.in_edges(v); }
+
+        int tail(int e) const { return graph.tail(e); }
+        int head(int e) const { return graph.head(e); }
+        int input(int e) const { return graph.input(e); }
+        int output(int e) const { return graph.output(e); }
+
+        std::vector<int> const& initials() const { return graph.initials(); }
+        std::vector<int> const& finals() const { return graph.finals(); }
+
+        int time(int v) const { return graph.time(v); }
+    };
+
+    template <class R1, class R2>
+    bool same_range(R1 const& a, R2 const& b)
+    {
+        return std::vector<int>(a.begin(), a.end()) == std::vector<int>(b.begin(), b.end());
+    }
+
+    /*
+     * Empty when graph is the graph of seg::make_graph with the same
+     * vertex and edge ids, otherwise the first difference.
+     */
+    std::string diff_graph(seg_graph::fst const& graph, ifst::fst const& ref,
+        std::vector<int> const& ref_order)
+    {
+        if (graph.vertices().size() != ref.vertices().size()) {
+            return "vertex counts " + std::to_string(graph.vertices().size())
+                + " and " + std::to_string(ref.vertices().size());
+        }
+
+        if (graph.edges().size() != ref.edges().size()) {
+            return "edge counts " + std::to_string(graph.edges().size())
+                + " and " + std::to_string(ref.edges().size());
+        }
+
+        if (graph.initials() != ref.initials() || graph.finals() != ref.finals()) {
+            return "initial or final vertices";
+        }
+
+        for (auto v: graph.vertices()) {
+            if (graph.time(v) != ref.time(v)) {
+                return "time of vertex " + std::to_string(v);
+            }
+
+            if (!same_range(graph.out_edges(v), ref.out_edges(v))) {
+                return "out-edges of vertex " + std::to_string(v);
+            }
+
+            if (!same_range(graph.in_edges(v), ref.in_edges(v))) {
+                return "in-edges of vertex " + std::to_string(v);
+            }
+        }
+
+        for (auto e: graph.edges()) {
+            if (graph.tail(e) != ref.tail(e) || graph.head(e) != ref.head(e)
+                    || graph.input(e) != ref.input(e) || graph.output(e) != ref.output(e)) {
+                return "edge " + std::to_string(e);
+            }
+        }
+
+        if (seg_graph::topo_order(graph) != ref_order) {
+            return "topological order";
+        }
+
+        return "";
+    }
+
+    template <class F>
+    double time_it(int repeat, F f)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < repeat; ++i) {
+            f();
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double>(end - start).count() / repeat;
+    }
+
+    template <class T>
+    double max_diff(std::vector<T> const& a, std::vector<double> const& b)
+    {
+        double result = 0;
+
+        for (int i = 0; i < a.size(); ++i) {
+            result = std::max(result, std::fabs(a[i] - b[i]));
+        }
+
+        return result;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    ebt::ArgumentSpec spec {
+        "seg-fb-bench",
+        "Benchmark the dense segmental forward-backward and Viterbi against seg and edge-by-edge ones",
+        {
+            {"frames", "default: 300", false},
+            {"labels", "default: 60", false},
+            {"gold-len", "default: 40", false},
+            {"min-seg", "default: 1", false},
+            {"max-seg", "default: 20", false},
+            {"stride", "default: 1", false},
+            {"repeat", "default: 5", false},
+            {"seed", "default: 1", false},
+        }
+    };
+
+    if (argc == 1) {
+        ebt::usage(spec);
+        exit(1);
+    }
+
+    auto args = ebt::parse_args(argc, argv, spec);
+
+    int nframes = 300;
+    if (ebt::in(std::string("frames"), args)) {
+        nframes = std::stoi(args.at("frames"));
+    }
+
+    int nlabel = 60;
+    if (ebt::in(std::string("labels"), args)) {
+        nlabel = std::stoi(args.at("labels"));
+    }
+
+    int gold_len = 40;
+    if (ebt::in(std::string("gold-len"), args)) {
+        gold_len = std::stoi(args.at("gold-len"));
+    }
+
+    int min_seg = 1;
+    if (ebt::in(std::string("min-seg"), args)) {
+        min_seg = std::stoi(args.at("min-seg"));
+    }
+
+    int max_seg = 20;
+    if (ebt::in(std::string("max-seg"), args)) {
+        max_seg = std::stoi(args.at("max-seg"));
+    }
+
+    int stride = 1;
+    if (ebt::in(std::string("stride"), args)) {
+        stride = std::stoi(args.at("stride"));
+    }
+
+    int repeat = 5;
+    if (ebt::in(std::string("repeat"), args)) {
+        repeat = std::stoi(args.at("repeat"));
+    }
+
+    int seed = 1;
+    if (ebt::in(std::string("seed"), args)) {
+        seed = std::stoi(args.at("seed"));
+    }
+
+    std::default_random_engine gen { (unsigned int) seed };
+
+    std::vector<std::string> id_label { "<eps>" };
+    std::unordered_map<std::string, int> label_id { {"<eps>", 0} };
+    for (int i = 1; i <= nlabel; ++i) {
+        id_label.push_back("l" + std::to_string(i));
+        label_id[id_label.back()] = i;
+    }
+
+    seg_graph::fst graph { nframes, label_id, id_label, min_seg, max_seg, stride };
+
+    std::normal_distribution<double> normal;
+    std::vector<double> scores((graph.vertices().size() * max_seg) * nlabel);
+    for (auto& s: scores) {
+        s = normal(gen);
+    }
+
+    std::uniform_int_distribution<int> uniform { 1, nlabel };
+    std::vector<int> label_seq;
+    for (int i = 0; i < gold_len; ++i) {
+        label_seq.push_back(uniform(gen));
+    }
+
+    std::vector<int> label_index;
+    for (auto& ell: label_seq) {
+        label_index.push_back(ell - 1);
+    }
+
+    std::cout << "frames: " << nframes << " labels: " << nlabel
+        << " gold len: " << gold_len << " edges: " << graph.edges().size() << std::endl;
+
+    std::vector<double> seg_grad(scores.size());
+    std::vector<double> ref_grad(scores.size());
+    std::vector<double> exact_grad(scores.size());
+    std::vector<double> fast_grad(scores.size());
+
+    std::vector<float> scores_float(scores.begin(), scores.end());
+    std::vector<float> float_grad(scores.size());
+
+    double seg_loss;
+    double ref_loss;
+    double exact_loss;
+    double fast_loss;
+    double float_loss;
+
+    seg::iseg_data graph_data;
+    graph_data.fst = seg::make_graph(nframes, label_id, id_label, min_seg, max_seg, stride);
+    graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+    graph_data.weight_func = std::make_shared<dense_weight>(scores, seg_grad, max_seg, nlabel);
+
+    std::string graph_diff = diff_graph(graph, *graph_data.fst, *graph_data.topo_order);
+
+    if (graph_diff != "") {
+        std::cerr << "seg_graph::fst and seg::make_graph differ in " << graph_diff << std::endl;
+        return 1;
+    }
+
+    ifst::fst label_fst = seg::make_label_fst(label_seq, label_id, id_label);
+
+    double seg_time = time_it(repeat, [&]() {
+        seg::marginal_log_loss loss { graph_data, label_fst };
+        std::fill(seg_grad.begin(), seg_grad.end(), 0);
+        seg_loss = loss.loss();
+        loss.grad();
+    });
+
+    double ref_time = time_it(repeat, [&]() {
+        edge_walk ref { graph, scores, label_index };
+        std::fill(ref_grad.begin(), ref_grad.end(), 0);
+        ref.grad(ref_grad);
+        ref_loss = ref.log_z - ref.gold_log_z;
+    });
+
+    double exact_time = time_it(repeat, [&]() {
+        seg_fb::marginal_log_loss loss { graph, scores, label_seq, false };
+        std::fill(exact_grad.begin(), exact_grad.end(), 0);
+        loss.grad(exact_grad);
+        exact_loss = loss.loss();
+    });
+
+    double fast_time = time_it(repeat, [&]() {
+        seg_fb::marginal_log_loss loss { graph, scores, label_seq, true };
+        std::fill(fast_grad.begin(), fast_grad.end(), 0);
+        loss.grad(fast_grad);
+        fast_loss = loss.loss();
+    });
+
+    double float_time = time_it(repeat, [&]() {
+        seg_fb::basic_marginal_log_loss<float> loss { graph, scores_float, label_seq, true };
+        std::fill(float_grad.begin(), float_grad.end(), 0);
+        loss.grad(float_grad);
+        float_loss = loss.loss();
+    });
+
+    std::cout << "seg: " << seg_time << "s loss: " << seg_loss << std::endl;
+    std::cout << "edge walk: " << ref_time << "s loss: " << ref_loss
+        << " loss diff: " << std::fabs(ref_loss - seg_loss)
+        << " max grad diff: " << max_diff(ref_grad, seg_grad) << std::endl;
+    std::cout << "dense exact: " << exact_time << "s loss: " << exact_loss
+        << " loss diff: " << std::fabs(exact_loss - seg_loss)
+        << " max grad diff: " << max_diff(exact_grad, seg_grad) << std::endl;
+    std::cout << "dense fast exp: " << fast_time << "s loss: " << fast_loss
+        << " loss diff: " << std::fabs(fast_loss - seg_loss)
+        << " max grad diff: " << max_diff(fast_grad, seg_grad) << std::endl;
+    std::cout << "dense float: " << float_time << "s loss: " << float_loss
+        << " loss diff: " << std::fabs(float_loss - seg_loss)
+        << " max grad diff: " << max_diff(float_grad, seg_grad) << std::endl;
+    std::cout << "speedup: " << seg_time / fast_time
+        << " float speedup: " << seg_time / float_time << std::endl;
+
+    if (std::fabs(exact_loss - seg_loss) > 1e-6 * std::max(1.0, std::fabs(seg_loss))
+            || max_diff(exact_grad, seg_grad) > 1e-6) {
+        std::cerr << "dense forward-backward and seg::marginal_log_loss disagree" << std::endl;
+        return 1;
+    }
+
+    std::vector<int> order = seg_graph::topo_order(graph);
+
+    // rounded scores make many paths tie exactly, and zero scores make
+    // every path tie, so that the two agree on ties as well
+    std::vector<double> rounded_scores;
+    for (auto& s: scores) {
+        rounded_scores.push_back(std::round(2 * s));
+    }
+
+    std::vector<double> zero_scores(scores.size());
+
+    std::vector<std::pair<std::string, std::vector<double> const*>> cases {
+        {"random", &scores}, {"rounded", &rounded_scores}, {"zero", &zero_scores} };
+
+    for (auto& c: cases) {
+        dense_fst ref_graph { graph, *c.second };
+
+        std::vector<int> ref_path;
+        std::vector<int> path;
+
+        double shortest_path_time = time_it(repeat, [&]() {
+            ref_path = fst::shortest_path(ref_graph, order);
+        });
+
+        double viterbi_time = time_it(repeat, [&]() {
+            path = seg_viterbi::best_path(graph, *c.second);
+        });
+
+        std::cout << c.first << " scores: shortest path: " << shortest_path_time << "s"
+            << " dense viterbi: " << viterbi_time << "s"
+            << " speedup: " << shortest_path_time / viterbi_time << std::endl;
+
+        if (path != ref_path) {
+            std::cerr << "dense viterbi and shortest path disagree on "
+                << c.first << " scores" << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
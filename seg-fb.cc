@@ -0,0 +1,387 @@
+#include "segbin/seg-fb.h"
+#include "segbin/workspace.h"
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+namespace seg_fb {
+
+    double fast_exp(double x)
+    {
+        double const log2e = 1.4426950408889634;
+        double const ln2_hi = 6.93145751953125e-1;
+        double const ln2_lo = 1.42860682030941723212e-6;
+
+        // the clamps below would turn NaN into a number, or pass it on
+        // to the integer conversion of n
+        if (std::isnan(x)) {
+            return x;
+        }
+
+        double c = std::max(x, -708.0);
+        c = std::min(c, 709.0);
+
+        double n = std::floor(c * log2e + 0.5);
+        double r = c - n * ln2_hi - n * ln2_lo;
+
+        double p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24
+            + r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040)))))));
+
+        std::int64_t bits = (static_cast<std::int64_t>(n) + 1023) << 52;
+        double scale;
+        std::memcpy(&scale, &bits, sizeof(double));
+
+        return x < -708.0 ? 0.0 : p * scale;
+    }
+
+    float fast_exp(float x)
+    {
+        float const log2e = 1.44269504f;
+        float const ln2_hi = 6.93145752e-1f;
+        float const ln2_lo = 1.42860677e-6f;
+
+        if (std::isnan(x)) {
+            return x;
+        }
+
+        float c = std::max(x, -87.0f);
+        c = std::min(c, 88.0f);
+
+        float n = std::floor(c * log2e + 0.5f);
+        float r = c - n * ln2_hi - n * ln2_lo;
+
+        float p = 1.0f + r * (1.0f + r * (1.0f / 2 + r * (1.0f / 6 + r * (1.0f / 24
+            + r * (1.0f / 120 + r * (1.0f / 720))))));
+
+        std::int32_t bits = (static_cast<std::int32_t>(n) + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(float));
+
+        return x < -87.0f ? 0.0f : p * scale;
+    }
+
+    namespace {
+
+        inline double exp_(double x, bool fast)
+        {
+            return fast ? fast_exp(x) : std::exp(x);
+        }
+
+        inline float exp_(float x, bool fast)
+        {
+            return fast ? fast_exp(x) : std::exp(x);
+        }
+
+        double const inf = std::numeric_limits<double>::infinity();
+
+    }
+
+    template <class T>
+    T log_sum_exp(T const *v, int n, bool fast)
+    {
+        T m = -inf;
+
+        for (int i = 0; i < n; ++i) {
+            m = std::max(m, v[i]);
+        }
+
+        if (m == -inf) {
+            return -inf;
+        }
+
+        T sum = 0;
+
+        if (fast) {
+            for (int i = 0; i < n; ++i) {
+                sum += fast_exp(v[i] - m);
+            }
+        } else {
+            for (int i = 0; i < n; ++i) {
+                sum += std::exp(v[i] - m);
+            }
+        }
+
+        return m + std::log(sum);
+    }
+
+    template float log_sum_exp(float const *v, int n, bool fast);
+    template double log_sum_exp(double const *v, int n, bool fast);
+
+    template <class T>
+    basic_marginal_log_loss<T>::basic_marginal_log_loss(seg_graph::fst const& graph,
+            std::vector<T> const& scores,
+            std::vector<int> const& label_seq,
+            bool fast)
+        : graph(graph), scores(scores), fast(fast)
+    {
+        max_seg = graph.max_seg;
+        nlabel = graph.labels.size();
+
+        for (auto& ell: label_seq) {
+            auto i = std::find(graph.labels.begin(), graph.labels.end(), ell);
+
+            if (i == graph.labels.end()) {
+                throw std::logic_error("label " + std::to_string(ell) + " not in graph");
+            }
+
+            this->label_seq.push_back(i - graph.labels.begin());
+        }
+
+        nstate = this->label_seq.size() + 1;
+
+        forward();
+        backward();
+        gold_forward();
+        gold_backward();
+    }
+
+    template <class T>
+    basic_marginal_log_loss<T>::~basic_marginal_log_loss()
+    {
+        workspace::local<T>().put(std::move(alpha));
+        workspace::local<T>().put(std::move(beta));
+        workspace::local<T>().put(std::move(gold_alpha));
+        workspace::local<T>().put(std::move(gold_beta));
+    }
+
+    template <class T>
+    int basic_marginal_log_loss<T>::index(int tail, int length, int label) const
+    {
+        return (tail * max_seg + length - 1) * nlabel + label;
+    }
+
+    template <class T>
+    void basic_marginal_log_loss<T>::forward()
+    {
+        int nvertex = graph.vertices().size();
+
+        alpha = workspace::local<T>().get(nvertex, -inf);
+        alpha[0] = 0;
+
+        std::vector<T> buf = workspace::local<T>().get(max_seg * nlabel, 0);
+
+        for (int v = 1; v < nvertex; ++v) {
+            int first = graph.first_tail(v);
+            int last = graph.last_tail(v);
+
+            buf.resize(std::max(0, last - first) * nlabel);
+            int n = 0;
+
+            for (int u = first; u < last; ++u) {
+                T a = alpha[u];
+                T const *s = &scores[index(u, graph.time(v) - graph.time(u), 0)];
+
+                for (int l = 0; l < nlabel; ++l) {
+                    buf[n + l] = a + s[l];
+                }
+
+                n += nlabel;
+            }
+
+            alpha[v] = log_sum_exp(buf.data(), n, fast);
+        }
+
+        workspace::local<T>().put(std::move(buf));
+
+        log_z = alpha.back();
+    }
+
+    template <class T>
+    void basic_marginal_log_loss<T>::backward()
+    {
+        int nvertex = graph.vertices().size();
+
+        beta = workspace::local<T>().get(nvertex, -inf);
+        beta.back() = 0;
+
+        std::vector<T> buf = workspace::local<T>().get(max_seg * nlabel, 0);
+
+        for (int u = nvertex - 2; u >= 0; --u) {
+            seg_graph::int_range r = graph.out_edges(u);
+
+            buf.resize(r.size());
+            int n = 0;
+
+            for (int e = r.first; e < r.last; e += nlabel) {
+                int v = graph.head(e);
+                T b = beta[v];
+                T const *s = &scores[index(u, graph.time(v) - graph.time(u), 0)];
+
+                for (int l = 0; l < nlabel; ++l) {
+                    buf[n + l] = s[l] + b;
+                }
+
+                n += nlabel;
+            }
+
+            beta[u] = log_sum_exp(buf.data(), n, fast);
+        }
+
+        workspace::local<T>().put(std::move(buf));
+    }
+
+    template <class T>
+    void basic_marginal_log_loss<T>::gold_forward()
+    {
+        int nvertex = graph.vertices().size();
+        int nlab = nstate - 1;
+
+        gold_alpha = workspace::local<T>().get(nvertex * nstate, -inf);
+        gold_alpha[0] = 0;
+
+        std::vector<T> m(nlab);
+        std::vector<T> sum(nlab);
+        std::vector<T> x(nlab);
+
+        for (int v = 1; v < nvertex; ++v) {
+            int first = graph.first_tail(v);
+            int last = graph.last_tail(v);
+
+            std::fill(m.begin(), m.end(), -inf);
+
+            for (int u = first; u < last; ++u) {
+                T const *a = &gold_alpha[u * nstate];
+                T const *s = &scores[index(u, graph.time(v) - graph.time(u), 0)];
+
+                for (int k = 0; k < nlab; ++k) {
+                    m[k] = std::max(m[k], a[k] + s[label_seq[k]]);
+                }
+            }
+
+            for (int k = 0; k < nlab; ++k) {
+                if (m[k] == -inf) {
+                    m[k] = 0;
+                }
+            }
+
+            std::fill(sum.begin(), sum.end(), 0);
+
+            for (int u = first; u < last; ++u) {
+                T const *a = &gold_alpha[u * nstate];
+                T const *s = &scores[index(u, graph.time(v) - graph.time(u), 0)];
+
+                for (int k = 0; k < nlab; ++k) {
+                    x[k] = a[k] + s[label_seq[k]] - m[k];
+                }
+
+                for (int k = 0; k < nlab; ++k) {
+                    sum[k] += exp_(x[k], fast);
+                }
+            }
+
+            T *a_v = &gold_alpha[v * nstate];
+
+            for (int k = 0; k < nlab; ++k) {
+                a_v[k + 1] = sum[k] == 0 ? -inf : m[k] + std::log(sum[k]);
+            }
+        }
+
+        gold_log_z = gold_alpha[(nvertex - 1) * nstate + nlab];
+    }
+
+    template <class T>
+    void basic_marginal_log_loss<T>::gold_backward()
+    {
+        int nvertex = graph.vertices().size();
+        int nlab = nstate - 1;
+
+        gold_beta = workspace::local<T>().get(nvertex * nstate, -inf);
+        gold_beta[(nvertex - 1) * nstate + nlab] = 0;
+
+        std::vector<T> m(nlab);
+        std::vector<T> sum(nlab);
+        std::vector<T> x(nlab);
+
+        for (int u = nvertex - 2; u >= 0; --u) {
+            seg_graph::int_range r = graph.out_edges(u);
+
+            std::fill(m.begin(), m.end(), -inf);
+
+            for (int e = r.first; e < r.last; e += nlabel) {
+                int v = graph.head(e);
+                T const *b = &gold_beta[v * nstate + 1];
+                T const *s = &scores[index(u, graph.time(v) - graph.time(u), 0)];
+
+                for (int k = 0; k < nlab; ++k) {
+                    m[k] = std::max(m[k], s[label_seq[k]] + b[k]);
+                }
+            }
+
+            for (int k = 0; k < nlab; ++k) {
+                if (m[k] == -inf) {
+                    m[k] = 0;
+                }
+            }
+
+            std::fill(sum.begin(), sum.end(), 0);
+
+            for (int e = r.first; e < r.last; e += nlabel) {
+                int v = graph.head(e);
+                T const *b = &gold_beta[v * nstate + 1];
+                T const *s = &scores[index(u, graph.time(v) - graph.time(u), 0)];
+
+                for (int k = 0; k < nlab; ++k) {
+                    x[k] = s[label_seq[k]] + b[k] - m[k];
+                }
+
+                for (int k = 0; k < nlab; ++k) {
+                    sum[k] += exp_(x[k], fast);
+                }
+            }
+
+            T *b_u = &gold_beta[u * nstate];
+
+            for (int k = 0; k < nlab; ++k) {
+                b_u[k] = sum[k] == 0 ? -inf : m[k] + std::log(sum[k]);
+            }
+        }
+    }
+
+    template <class T>
+    double basic_marginal_log_loss<T>::loss() const
+    {
+        return log_z - gold_log_z;
+    }
+
+    template <class T>
+    void basic_marginal_log_loss<T>::grad(std::vector<T>& score_grad, double scale) const
+    {
+        int nvertex = graph.vertices().size();
+        int nlab = nstate - 1;
+
+        for (int u = 0; u < nvertex - 1; ++u) {
+            seg_graph::int_range r = graph.out_edges(u);
+
+            for (int e = r.first; e < r.last; e += nlabel) {
+                int v = graph.head(e);
+                int k0 = index(u, graph.time(v) - graph.time(u), 0);
+                T const *s = &scores[k0];
+                T *g = &score_grad[k0];
+
+                if (log_z != -inf) {
+                    T c = alpha[u] + beta[v] - log_z;
+
+                    for (int l = 0; l < nlabel; ++l) {
+                        g[l] += scale * exp_(c + s[l], fast);
+                    }
+                }
+
+                if (gold_log_z != -inf) {
+                    T const *a = &gold_alpha[u * nstate];
+                    T const *b = &gold_beta[v * nstate + 1];
+
+                    for (int k = 0; k < nlab; ++k) {
+                        g[label_seq[k]] -= scale * exp_(a[k] + s[label_seq[k]] + b[k] - gold_log_z, fast);
+                    }
+                }
+            }
+        }
+    }
+
+    template struct basic_marginal_log_loss<float>;
+    template struct basic_marginal_log_loss<double>;
+
+}
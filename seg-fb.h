@@ -0,0 +1,98 @@
+#ifndef SEG_FB_H
+#define SEG_FB_H
+
+#include <vector>
+#include "segbin/seg-graph.h"
+
+namespace seg_fb {
+
+    /*
+     * exp(x) by range reduction to |r| <= ln 2 / 2 and a degree 7
+     * polynomial, with a relative error below 1e-8.  Inputs below -708
+     * give 0, which drops the denormal range, and inputs above 709 are
+     * clamped to exp(709).  NaN is returned as is.
+     */
+    double fast_exp(double x);
+
+    /*
+     * Single precision fast_exp with a degree 6 polynomial, accurate to
+     * a few ulps.  Inputs below -87 give 0, inputs above 88 are clamped
+     * to exp(88), and NaN is returned as is.
+     */
+    float fast_exp(float x);
+
+    /*
+     * log sum_i exp(v[i]) for the first n values, -inf for n == 0
+     * or when all values are -inf.  Defined for float and double.
+     */
+    template <class T>
+    T log_sum_exp(T const *v, int n, bool fast);
+
+    /*
+     * Marginal log loss of a zeroth-order segmental model,
+     *
+     *   log Z - log Z(label_seq),
+     *
+     * where Z sums over all paths of the graph and Z(label_seq) over
+     * all segmentations of label_seq.  Scores are read from a dense
+     * nvertex x max_seg x nlabel tensor with the layout of
+     * seg_score::scorer.
+     *
+     * Forward and backward scores of the whole graph are kept per
+     * vertex, and those of the gold segmentations in a dense
+     * nvertex x (len(label_seq) + 1) array, so that the inner loops run
+     * over contiguous memory.
+     *
+     * T is the type of the scores and of the dynamic programs, either
+     * float or double.  The loss is returned in double either way.
+     * The tables are taken from the workspace pool of the thread.
+     */
+    template <class T>
+    struct basic_marginal_log_loss {
+
+        seg_graph::fst const& graph;
+        std::vector<T> const& scores;
+
+        // label indices in the graph, not label ids
+        std::vector<int> label_seq;
+
+        bool fast;
+
+        std::vector<T> alpha;
+        std::vector<T> beta;
+        std::vector<T> gold_alpha;
+        std::vector<T> gold_beta;
+
+        T log_z;
+        T gold_log_z;
+
+        basic_marginal_log_loss(seg_graph::fst const& graph,
+            std::vector<T> const& scores,
+            std::vector<int> const& label_seq,
+            bool fast = true);
+
+        ~basic_marginal_log_loss();
+
+        double loss() const;
+
+        // adds scale times the gradient of the loss to score_grad
+        void grad(std::vector<T>& score_grad, double scale = 1) const;
+
+    private:
+        int max_seg;
+        int nlabel;
+        int nstate;
+
+        int index(int tail, int length, int label) const;
+
+        void forward();
+        void backward();
+        void gold_forward();
+        void gold_backward();
+    };
+
+    typedef basic_marginal_log_loss<double> marginal_log_loss;
+
+}
+
+#endif
@@ -0,0 +1,225 @@
+#include "segbin/seg-graph.h"
+#include <algorithm>
+
+namespace seg_graph {
+
+    int in_edge_range::iterator::operator*() const
+    {
+        return f->edge_id(tail, head, label);
+    }
+
+    in_edge_range::iterator& in_edge_range::iterator::operator++()
+    {
+        ++label;
+
+        if (label == f->labels.size()) {
+            label = 0;
+            ++tail;
+        }
+
+        return *this;
+    }
+
+    in_edge_range::iterator in_edge_range::begin() const
+    {
+        if (f->labels.size() == 0) {
+            return end();
+        }
+
+        return iterator { f, head, first_tail, 0 };
+    }
+
+    in_edge_range::iterator in_edge_range::end() const
+    {
+        return iterator { f, head, std::max(first_tail, last_tail), 0 };
+    }
+
+    int in_edge_range::size() const
+    {
+        return std::max(0, last_tail - first_tail) * f->labels.size();
+    }
+
+    fst::fst(int nframes, std::unordered_map<std::string, int> const& label_id,
+            std::vector<std::string> const& id_label,
+            int min_seg, int max_seg, int stride)
+        : nframes(nframes), min_seg(min_seg), max_seg(max_seg), stride(stride)
+    {
+        for (int i = 0; i < id_label.size(); ++i) {
+            if (id_label[i] != "<eps>") {
+                labels.push_back(label_id.at(id_label[i]));
+            }
+        }
+
+        nvertex = (nframes + stride - 1) / stride + 1;
+
+        min_step = std::max(1, (min_seg + stride - 1) / stride);
+        max_step = max_seg / stride;
+
+        offset.resize(nvertex + 1);
+        offset[0] = 0;
+
+        for (int u = 0; u < nvertex; ++u) {
+            int n = std::max(0, last_head(u) - first_head(u) + 1);
+            offset[u + 1] = offset[u] + n * labels.size();
+        }
+
+        int per_tail = (max_step - min_step + 1) * labels.size();
+
+        regular_tails = 0;
+
+        while (per_tail > 0 && regular_tails < nvertex
+                && offset[regular_tails + 1] - offset[regular_tails] == per_tail
+                && last_head(regular_tails) == regular_tails + max_step) {
+            ++regular_tails;
+        }
+
+        initial.push_back(0);
+        final.push_back(nvertex - 1);
+    }
+
+    int fst::time(int v) const
+    {
+        return std::min(v * stride, nframes);
+    }
+
+    int fst::first_head(int u) const
+    {
+        int j = u + min_step;
+
+        if (j < nvertex - 1) {
+            return j;
+        }
+
+        if (u < nvertex - 1 && nframes - time(u) >= min_seg) {
+            return nvertex - 1;
+        }
+
+        return nvertex;
+    }
+
+    int fst::last_head(int u) const
+    {
+        if (u < nvertex - 1 && nframes - time(u) <= max_seg) {
+            return nvertex - 1;
+        }
+
+        return std::min(u + max_step, nvertex - 2);
+    }
+
+    int fst::first_tail(int v) const
+    {
+        if (v == nvertex - 1) {
+            int diff = nframes - max_seg;
+            return std::max(0, diff <= 0 ? 0 : (diff + stride - 1) / stride);
+        } else {
+            return std::max(0, v - max_step);
+        }
+    }
+
+    int fst::last_tail(int v) const
+    {
+        if (v == nvertex - 1) {
+            int diff = nframes - min_seg;
+            return diff < 0 ? 0 : std::min(v, diff / stride + 1);
+        } else {
+            return std::max(0, v - min_step + 1);
+        }
+    }
+
+    int_range fst::vertices() const
+    {
+        return int_range { 0, nvertex };
+    }
+
+    int_range fst::edges() const
+    {
+        return int_range { 0, offset.back() };
+    }
+
+    double fst::weight(int e) const
+    {
+        return 0;
+    }
+
+    int_range fst::out_edges(int v) const
+    {
+        return int_range { offset[v], offset[v + 1] };
+    }
+
+    in_edge_range fst::in_edges(int v) const
+    {
+        return in_edge_range { this, v, first_tail(v), last_tail(v) };
+    }
+
+    int fst::tail(int e) const
+    {
+        if (e < offset[regular_tails]) {
+            return e / ((max_step - min_step + 1) * labels.size());
+        }
+
+        return std::upper_bound(offset.begin() + regular_tails, offset.end(), e)
+            - offset.begin() - 1;
+    }
+
+    int fst::head(int e) const
+    {
+        int u = tail(e);
+
+        return first_head(u) + (e - offset[u]) / labels.size();
+    }
+
+    int fst::input(int e) const
+    {
+        return labels[e % labels.size()];
+    }
+
+    int fst::output(int e) const
+    {
+        return labels[e % labels.size()];
+    }
+
+    std::vector<int> const& fst::initials() const
+    {
+        return initial;
+    }
+
+    std::vector<int> const& fst::finals() const
+    {
+        return final;
+    }
+
+    int fst::edge_id(int u, int v, int l) const
+    {
+        return offset[u] + (v - first_head(u)) * labels.size() + l;
+    }
+
+    std::shared_ptr<fst> make_graph(int nframes,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int min_seg, int max_seg, int stride)
+    {
+        return std::make_shared<fst>(fst { nframes, label_id, id_label,
+            min_seg, max_seg, stride });
+    }
+
+    std::vector<int> topo_order(fst const& f)
+    {
+        std::vector<int> result;
+
+        for (auto v: f.vertices()) {
+            result.push_back(v);
+        }
+
+        return result;
+    }
+
+    weight::~weight()
+    {}
+
+    void weight::accumulate_grad(double g, fst const& f, int e) const
+    {}
+
+    void weight::grad() const
+    {}
+
+}
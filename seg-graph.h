@@ -0,0 +1,191 @@
+#ifndef SEG_GRAPH_H
+#define SEG_GRAPH_H
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <iterator>
+#include <cstddef>
+
+namespace seg_graph {
+
+    /*
+     * Consecutive ints, usable in range-based for loops in place of
+     * the edge and vertex vectors of ifst::fst.
+     */
+    struct int_range {
+
+        struct iterator {
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = int;
+            using difference_type = std::ptrdiff_t;
+            using pointer = int const*;
+            using reference = int;
+
+            int i;
+
+            int operator*() const { return i; }
+            iterator& operator++() { ++i; return *this; }
+            iterator operator++(int) { iterator r = *this; ++i; return r; }
+            bool operator==(iterator const& that) const { return i == that.i; }
+            bool operator!=(iterator const& that) const { return i != that.i; }
+        };
+
+        int first;
+        int last;
+
+        iterator begin() const { return iterator { first }; }
+        iterator end() const { return iterator { last }; }
+        int size() const { return last - first; }
+    };
+
+    struct fst;
+
+    /*
+     * Edges entering a vertex.  They come in blocks of one edge per
+     * label, one block for each tail, and are generated on the fly.
+     */
+    struct in_edge_range {
+
+        struct iterator {
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = int;
+            using difference_type = std::ptrdiff_t;
+            using pointer = int const*;
+            using reference = int;
+
+            fst const *f;
+            int head;
+            int tail;
+            int label;
+
+            int operator*() const;
+            iterator& operator++();
+            bool operator==(iterator const& that) const
+            { return tail == that.tail && label == that.label; }
+            bool operator!=(iterator const& that) const
+            { return !(*this == that); }
+        };
+
+        fst const *f;
+        int head;
+        int first_tail;
+        int last_tail;
+
+        iterator begin() const;
+        iterator end() const;
+        int size() const;
+    };
+
+    /*
+     * The segment graph of seg::make_graph without materialized edges.
+     *
+     * Vertex i sits at time min(i * stride, nframes), and there is one
+     * edge per label, <eps> excluded, from i to every later vertex j
+     * with min_seg <= time(j) - time(i) <= max_seg.  Edges are numbered
+     * by tail, then by head, then by label, so the out-edges of a vertex
+     * are consecutive ids and everything else is computed from the id.
+     *
+     * The only storage is the first edge id of each vertex, which makes
+     * edge ids dense.  Vertex ids are already in time order, which is a
+     * topological order.
+     */
+    struct fst {
+
+        using vertex = int;
+        using edge = int;
+        using symbol = int;
+
+        fst(int nframes, std::unordered_map<std::string, int> const& label_id,
+            std::vector<std::string> const& id_label,
+            int min_seg, int max_seg, int stride);
+
+        int nframes;
+        int min_seg;
+        int max_seg;
+        int stride;
+
+        // label ids, <eps> excluded
+        std::vector<int> labels;
+
+        int_range vertices() const;
+        int_range edges() const;
+
+        double weight(int e) const;
+        int_range out_edges(int v) const;
+        in_edge_range in_edges(int v) const;
+
+        int tail(int e) const;
+        int head(int e) const;
+        int input(int e) const;
+        int output(int e) const;
+
+        std::vector<int> const& initials() const;
+        std::vector<int> const& finals() const;
+
+        int time(int v) const;
+
+        // the first and one past the last tail of edges entering v
+        int first_tail(int v) const;
+        int last_tail(int v) const;
+
+        // id of the edge from u to v with the label of index l
+        int edge_id(int u, int v, int l) const;
+
+    private:
+        int nvertex;
+
+        // steps, in vertices, of the segments of an interior tail
+        int min_step;
+        int max_step;
+
+        // offset[u] is the id of the first out-edge of u
+        std::vector<int> offset;
+
+        // tails below this one have all of their segments
+        int regular_tails;
+
+        std::vector<int> initial;
+        std::vector<int> final;
+
+        int first_head(int u) const;
+        int last_head(int u) const;
+    };
+
+    std::shared_ptr<fst> make_graph(int nframes,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int min_seg, int max_seg, int stride);
+
+    std::vector<int> topo_order(fst const& f);
+
+    /*
+     * Edge weights of the graph, the counterpart of the weight functions
+     * of seg::iseg_data.
+     */
+    struct weight {
+
+        virtual ~weight();
+
+        virtual double operator()(fst const& f, int e) const = 0;
+
+        virtual void accumulate_grad(double g, fst const& f, int e) const;
+
+        virtual void grad() const;
+
+    };
+
+    /*
+     * Same fields as seg::iseg_data, with the implicit graph in place
+     * of ifst::fst.
+     */
+    struct data {
+        std::shared_ptr<seg_graph::fst> fst;
+        std::shared_ptr<std::vector<int>> topo_order;
+        std::shared_ptr<weight> weight_func;
+    };
+
+}
+
+#endif
@@ -0,0 +1,537 @@
+#include "segbin/seg-score.h"
+#include "seg/seg-util.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+namespace seg_score {
+
+    std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
+        std::vector<std::string> const& features)
+    {
+        tensor_tree::vertex root;
+
+        for (auto& k: features) {
+            if (k == "frame-avg" || k == "left-end" || k == "right-end"
+                    || k == "length-indicator" || k == "bias") {
+                root.children.push_back(tensor_tree::make_tensor(k));
+            } else {
+                throw std::logic_error("the dense scorer does not support feature " + k);
+            }
+        }
+
+        return std::make_shared<tensor_tree::vertex>(root);
+    }
+
+    namespace {
+
+        /*
+         * Calls f(start time, length, label index, score) for every edge
+         * of the seg graph of the frames, scored with the weights of
+         * seg::make_weights.
+         */
+        template <class F>
+        void probe(std::vector<std::string> const& features,
+            std::shared_ptr<tensor_tree::vertex> seg_param,
+            std::unordered_map<std::string, int> const& label_id,
+            std::vector<std::string> const& id_label,
+            std::vector<double>& frames, int nframes, int dim, int max_seg, F f)
+        {
+            std::unordered_map<int, int> label_index;
+
+            for (int i = 0; i < id_label.size(); ++i) {
+                if (id_label[i] != "<eps>") {
+                    int l = label_index.size();
+                    label_index[label_id.at(id_label[i])] = l;
+                }
+            }
+
+            autodiff::computation_graph comp_graph;
+            std::shared_ptr<tensor_tree::vertex> var_tree
+                = tensor_tree::make_var_tree(comp_graph, seg_param);
+
+            std::shared_ptr<autodiff::op_t> frame_mat = comp_graph.var(
+                la::cpu::weak_tensor<double>(frames.data(),
+                    { (unsigned int) nframes, (unsigned int) dim }));
+
+            seg::iseg_data graph_data;
+            graph_data.fst = seg::make_graph(nframes, label_id, id_label, 1, max_seg, 1);
+            graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat);
+
+            seg::seg_fst<seg::iseg_data> graph { graph_data };
+
+            for (auto& e: graph.edges()) {
+                int t = graph.time(graph.tail(e));
+                f(t, graph.time(graph.head(e)) - t,
+                    label_index.at(graph.output(e)), graph.weight(e));
+            }
+        }
+
+    }
+
+    std::shared_ptr<tensor_tree::vertex> convert(
+        std::vector<std::string> const& features,
+        std::shared_ptr<tensor_tree::vertex> seg_param,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int hidden_dim, int max_seg)
+    {
+        std::shared_ptr<tensor_tree::vertex> result = make_tensor_tree(features);
+
+        int nlabel = 0;
+        for (auto& k: id_label) {
+            if (k != "<eps>") {
+                ++nlabel;
+            }
+        }
+
+        int probe_seg = std::max(max_seg, 3);
+
+        // c[(len - 1) * nlabel + l], the score of a segment of zero frames
+        std::vector<double> c(probe_seg * nlabel, 0);
+
+        std::vector<double> zeros(probe_seg * hidden_dim, 0);
+
+        probe(features, seg_param, label_id, id_label, zeros, probe_seg, hidden_dim, probe_seg,
+            [&](int t, int len, int l, double w) {
+                if (t == 0) {
+                    c[(len - 1) * nlabel + l] = w;
+                }
+            });
+
+        // frame 3d + 1 is the unit vector of dimension d and the others
+        // are zero, so that, less the constant terms,
+        //
+        //   [3d + 1, 3d + 2)  frame-avg + left-end + right-end
+        //   [3d + 1, 3d + 3)  frame-avg / 2 + left-end
+        //   [3d, 3d + 2)      frame-avg / 2 + right-end
+        //   [3d, 3d + 3)      frame-avg / 3
+        //
+        std::vector<double> units(3 * hidden_dim * hidden_dim, 0);
+        for (int d = 0; d < hidden_dim; ++d) {
+            units[(3 * d + 1) * hidden_dim + d] = 1;
+        }
+
+        std::vector<double> one(hidden_dim * nlabel);
+        std::vector<double> left(hidden_dim * nlabel);
+        std::vector<double> right(hidden_dim * nlabel);
+        std::vector<double> three(hidden_dim * nlabel);
+
+        probe(features, seg_param, label_id, id_label, units, 3 * hidden_dim, hidden_dim, 3,
+            [&](int t, int len, int l, double w) {
+                int k = (t / 3) * nlabel + l;
+                w -= c[(len - 1) * nlabel + l];
+
+                if (t % 3 == 1 && len == 1) {
+                    one[k] = w;
+                } else if (t % 3 == 1 && len == 2) {
+                    left[k] = w;
+                } else if (t % 3 == 0 && len == 2) {
+                    right[k] = w;
+                } else if (t % 3 == 0 && len == 3) {
+                    three[k] = w;
+                }
+            });
+
+        std::vector<double> frame_avg(hidden_dim * nlabel);
+        std::vector<double> left_end(hidden_dim * nlabel);
+        std::vector<double> right_end(hidden_dim * nlabel);
+
+        for (int k = 0; k < hidden_dim * nlabel; ++k) {
+            frame_avg[k] = 3 * three[k];
+            left_end[k] = left[k] - frame_avg[k] / 2;
+            right_end[k] = right[k] - frame_avg[k] / 2;
+
+            double sum = frame_avg[k] + left_end[k] + right_end[k];
+
+            if (std::fabs(one[k] - sum) > 1e-6 * (1 + std::fabs(one[k]))) {
+                throw std::logic_error("segment weights are not the features "
+                    "of the dense scorer");
+            }
+        }
+
+        auto has = [&](std::string const& k) {
+            return std::find(features.begin(), features.end(), k) != features.end();
+        };
+
+        auto set = [&](std::string const& k, std::vector<double> const& v,
+                std::vector<unsigned int> sizes) {
+            int i = std::find(features.begin(), features.end(), k) - features.begin();
+
+            if (i < features.size()) {
+                result->children[i]->data = std::make_shared<la::cpu::tensor<double>>(
+                    la::cpu::tensor<double>(la::cpu::vector<double>(v), sizes));
+                return;
+            }
+
+            // a term without a leaf has to be zero
+            for (auto& x: v) {
+                if (std::fabs(x) > 1e-6) {
+                    throw std::logic_error("segment weights have a " + k
+                        + " term but the feature is not given");
+                }
+            }
+        };
+
+        unsigned int dim = hidden_dim;
+
+        set("frame-avg", frame_avg, { dim, (unsigned int) nlabel });
+        set("left-end", left_end, { dim, (unsigned int) nlabel });
+        set("right-end", right_end, { dim, (unsigned int) nlabel });
+
+        // the length and bias terms only show up summed, so the length
+        // indicator takes both when there is one
+        std::vector<double> length(c.begin(), c.begin() + max_seg * nlabel);
+        std::vector<double> bias(nlabel, 0);
+
+        if (!has("length-indicator")) {
+            std::copy(c.begin(), c.begin() + nlabel, bias.begin());
+
+            for (int k = 0; k < max_seg * nlabel; ++k) {
+                length[k] -= bias[k % nlabel];
+            }
+        }
+
+        set("length-indicator", length, { (unsigned int) max_seg, (unsigned int) nlabel });
+        set("bias", bias, { (unsigned int) nlabel });
+
+        return result;
+    }
+
+    namespace {
+
+        la::cpu::tensor_like<double>& get_grad(std::shared_ptr<autodiff::op_t> op)
+        {
+            if (op->grad == nullptr) {
+                auto& t = autodiff::get_output<la::cpu::tensor_like<double>>(op);
+                la::cpu::tensor<double> g;
+                la::cpu::resize_as(g, t);
+                op->grad = std::make_shared<la::cpu::tensor<double>>(g);
+            }
+
+            return autodiff::get_grad<la::cpu::tensor_like<double>>(op);
+        }
+
+        /*
+         * Calls f(start time, length, index of the first label) for
+         * every segment of the graph.
+         */
+        template <class S, class F>
+        void for_each_segment(S const& s, F f)
+        {
+            for (int u = 0; u < s.nvertex; ++u) {
+                int t = s.graph.time(u);
+                seg_graph::int_range r = s.graph.out_edges(u);
+
+                for (int e = r.first; e < r.last; e += s.nlabel) {
+                    int len = s.graph.time(s.graph.head(e)) - t;
+                    f(t, len, s.index(u, len, 0));
+                }
+            }
+        }
+
+    }
+
+    template <class T>
+    basic_scorer<T>::basic_scorer(std::vector<std::string> const& features,
+            std::shared_ptr<tensor_tree::vertex> var_tree,
+            std::shared_ptr<autodiff::op_t> frames,
+            seg_graph::fst const& graph)
+        : features(features), var_tree(var_tree), frames(frames), graph(graph)
+    {
+        auto& frames_t = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
+
+        if (frames_t.size(0) != graph.nframes) {
+            throw std::logic_error("graph and frames of different lengths");
+        }
+
+        nvertex = graph.vertices().size();
+        max_seg = graph.max_seg;
+        nlabel = graph.labels.size();
+
+        scores = workspace::local<T>().get(nvertex * max_seg * nlabel, 0);
+        score_grad = workspace::local<T>().get(nvertex * max_seg * nlabel, 0);
+
+        std::vector<double> prefix = workspace::local<double>().get((graph.nframes + 1) * nlabel, 0);
+
+        // the frame features share one product of the frames with the
+        // weights of all of them side by side
+        column.assign(features.size(), -1);
+        ncolumn = 0;
+
+        for (int i = 0; i < features.size(); ++i) {
+            if (features[i] == "frame-avg" || features[i] == "left-end"
+                    || features[i] == "right-end") {
+                column[i] = ncolumn;
+                ncolumn += nlabel;
+            }
+        }
+
+        std::vector<double> proj;
+
+        if (ncolumn > 0) {
+            int dim = frames_t.size(1);
+
+            weights = workspace::local<double>().get(dim * ncolumn, 0);
+            proj = workspace::local<double>().get(graph.nframes * ncolumn, 0);
+
+            for (int i = 0; i < features.size(); ++i) {
+                if (column[i] == -1) {
+                    continue;
+                }
+
+                double const *w = autodiff::get_output<la::cpu::tensor_like<double>>(
+                    tensor_tree::get_var(var_tree->children[i])).data();
+
+                for (int d = 0; d < dim; ++d) {
+                    std::copy(w + d * nlabel, w + (d + 1) * nlabel,
+                        weights.data() + d * ncolumn + column[i]);
+                }
+            }
+
+            la::cpu::weak_tensor<double> weights_t { weights.data(),
+                { (unsigned int) dim, (unsigned int) ncolumn } };
+            la::cpu::weak_tensor<double> proj_t { proj.data(),
+                { (unsigned int) graph.nframes, (unsigned int) ncolumn } };
+
+            la::cpu::mul(proj_t, frames_t, weights_t);
+        }
+
+        for (int i = 0; i < features.size(); ++i) {
+            auto w = tensor_tree::get_var(var_tree->children[i]);
+
+            // frames times the weights of feature i, with stride ncolumn
+            double const *p = column[i] == -1 ? nullptr : proj.data() + column[i];
+
+            if (features[i] == "frame-avg") {
+                // prefix[t] is the sum of the products of the frames before t
+                prefix.assign((graph.nframes + 1) * nlabel, 0);
+
+                for (int t = 0; t < graph.nframes; ++t) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        prefix[(t + 1) * nlabel + l] = prefix[t * nlabel + l] + p[t * ncolumn + l];
+                    }
+                }
+
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        scores[k + l] += (prefix[(t + len) * nlabel + l]
+                            - prefix[t * nlabel + l]) / len;
+                    }
+                });
+            } else if (features[i] == "left-end") {
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        scores[k + l] += p[t * ncolumn + l];
+                    }
+                });
+            } else if (features[i] == "right-end") {
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        scores[k + l] += p[(t + len - 1) * ncolumn + l];
+                    }
+                });
+            } else if (features[i] == "length-indicator") {
+                double const *p = autodiff::get_output<la::cpu::tensor_like<double>>(w).data();
+
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        scores[k + l] += p[(len - 1) * nlabel + l];
+                    }
+                });
+            } else if (features[i] == "bias") {
+                double const *p = autodiff::get_output<la::cpu::tensor_like<double>>(w).data();
+
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        scores[k + l] += p[l];
+                    }
+                });
+            } else {
+                throw std::logic_error("unknown feature " + features[i]);
+            }
+        }
+
+        workspace::local<double>().put(std::move(prefix));
+        workspace::local<double>().put(std::move(proj));
+    }
+
+    template <class T>
+    basic_scorer<T>::~basic_scorer()
+    {
+        workspace::local<T>().put(std::move(scores));
+        workspace::local<T>().put(std::move(score_grad));
+        workspace::local<double>().put(std::move(weights));
+    }
+
+    template <class T>
+    int basic_scorer<T>::index(int tail, int length, int label) const
+    {
+        return (tail * max_seg + length - 1) * nlabel + label;
+    }
+
+    template <class T>
+    int basic_scorer<T>::index(int e) const
+    {
+        int u = graph.tail(e);
+        int len = graph.time(graph.head(e)) - graph.time(u);
+
+        return index(u, len, e % nlabel);
+    }
+
+    template <class T>
+    void basic_scorer<T>::grad()
+    {
+        std::vector<double> diff = workspace::local<double>().get((graph.nframes + 1) * nlabel, 0);
+
+        // gradient of the product of the frame features
+        std::vector<double> proj_grad = workspace::local<double>().get(graph.nframes * ncolumn, 0);
+
+        for (int i = 0; i < features.size(); ++i) {
+            auto w = tensor_tree::get_var(var_tree->children[i]);
+
+            double *g = column[i] == -1 ? nullptr : proj_grad.data() + column[i];
+
+            if (features[i] == "frame-avg") {
+                // spread g / len over the frames of each segment with
+                // a difference array, and integrate once at the end
+                diff.assign((graph.nframes + 1) * nlabel, 0);
+
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        diff[t * nlabel + l] += score_grad[k + l] / len;
+                        diff[(t + len) * nlabel + l] -= score_grad[k + l] / len;
+                    }
+                });
+
+                for (int l = 0; l < nlabel; ++l) {
+                    double acc = 0;
+
+                    for (int t = 0; t < graph.nframes; ++t) {
+                        acc += diff[t * nlabel + l];
+                        g[t * ncolumn + l] += acc;
+                    }
+                }
+            } else if (features[i] == "left-end") {
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        g[t * ncolumn + l] += score_grad[k + l];
+                    }
+                });
+            } else if (features[i] == "right-end") {
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        g[(t + len - 1) * ncolumn + l] += score_grad[k + l];
+                    }
+                });
+            } else if (features[i] == "length-indicator") {
+                double *g = get_grad(w).data();
+
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        g[(len - 1) * nlabel + l] += score_grad[k + l];
+                    }
+                });
+            } else if (features[i] == "bias") {
+                double *g = get_grad(w).data();
+
+                for_each_segment(*this, [&](int t, int len, int k) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        g[l] += score_grad[k + l];
+                    }
+                });
+            }
+        }
+
+        if (ncolumn > 0) {
+            auto& frames_t = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
+            int dim = frames_t.size(1);
+
+            la::cpu::weak_tensor<double> weights_t { weights.data(),
+                { (unsigned int) dim, (unsigned int) ncolumn } };
+            la::cpu::weak_tensor<double> proj_grad_t { proj_grad.data(),
+                { (unsigned int) graph.nframes, (unsigned int) ncolumn } };
+
+            // the two products of the backward pass of the one above
+            la::cpu::rmul(get_grad(frames), proj_grad_t, weights_t);
+
+            std::vector<double> weights_grad = workspace::local<double>().get(dim * ncolumn, 0);
+            la::cpu::weak_tensor<double> weights_grad_t { weights_grad.data(),
+                { (unsigned int) dim, (unsigned int) ncolumn } };
+
+            la::cpu::lmul(weights_grad_t, frames_t, proj_grad_t);
+
+            for (int i = 0; i < features.size(); ++i) {
+                if (column[i] == -1) {
+                    continue;
+                }
+
+                double *g = get_grad(tensor_tree::get_var(var_tree->children[i])).data();
+
+                for (int d = 0; d < dim; ++d) {
+                    for (int l = 0; l < nlabel; ++l) {
+                        g[d * nlabel + l] += weights_grad[d * ncolumn + column[i] + l];
+                    }
+                }
+            }
+
+            workspace::local<double>().put(std::move(weights_grad));
+        }
+
+        workspace::local<double>().put(std::move(diff));
+        workspace::local<double>().put(std::move(proj_grad));
+    }
+
+    template <class T>
+    basic_dense_weight<T>::basic_dense_weight(std::shared_ptr<basic_scorer<T>> s)
+        : s(s)
+    {}
+
+    template <class T>
+    double basic_dense_weight<T>::operator()(seg_graph::fst const& f, int e) const
+    {
+        return s->scores[s->index(e)];
+    }
+
+    template <class T>
+    void basic_dense_weight<T>::accumulate_grad(double g, seg_graph::fst const& f, int e) const
+    {
+        s->score_grad[s->index(e)] += g;
+    }
+
+    template <class T>
+    void basic_dense_weight<T>::grad() const
+    {
+        s->grad();
+    }
+
+    template <class T>
+    std::shared_ptr<basic_dense_weight<T>> make_weights(
+        std::vector<std::string> const& features,
+        std::shared_ptr<tensor_tree::vertex> var_tree,
+        std::shared_ptr<autodiff::op_t> frames,
+        seg_graph::fst const& graph)
+    {
+        return std::make_shared<basic_dense_weight<T>>(
+            std::make_shared<basic_scorer<T>>(features, var_tree, frames, graph));
+    }
+
+    template struct basic_scorer<float>;
+    template struct basic_scorer<double>;
+
+    template struct basic_dense_weight<float>;
+    template struct basic_dense_weight<double>;
+
+    template std::shared_ptr<basic_dense_weight<float>> make_weights<float>(
+        std::vector<std::string> const& features,
+        std::shared_ptr<tensor_tree::vertex> var_tree,
+        std::shared_ptr<autodiff::op_t> frames,
+        seg_graph::fst const& graph);
+
+    template std::shared_ptr<basic_dense_weight<double>> make_weights<double>(
+        std::vector<std::string> const& features,
+        std::shared_ptr<tensor_tree::vertex> var_tree,
+        std::shared_ptr<autodiff::op_t> frames,
+        seg_graph::fst const& graph);
+
+}
@@ -0,0 +1,139 @@
+#ifndef SEG_SCORE_H
+#define SEG_SCORE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include "nn/tensor-tree.h"
+#include "autodiff/autodiff.h"
+#include "segbin/seg-graph.h"
+#include "segbin/workspace.h"
+
+namespace seg_score {
+
+    /*
+     * Parameters of the label-factored segment scorer, one leaf per
+     * feature, in the order of the features:
+     *
+     *   frame-avg         hidden_dim x nlabel, applied to the mean frame
+     *   left-end          hidden_dim x nlabel, applied to the first frame
+     *   right-end         hidden_dim x nlabel, applied to the last frame
+     *   length-indicator  max_seg x nlabel, one row per segment length
+     *   bias              nlabel
+     *
+     * where nlabel excludes <eps>.
+     */
+    std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
+        std::vector<std::string> const& features);
+
+    /*
+     * Parameters of the scorer that score every segment of up to
+     * max_seg frames the same as seg::make_weights(features, seg_param)
+     * does, so that models trained on the seg graph can be decoded with
+     * the dense path.
+     *
+     * The weights are read by scoring probe frames rather than from the
+     * layout of the seg tree.  Segment scores are linear in the frames,
+     * so with zero frames they give the length and bias terms, and with
+     * unit frames three frames apart the segments of length one to
+     * three around each unit frame give the frame-avg, left-end and
+     * right-end weights of that dimension.  Throws when the probes
+     * disagree, i.e. when seg_param scores something other than the
+     * features of make_tensor_tree().
+     */
+    std::shared_ptr<tensor_tree::vertex> convert(
+        std::vector<std::string> const& features,
+        std::shared_ptr<tensor_tree::vertex> seg_param,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int hidden_dim, int max_seg);
+
+    /*
+     * Scores of all segments and labels of a graph, kept in a dense
+     * nvertex x max_seg x nlabel tensor indexed by tail vertex, segment
+     * length minus one, and label index.
+     *
+     * All the features are linear in the frames, so the weights of
+     * all labels of frame-avg, left-end and right-end are laid side by
+     * side and each frame is multiplied by them in a single product,
+     * and segment scores are then sums and differences of that
+     * product.  Nothing is computed per segment beyond the final
+     * additions.  grad() runs the backward pass of the product itself
+     * and adds into the gradients of the frames and the weights.
+     *
+     * Parameters, products and prefix sums stay in double; only the
+     * dense scores and their gradients are kept in T, so that the
+     * dynamic programs that stream over them can run in float.
+     *
+     * The dense arrays come from the workspace pool of the thread and
+     * go back to it when the scorer is destroyed.
+     */
+    template <class T>
+    struct basic_scorer {
+
+        std::vector<std::string> features;
+        std::shared_ptr<tensor_tree::vertex> var_tree;
+        std::shared_ptr<autodiff::op_t> frames;
+
+        seg_graph::fst const& graph;
+
+        int nvertex;
+        int max_seg;
+        int nlabel;
+
+        std::vector<T> scores;
+        std::vector<T> score_grad;
+
+        basic_scorer(std::vector<std::string> const& features,
+            std::shared_ptr<tensor_tree::vertex> var_tree,
+            std::shared_ptr<autodiff::op_t> frames,
+            seg_graph::fst const& graph);
+
+        ~basic_scorer();
+
+        int index(int tail, int length, int label) const;
+        int index(int e) const;
+
+        // backpropagates score_grad into the graph
+        void grad();
+
+    private:
+        // first column of each frame feature in weights, or -1
+        std::vector<int> column;
+        int ncolumn;
+
+        // weights of the frame features side by side, hidden_dim x ncolumn
+        std::vector<double> weights;
+    };
+
+    typedef basic_scorer<double> scorer;
+
+    template <class T>
+    struct basic_dense_weight
+        : public seg_graph::weight {
+
+        std::shared_ptr<basic_scorer<T>> s;
+
+        basic_dense_weight(std::shared_ptr<basic_scorer<T>> s);
+
+        virtual double operator()(seg_graph::fst const& f, int e) const override;
+
+        virtual void accumulate_grad(double g, seg_graph::fst const& f, int e) const override;
+
+        virtual void grad() const override;
+
+    };
+
+    typedef basic_dense_weight<double> dense_weight;
+
+    template <class T = double>
+    std::shared_ptr<basic_dense_weight<T>> make_weights(
+        std::vector<std::string> const& features,
+        std::shared_ptr<tensor_tree::vertex> var_tree,
+        std::shared_ptr<autodiff::op_t> frames,
+        seg_graph::fst const& graph);
+
+}
+
+#endif
@@ -0,0 +1,78 @@
+#include "segbin/seg-viterbi.h"
+#include "segbin/workspace.h"
+#include <limits>
+#include <algorithm>
+
+namespace seg_viterbi {
+
+    template <class T>
+    std::vector<int> best_path(seg_graph::fst const& graph,
+        std::vector<T> const& scores)
+    {
+        T const inf = std::numeric_limits<T>::infinity();
+
+        int nvertex = graph.vertices().size();
+        int nlabel = graph.labels.size();
+        int max_seg = graph.max_seg;
+
+        std::vector<T> best = workspace::local<T>().get(nvertex, -inf);
+        std::vector<int> back = workspace::local<int>().get(nvertex, -1);
+
+        best[0] = 0;
+
+        for (int u = 0; u < nvertex - 1; ++u) {
+            if (best[u] == -inf) {
+                continue;
+            }
+
+            seg_graph::int_range r = graph.out_edges(u);
+            int t = graph.time(u);
+
+            for (int e = r.first; e < r.last; e += nlabel) {
+                int v = graph.head(e);
+                T const *s = &scores[(u * max_seg + graph.time(v) - t - 1) * nlabel];
+
+                int arg = 0;
+                T m = s[0];
+
+                for (int l = 1; l < nlabel; ++l) {
+                    if (s[l] > m) {
+                        m = s[l];
+                        arg = l;
+                    }
+                }
+
+                // edges into v are relaxed in increasing id order, so
+                // strict comparison keeps the smallest id on ties
+                if (best[u] + m > best[v]) {
+                    best[v] = best[u] + m;
+                    back[v] = e + arg;
+                }
+            }
+        }
+
+        std::vector<int> result;
+
+        int v = nvertex - 1;
+
+        if (nvertex == 1 || back[v] != -1) {
+            while (v != 0) {
+                result.push_back(back[v]);
+                v = graph.tail(back[v]);
+            }
+
+            std::reverse(result.begin(), result.end());
+        }
+
+        workspace::local<T>().put(std::move(best));
+        workspace::local<int>().put(std::move(back));
+
+        return result;
+    }
+
+    template std::vector<int> best_path(seg_graph::fst const& graph,
+        std::vector<float> const& scores);
+    template std::vector<int> best_path(seg_graph::fst const& graph,
+        std::vector<double> const& scores);
+
+}
@@ -0,0 +1,30 @@
+#ifndef SEG_VITERBI_H
+#define SEG_VITERBI_H
+
+#include <vector>
+#include "segbin/seg-graph.h"
+
+namespace seg_viterbi {
+
+    /*
+     * Highest scoring path of the implicit segment graph, with edge
+     * scores read from a dense nvertex x max_seg x nlabel tensor with
+     * the layout of seg_score::scorer.  Returns edge ids of the graph
+     * from the initial to the final vertex.
+     *
+     * Tails are visited in time order and push their scores forward,
+     * so that the max_seg x nlabel block of scores of a tail is read
+     * once and in order.  The best label of a segment is picked in the
+     * same loop as the segment itself, and the only backpointer kept
+     * is the best incoming edge of each vertex.
+     *
+     * Ties go to the edge with the smallest id.  Defined for float and
+     * double scores.
+     */
+    template <class T>
+    std::vector<int> best_path(seg_graph::fst const& graph,
+        std::vector<T> const& scores);
+
+}
+
+#endif
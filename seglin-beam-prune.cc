@@ -4,6 +4,10 @@
 #include <fstream>
 #include "ebt/ebt.h"
 #include "seg/loss.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/lat-archive.h"
+#include "segbin/stage-timer.h"
 
 struct prediction_env {
 
@@ -15,6 +19,8 @@ struct prediction_env {
     int min_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
     std::shared_ptr<tensor_tree::vertex> param;
 
     std::vector<std::string> id_label;
@@ -22,7 +28,10 @@ struct prediction_env {
 
     double alpha;
     int min_edges;
-    std::ofstream output;
+    std::shared_ptr<lat_archive::writer> output;
+
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
 
     std::unordered_map<std::string, std::string> args;
 
@@ -42,12 +51,18 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"features", "", true},
             {"label", "", true},
             {"alpha", "", true},
             {"min-edges", "", true},
             {"output", "", true},
+            {"binary", "write a lattice archive", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -103,7 +118,34 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
     alpha = std::stod(args.at("alpha"));
     min_edges = std::stoi(args.at("min-edges"));
 
-    output.open(args.at("output"));
+    output = std::make_shared<lat_archive::writer>(args.at("output"), id_label,
+        ebt::in(std::string("binary"), args));
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(args.at("trace"));
+    }
 }
 
 void prediction_env::run()
@@ -112,39 +154,46 @@ void prediction_env::run()
 
     while (1) {
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_batch);
+        stage_timer::utterance utt { profile.get(), timeline.get() };
+        utt.set_key(std::to_string(nsample));
+
+        stage_timer::scope load_time { "load" };
+
+        frame::mat frames = frame::load_frame_mat(frame_batch);
 
         if (!frame_batch) {
+            load_time.cancel();
             break;
         }
 
+        utt.set_nframes(frames.nframes);
+        load_time.stop();
+
         autodiff::computation_graph comp_graph;
         std::shared_ptr<tensor_tree::vertex> var_tree
             = tensor_tree::make_var_tree(comp_graph, param);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
-
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
-
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
-
         std::shared_ptr<autodiff::op_t> frame_mat = comp_graph.var(la::cpu::weak_tensor<double>(
-            frame_cat.data(), { nframes, ndim }));
+            frames.data.data(), { frames.nframes, frames.ndim }));
 
         seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(frames.size(), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+        graph_cache::entry graph_entry = graphs->at(frames.nframes);
+        graph_data.fst = graph_entry.fst;
+        graph_data.topo_order = graph_entry.topo_order;
 
+        stage_timer::scope weights_time { "make_weights" };
         graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat);
+        weights_time.stop();
 
         seg::seg_fst<seg::iseg_data> graph { graph_data };
 
+        // the weights are computed as the search asks for them
+        stage_timer::scope prune_time { "prune" };
         fst::beam_prune<seg::seg_fst<seg::iseg_data>> beam_prune;
         beam_prune.merge(graph, *graph_data.topo_order, alpha, min_edges);
+        prune_time.stop();
+
+        stage_timer::scope output_time { "output" };
 
         ifst::fst_data data;
         data.symbol_id = std::make_shared<std::unordered_map<std::string, int>>(label_id);
@@ -176,32 +225,16 @@ void prediction_env::run()
                 graph.input(e), graph.output(e) });
         }
 
-        output << nsample << ".lat" << std::endl;
-
         ifst::fst f;
         f.data = std::make_shared<ifst::fst_data>(data);
 
-        for (int i = 0; i < f.vertices().size(); ++i) {
-            if (ebt::in(std::string("subsampling"), args)) {
-                output << i << " "
-                    << "time=" << f.time(i) * 4 << std::endl;
-            } else {
-                output << i << " "
-                    << "time=" << f.time(i) << std::endl;
-            }
-        }
-
-        output << "#" << std::endl;
+        lat_archive::lattice lat = lat_archive::make_lattice(
+            std::to_string(nsample) + ".lat", f,
+            ebt::in(std::string("subsampling"), args) ? 4 : 1);
 
-        for (int e = 0; e < f.edges().size(); ++e) {
-            int tail = f.tail(e);
-            int head = f.head(e);
+        output->put(nsample, std::move(lat));
 
-            output << tail << " " << head << " "
-                << "label=" << id_label.at(f.output(e)) << ";"
-                << "weight=" << f.weight(e) << std::endl;
-        }
-        output << "." << std::endl;
+        output_time.stop();
 
         auto edges = graph.edges();
 
@@ -220,5 +253,20 @@ void prediction_env::run()
 
     }
 
+    output->close();
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cout);
+        graphs->report(std::cout);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
 }
 
@@ -4,21 +4,69 @@
 #include <fstream>
 #include "ebt/ebt.h"
 #include "seg/loss.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/seg-graph.h"
+#include "segbin/seg-score.h"
+#include "segbin/seg-fb.h"
+#include "segbin/prefetch.h"
+#include "segbin/grad-tree.h"
+#include "segbin/telemetry.h"
+#include "segbin/stage-timer.h"
+
+struct sample : public frame::sample {
+    std::vector<int> label_seq;
+};
+
+/*
+ * Marginal log loss of the dense scorer.  When the loss is positive,
+ * the gradient is pushed through the scores into the weights and the
+ * frames, and the rest is left to autodiff.
+ */
+template <class T>
+double dense_loss_grad(std::vector<std::string> const& features,
+    std::shared_ptr<tensor_tree::vertex> var_tree, std::shared_ptr<autodiff::op_t> frame_mat,
+    seg_graph::fst const& graph, std::vector<int> const& label_seq, bool fast_exp)
+{
+    stage_timer::scope weights_time { "make_weights" };
+    auto weight = seg_score::make_weights<T>(features, var_tree, frame_mat, graph);
+    weights_time.stop();
+
+    seg_fb::basic_marginal_log_loss<T> loss_func { graph, weight->s->scores, label_seq, fast_exp };
+
+    stage_timer::scope loss_time { "loss" };
+    double ell = loss_func.loss();
+    loss_time.stop();
+
+    if (ell > 0) {
+        stage_timer::scope grad_time { "loss_grad" };
+        loss_func.grad(weight->s->score_grad);
+        weight->grad();
+    }
+
+    return ell;
+}
 
 struct learning_env {
 
     std::vector<std::string> features;
 
-    speech::batch_indices frame_batch;
+    frame::scp frame_batch;
     speech::batch_indices label_batch;
 
+    std::vector<int> indices;
+
     int max_seg;
     int min_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
     std::shared_ptr<tensor_tree::vertex> param;
 
-    std::shared_ptr<tensor_tree::optimizer> opt;
+    grad_tree::buffer param_grad;
+
+    std::shared_ptr<param_arena::optimizer> opt;
 
     std::string output_param;
     std::string output_opt_data;
@@ -33,10 +81,24 @@ struct learning_env {
     std::vector<std::string> id_label;
     std::unordered_map<std::string, int> label_id;
 
+    int prefetch_depth;
+    int loader_threads;
+    std::vector<std::shared_ptr<frame::scp>> loader_frame_batch;
+    std::vector<std::shared_ptr<speech::batch_indices>> loader_label_batch;
+
+    // per-sample lines are printed only without --report-every
+    // and --report-seconds
+    std::shared_ptr<telemetry::recorder> stats;
+
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
+
     std::unordered_map<std::string, std::string> args;
 
     learning_env(std::unordered_map<std::string, std::string> args);
 
+    sample load_sample(frame::scp& f_src, speech::batch_indices& l_src, int i);
+
     void run();
 
 };
@@ -52,21 +114,35 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"opt-data", "", true},
             {"output-param", "", false},
             {"output-opt-data", "", false},
             {"features", "", true},
+            {"dense-scores", "", false},
+            {"seg-param", "param has seg weights, converted for --dense-scores", false},
+            {"float", "", false},
+            {"exact-exp", "use std::exp in the dense forward-backward", false},
             {"label", "", true},
             {"dropout", "", false},
             {"seed", "", false},
             {"shuffle", "", false},
+            {"prefetch", "", false},
+            {"loader-threads", "", false},
             {"nsample", "", false},
             {"opt", "const-step,rmsprop,adagrad", true},
             {"step-size", "", true},
             {"clip", "", false},
             {"decay", "", false},
             {"momentum", "", false},
+            {"report-every", "", false},
+            {"report-seconds", "", false},
+            {"report-file", "", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -94,10 +170,33 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 {
     features = ebt::split(args.at("features"), ",");
 
-    param = seg::make_tensor_tree(features);
-    tensor_tree::load_tensor(param, args.at("param"));
+    bool seg_param = ebt::in(std::string("seg-param"), args);
+
+    if (seg_param && !ebt::in(std::string("dense-scores"), args)) {
+        throw std::logic_error("--seg-param requires --dense-scores");
+    }
+
+    if (seg_param) {
+        seg_score::make_tensor_tree(features);
+    }
+
+    if (ebt::in(std::string("dense-scores"), args) && !seg_param) {
+        param = seg_score::make_tensor_tree(features);
+        tensor_tree::load_tensor(param, args.at("param"));
+    } else {
+        param = seg::make_tensor_tree(features);
+        tensor_tree::load_tensor(param, args.at("param"));
+    }
+
+    if (ebt::in(std::string("float"), args) && !ebt::in(std::string("dense-scores"), args)) {
+        throw std::logic_error("--float requires --dense-scores");
+    }
 
-    frame_batch.open(args.at("frame-batch"));
+    if (ebt::in(std::string("exact-exp"), args) && !ebt::in(std::string("dense-scores"), args)) {
+        throw std::logic_error("--exact-exp requires --dense-scores");
+    }
+
+    frame_batch.open_batch(args.at("frame-batch"));
     label_batch.open(args.at("label-batch"));
 
     output_param = "param-last";
@@ -148,131 +247,259 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
         label_id[id_label[i]] = i;
     }
 
-    if (ebt::in(std::string("shuffle"), args)) {
-        std::vector<int> indices;
-        indices.resize(frame_batch.pos.size());
+    if (seg_param) {
+        frame::mat m;
+        int dim = frame_batch.at(0, m).ndim;
+        param = seg_score::convert(features, param, label_id, id_label, dim, max_seg);
+    }
 
-        for (int i = 0; i < indices.size(); ++i) {
-            indices[i] = i;
-        }
+    if (ebt::in(std::string("dense-scores"), args)) {
+        param_grad = grad_tree::buffer { seg_score::make_tensor_tree(features), param };
+    } else {
+        param_grad = grad_tree::buffer { seg::make_tensor_tree(features), param };
+    }
+
+    indices.resize(frame_batch.entries.size());
+
+    for (int i = 0; i < indices.size(); ++i) {
+        indices[i] = i;
+    }
+
+    if (ebt::in(std::string("shuffle"), args)) {
         std::shuffle(indices.begin(), indices.end(), gen);
+    }
 
-        std::vector<unsigned long> pos = frame_batch.pos;
-        for (int i = 0; i < indices.size(); ++i) {
-            frame_batch.pos[i] = pos[indices[i]];
-        }
+    prefetch_depth = 0;
+    if (ebt::in(std::string("prefetch"), args)) {
+        prefetch_depth = std::stoi(args.at("prefetch"));
+    }
 
-        pos = label_batch.pos;
-        for (int i = 0; i < indices.size(); ++i) {
-            label_batch.pos[i] = pos[indices[i]];
+    loader_threads = 1;
+    if (ebt::in(std::string("loader-threads"), args)) {
+        loader_threads = std::stoi(args.at("loader-threads"));
+    }
+
+    if (prefetch_depth > 0) {
+        for (int i = 0; i < loader_threads; ++i) {
+            loader_frame_batch.push_back(std::make_shared<frame::scp>());
+            loader_frame_batch.back()->open_batch(args.at("frame-batch"));
+
+            loader_label_batch.push_back(std::make_shared<speech::batch_indices>());
+            loader_label_batch.back()->open(args.at("label-batch"));
         }
     }
 
-    if (args.at("opt") == "const-step") {
-        opt = std::make_shared<tensor_tree::const_step_opt>(
-            tensor_tree::const_step_opt{param, step_size});
-    } else if (args.at("opt") == "const-step-momentum") {
-        double momentum = std::stod(args.at("momentum"));
-        opt = std::make_shared<tensor_tree::const_step_momentum_opt>(
-            tensor_tree::const_step_momentum_opt{param, step_size, momentum});
+    opt = std::make_shared<param_arena::optimizer>(param, args.at("opt"), step_size);
+
+    if (args.at("opt") == "const-step-momentum") {
+        opt->momentum = std::stod(args.at("momentum"));
     } else if (args.at("opt") == "rmsprop") {
-        double decay = std::stod(args.at("decay"));
-        opt = std::make_shared<tensor_tree::rmsprop_opt>(
-            tensor_tree::rmsprop_opt{param, step_size, decay});
-    } else if (args.at("opt") == "adagrad") {
-        opt = std::make_shared<tensor_tree::adagrad_opt>(
-            tensor_tree::adagrad_opt{param, step_size});
+        opt->decay = std::stod(args.at("decay"));
     } else if (args.at("opt") == "adam") {
-        double beta1 = std::stod(args.at("beta1"));
-        double beta2 = std::stod(args.at("beta2"));
-        opt = std::make_shared<tensor_tree::adam_opt>(
-            tensor_tree::adam_opt{param, step_size, beta1, beta2});
-    } else {
-        std::cout << "unknown optimizer " << args.at("opt") << std::endl;
-        exit(1);
+        opt->beta1 = std::stod(args.at("beta1"));
+        opt->beta2 = std::stod(args.at("beta2"));
+    }
+
+    // the opt data of a seg model does not fit the converted weights
+    if (!seg_param) {
+        std::ifstream opt_data_ifs { args.at("opt-data") };
+        opt->load_opt_data(opt_data_ifs);
+    }
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
     }
 
-    std::ifstream opt_data_ifs { args.at("opt-data") };
-    opt->load_opt_data(opt_data_ifs);
+    if (ebt::in(std::string("report-every"), args) || ebt::in(std::string("report-seconds"), args)) {
+        int report_every = 0;
+        if (ebt::in(std::string("report-every"), args)) {
+            report_every = std::stoi(args.at("report-every"));
+        }
+
+        double report_seconds = 0;
+        if (ebt::in(std::string("report-seconds"), args)) {
+            report_seconds = std::stod(args.at("report-seconds"));
+        }
+
+        std::string report_file;
+        if (ebt::in(std::string("report-file"), args)) {
+            report_file = args.at("report-file");
+        }
+
+        stats = std::make_shared<telemetry::recorder>(report_file,
+            report_every, report_seconds);
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(args.at("trace"));
+    }
 }
 
-void learning_env::run()
+sample learning_env::load_sample(frame::scp& f_src, speech::batch_indices& l_src, int i)
 {
-    ebt::Timer timer;
+    sample result;
+
+    result.key = f_src.entries[i].key;
+
+    stage_timer::utterance utt { profile.get(), timeline.get() };
+    utt.set_key(result.key);
+    stage_timer::scope load_time { "load" };
+
+    result.frames = f_src.at(i, result.buf);
+    result.label_seq = speech::load_label_seq_batch(l_src.at(i), label_id);
+
+    utt.set_nframes(result.frames.nframes);
+
+    return result;
+}
 
+void learning_env::run()
+{
     int nsample = 0;
 
-    while (nsample < frame_batch.pos.size()) {
+    prefetch::loader<sample> loader { indices, prefetch_depth,
+        prefetch_depth > 0 ? loader_threads : 0,
+        [&](int thread, int i) -> sample {
+            if (prefetch_depth > 0) {
+                return load_sample(*loader_frame_batch[thread], *loader_label_batch[thread], i);
+            } else {
+                return load_sample(frame_batch, label_batch, i);
+            }
+        }};
+
+    while (nsample < indices.size()) {
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_batch.at(nsample));
+        sample s = loader.next();
 
-        std::vector<int> label_seq = speech::load_label_seq_batch(label_batch.at(nsample), label_id);
+        frame::view& frames = s.frames;
+        std::vector<int>& label_seq = s.label_seq;
 
-        std::cout << "sample: " << nsample + 1 << std::endl;
-        std::cout << "gold len: " << label_seq.size() << std::endl;
+        if (stats == nullptr) {
+            std::cout << "sample: " << nsample + 1 << std::endl;
+            std::cout << "gold len: " << label_seq.size() << std::endl;
+
+            std::cout << "frames: " << frames.nframes << std::endl;
+        } else {
+            stats->count("frames", frames.nframes);
+        }
 
-        std::cout << "frames: " << frames.size() << std::endl;
+        if (frames.nframes < label_seq.size()) {
+            if (stats != nullptr) {
+                stats->count("too_short");
+                stats->step();
+            }
 
-        if (frames.size() < label_seq.size()) {
             ++nsample;
             continue;
         }
 
+        stage_timer::utterance utt { profile.get(), timeline.get(), (int) frames.nframes };
+        utt.set_key(s.key);
+
         autodiff::computation_graph comp_graph;
         std::shared_ptr<tensor_tree::vertex> var_tree
             = tensor_tree::make_var_tree(comp_graph, param);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
-
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
-
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
+        param_grad.bind(var_tree);
 
         std::shared_ptr<autodiff::op_t> frame_mat = comp_graph.var(la::cpu::weak_tensor<double>(
-            frame_cat.data(), { nframes, ndim }));
+            frames.data, { frames.nframes, frames.ndim }));
 
         if (ebt::in(std::string("dropout"), args)) {
             auto d_mask = autodiff::dropout_mask(frame_mat, dropout, gen);
             frame_mat = autodiff::emul(d_mask, frame_mat);
         }
 
+        bool dense_scores = ebt::in(std::string("dense-scores"), args);
+
         seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(frames.size(), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+        ifst::fst label_fst;
+        seg::loss_func *loss_func = nullptr;
 
-        if (ebt::in(std::string("dropout"), args)) {
-            graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat,
-                dropout, &gen);
-        } else {
-            graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat);
-        }
+        double ell;
 
-        seg::loss_func *loss_func;
+        if (dense_scores) {
+            stage_timer::scope graph_time { "make_graph" };
+            std::shared_ptr<seg_graph::fst> graph = seg_graph::make_graph(frames.nframes,
+                label_id, id_label, min_seg, max_seg, stride);
+            graph_time.stop();
 
-        ifst::fst label_fst = seg::make_label_fst(label_seq, label_id, id_label);
+            bool fast_exp = !ebt::in(std::string("exact-exp"), args);
 
-        loss_func = new seg::marginal_log_loss { graph_data, label_fst };
+            if (ebt::in(std::string("float"), args)) {
+                ell = dense_loss_grad<float>(features, var_tree, frame_mat, *graph, label_seq,
+                    fast_exp);
+            } else {
+                ell = dense_loss_grad<double>(features, var_tree, frame_mat, *graph, label_seq,
+                    fast_exp);
+            }
+        } else {
+            graph_cache::entry graph_entry = graphs->at(frames.nframes);
+            graph_data.fst = graph_entry.fst;
+            graph_data.topo_order = graph_entry.topo_order;
 
-        double ell = loss_func->loss();
+            stage_timer::scope weights_time { "make_weights" };
 
-        std::cout << "loss: " << ell << std::endl;
-        std::cout << "E: " << ell / label_seq.size() << std::endl;
+            if (ebt::in(std::string("dropout"), args)) {
+                graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat,
+                    dropout, &gen);
+            } else {
+                graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat);
+            }
 
-        std::shared_ptr<tensor_tree::vertex> param_grad = seg::make_tensor_tree(features);
+            label_fst = seg::make_label_fst(label_seq, label_id, id_label);
 
-        if (ell > 0) {
-            loss_func->grad();
+            loss_func = new seg::marginal_log_loss { graph_data, label_fst };
+
+            weights_time.stop();
 
-            graph_data.weight_func->grad();
+            stage_timer::scope loss_time { "loss" };
+            ell = loss_func->loss();
+        }
 
-            tensor_tree::copy_grad(param_grad, var_tree);
+        if (stats == nullptr) {
+            std::cout << "loss: " << ell << std::endl;
+            std::cout << "E: " << ell / label_seq.size() << std::endl;
+        } else {
+            stats->observe("loss", ell);
+            stats->observe("E", ell / label_seq.size());
+        }
 
-            {
-                auto vars = tensor_tree::leaves_pre_order(param_grad);
+        if (ell > 0) {
+            if (dense_scores) {
+                // the scorer multiplies the frames by its weights in the
+                // graph, so the gradient has to go through autodiff
+                stage_timer::scope backward_time { "backward" };
+                auto topo_order = autodiff::natural_topo_order(comp_graph);
+                autodiff::guarded_grad(topo_order, autodiff::grad_funcs);
+            } else {
+                stage_timer::scope grad_time { "loss_grad" };
+
+                loss_func->grad();
+
+                graph_data.weight_func->grad();
+            }
+
+            if (stats == nullptr) {
+                auto vars = tensor_tree::leaves_pre_order(param_grad.tree);
                 std::cout << vars.back()->name << " "
                     << "analytic grad: " << tensor_tree::get_tensor(vars[0]).data()[0]
                     << std::endl;
@@ -283,38 +510,83 @@ void learning_env::run()
 
             double v1 = tensor_tree::get_tensor(vars[0]).data()[0];
 
-            if (ebt::in(std::string("clip"), args)) {
-                double n = tensor_tree::norm(param_grad);
-
-                std::cout << "grad norm: " << n;
+            stage_timer::scope update_time { "update" };
 
-                if (n > clip) {
-                    tensor_tree::axpy(param_grad, clip / n - 1, param_grad);
+            // the norm and the check for nan and inf in one pass
+            param_arena::grad_stats g = param_grad.stats();
 
-                    std::cout << " clip: " << clip << " gradient clipped";
+            if (!g.finite) {
+                if (stats == nullptr) {
+                    std::cout << "gradient has nan or inf.  skipping." << std::endl;
+                } else {
+                    stats->count("nonfinite_grad");
+                }
+            } else {
+                double scale = 1;
+
+                if (ebt::in(std::string("clip"), args)) {
+                    double n = g.norm;
+
+                    if (stats == nullptr) {
+                        std::cout << "grad norm: " << n;
+                    } else {
+                        stats->observe("grad_norm", n);
+                    }
+
+                    if (n > clip) {
+                        scale = clip / n;
+
+                        if (stats == nullptr) {
+                            std::cout << " clip: " << clip << " gradient clipped";
+                        } else {
+                            stats->count("clipped");
+                        }
+                    }
+
+                    if (stats == nullptr) {
+                        std::cout << std::endl;
+                    }
                 }
 
-                std::cout << std::endl;
+                // clipping is applied by the optimizer as it reads the arena
+                opt->update(param_grad.data(), param_grad.size(), scale);
             }
 
-            opt->update(param_grad);
+            update_time.stop();
 
             double v2 = tensor_tree::get_tensor(vars[0]).data()[0];
 
-            std::cout << "weight: " << v1 << " update: " << v2 - v1
-                << " ratio: " << (v2 - v1) / v1 << std::endl;
+            if (stats == nullptr) {
+                std::cout << "weight: " << v1 << " update: " << v2 - v1
+                    << " ratio: " << (v2 - v1) / v1 << std::endl;
+            } else {
+                stats->gauge("update_ratio", (v2 - v1) / v1);
+            }
 
         }
 
         if (ell < 0) {
-            std::cout << "loss is less than zero.  skipping." << std::endl;
+            if (stats == nullptr) {
+                std::cout << "loss is less than zero.  skipping." << std::endl;
+            } else {
+                stats->count("negative_loss");
+            }
         }
 
-        double n = tensor_tree::norm(param);
+        if (stats == nullptr) {
+            double n = tensor_tree::norm(param);
 
-        std::cout << "norm: " << n << std::endl;
+            std::cout << "norm: " << n << std::endl;
 
-        std::cout << std::endl;
+            std::cout << std::endl;
+        } else {
+            // a full pass over the model, only for reports
+            if (stats->due()) {
+                stats->gauge("param_norm", tensor_tree::norm(param));
+            }
+
+            stats->step();
+        }
 
         ++nsample;
 
@@ -326,11 +598,29 @@ void learning_env::run()
 
     }
 
+    if (prefetch_depth > 0) {
+        std::cout << "prefetch stalls: " << loader.stalls
+            << " wait: " << loader.stall_time << std::endl;
+    }
+
     tensor_tree::save_tensor(param, output_param);
 
     std::ofstream opt_data_ofs { output_opt_data };
     opt->save_opt_data(opt_data_ofs);
     opt_data_ofs.close();
 
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cout);
+        graphs->report(std::cout);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
 }
 
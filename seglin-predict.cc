@@ -4,6 +4,13 @@
 #include <fstream>
 #include "ebt/ebt.h"
 #include "seg/loss.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/seg-graph.h"
+#include "segbin/seg-score.h"
+#include "segbin/seg-viterbi.h"
+#include "segbin/param-file.h"
+#include "segbin/stage-timer.h"
 
 struct prediction_env {
 
@@ -15,11 +22,20 @@ struct prediction_env {
     int min_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
     std::shared_ptr<tensor_tree::vertex> param;
 
+    // param still has the seg weights of --seg-param, converted once
+    // the first utterance gives the frame dimension
+    bool seg_param;
+
     std::vector<std::string> id_label;
     std::unordered_map<std::string, int> label_id;
 
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
+
     std::unordered_map<std::string, std::string> args;
 
     prediction_env(std::unordered_map<std::string, std::string> args);
@@ -38,9 +54,17 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"features", "", true},
             {"label", "", true},
+            {"dense-scores", "", false},
+            {"seg-param", "param has seg weights, converted for --dense-scores", false},
+            {"float", "", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -68,8 +92,29 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
 {
     features = ebt::split(args.at("features"), ",");
 
-    param = seg::make_tensor_tree(features);
-    tensor_tree::load_tensor(param, args.at("param"));
+    seg_param = ebt::in(std::string("seg-param"), args);
+
+    if (seg_param && !ebt::in(std::string("dense-scores"), args)) {
+        throw std::logic_error("--seg-param requires --dense-scores");
+    }
+
+    if (seg_param) {
+        // fails on features the dense scorer does not have
+        seg_score::make_tensor_tree(features);
+    }
+
+    if (ebt::in(std::string("dense-scores"), args) && !seg_param) {
+        param = seg_score::make_tensor_tree(features);
+    } else {
+        param = seg::make_tensor_tree(features);
+    }
+    param_file::reader param_src;
+    param_src.open(args.at("param"));
+    param_src.load(param);
+
+    if (ebt::in(std::string("float"), args) && !ebt::in(std::string("dense-scores"), args)) {
+        throw std::logic_error("--float requires --dense-scores");
+    }
 
     frame_batch.open(args.at("frame-batch"));
 
@@ -92,6 +137,32 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
     for (int i = 0; i < id_label.size(); ++i) {
         label_id[id_label[i]] = i;
     }
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(args.at("trace"));
+    }
 }
 
 void prediction_env::run()
@@ -100,49 +171,96 @@ void prediction_env::run()
 
     while (1) {
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_batch);
+        stage_timer::utterance utt { profile.get(), timeline.get() };
+        utt.set_key(std::to_string(nsample));
+
+        stage_timer::scope load_time { "load" };
+
+        frame::mat frames = frame::load_frame_mat(frame_batch);
 
         if (!frame_batch) {
+            load_time.cancel();
             break;
         }
 
+        utt.set_nframes(frames.nframes);
+        load_time.stop();
+
+        if (seg_param) {
+            param = seg_score::convert(features, param, label_id, id_label,
+                frames.ndim, max_seg);
+            seg_param = false;
+        }
+
         autodiff::computation_graph comp_graph;
         std::shared_ptr<tensor_tree::vertex> var_tree
             = tensor_tree::make_var_tree(comp_graph, param);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
+        std::shared_ptr<autodiff::op_t> frame_mat = comp_graph.var(la::cpu::weak_tensor<double>(
+            frames.data.data(), { frames.nframes, frames.ndim }));
 
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
+        if (ebt::in(std::string("dense-scores"), args)) {
+            stage_timer::scope graph_time { "make_graph" };
+            std::shared_ptr<seg_graph::fst> graph = seg_graph::make_graph(frames.nframes,
+                label_id, id_label, min_seg, max_seg, stride);
+            graph_time.stop();
 
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
+            std::vector<int> path;
 
-        std::shared_ptr<autodiff::op_t> frame_mat = comp_graph.var(la::cpu::weak_tensor<double>(
-            frame_cat.data(), { nframes, ndim }));
+            if (ebt::in(std::string("float"), args)) {
+                stage_timer::scope weights_time { "make_weights" };
+                seg_score::basic_scorer<float> scores { features, var_tree, frame_mat, *graph };
+                weights_time.stop();
 
-        seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(frames.size(), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+                stage_timer::scope search_time { "search" };
+                path = seg_viterbi::best_path(*graph, scores.scores);
+            } else {
+                stage_timer::scope weights_time { "make_weights" };
+                seg_score::scorer scores { features, var_tree, frame_mat, *graph };
+                weights_time.stop();
 
-        graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat);
+                stage_timer::scope search_time { "search" };
+                path = seg_viterbi::best_path(*graph, scores.scores);
+            }
 
-        seg::seg_fst<seg::iseg_data> graph { graph_data };
+            stage_timer::scope output_time { "output" };
 
-        fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
-        for (auto& i: graph.initials()) {
-            one_best.extra[i] = {-1, 0};
-        }
-        one_best.merge(graph, *graph_data.topo_order);
+            for (int e: path) {
+                std::cout << id_label.at(graph->output(e)) << " ";
+            }
+            std::cout << "(" << nsample << ".dot)" << std::endl;
+        } else {
+            seg::iseg_data graph_data;
+            graph_cache::entry graph_entry = graphs->at(frames.nframes);
+            graph_data.fst = graph_entry.fst;
+            graph_data.topo_order = graph_entry.topo_order;
+
+            stage_timer::scope weights_time { "make_weights" };
+            graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat);
+            weights_time.stop();
 
-        std::vector<int> path = one_best.best_path(graph);
+            seg::seg_fst<seg::iseg_data> graph { graph_data };
 
-        for (int e: path) {
-            std::cout << id_label.at(graph.output(e)) << " ";
+            // the weights are computed as the search asks for them
+            stage_timer::scope search_time { "search" };
+
+            fst::forward_one_best<seg::seg_fst<seg::iseg_data>> one_best;
+            for (auto& i: graph.initials()) {
+                one_best.extra[i] = {-1, 0};
+            }
+            one_best.merge(graph, *graph_data.topo_order);
+
+            std::vector<int> path = one_best.best_path(graph);
+
+            search_time.stop();
+
+            stage_timer::scope output_time { "output" };
+
+            for (int e: path) {
+                std::cout << id_label.at(graph.output(e)) << " ";
+            }
+            std::cout << "(" << nsample << ".dot)" << std::endl;
         }
-        std::cout << "(" << nsample << ".dot)" << std::endl;
 
         ++nsample;
 
@@ -154,5 +272,18 @@ void prediction_env::run()
 
     }
 
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cerr);
+        graphs->report(std::cerr);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
 }
 
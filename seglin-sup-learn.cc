@@ -4,18 +4,24 @@
 #include <fstream>
 #include "ebt/ebt.h"
 #include "seg/loss.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
 
 struct learning_env {
 
     std::vector<std::string> features;
 
-    speech::batch_indices frame_batch;
+    frame::scp frame_batch;
     speech::batch_indices seg_batch;
 
+    std::vector<int> indices;
+
     int max_seg;
     int min_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
     int subsampling;
 
     std::shared_ptr<tensor_tree::vertex> param;
@@ -55,6 +61,8 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"opt-data", "", true},
             {"features", "", true},
@@ -104,7 +112,7 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
     param = seg::make_tensor_tree(features);
     tensor_tree::load_tensor(param, args.at("param"));
 
-    frame_batch.open(args.at("frame-batch"));
+    frame_batch.open_batch(args.at("frame-batch"));
     seg_batch.open(args.at("seg-batch"));
 
     output_param = "param-last";
@@ -163,24 +171,14 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
         sils.push_back(label_id.at(s));
     }
 
-    if (ebt::in(std::string("shuffle"), args)) {
-        std::vector<int> indices;
-        indices.resize(frame_batch.pos.size());
-
-        for (int i = 0; i < indices.size(); ++i) {
-            indices[i] = i;
-        }
-        std::shuffle(indices.begin(), indices.end(), gen);
+    indices.resize(frame_batch.entries.size());
 
-        std::vector<unsigned long> pos = frame_batch.pos;
-        for (int i = 0; i < indices.size(); ++i) {
-            frame_batch.pos[i] = pos[indices[i]];
-        }
+    for (int i = 0; i < indices.size(); ++i) {
+        indices[i] = i;
+    }
 
-        pos = seg_batch.pos;
-        for (int i = 0; i < indices.size(); ++i) {
-            seg_batch.pos[i] = pos[indices[i]];
-        }
+    if (ebt::in(std::string("shuffle"), args)) {
+        std::shuffle(indices.begin(), indices.end(), gen);
     }
 
     if (args.at("opt") == "const-step") {
@@ -209,26 +207,37 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 
     std::ifstream opt_data_ifs { args.at("opt-data") };
     opt->load_opt_data(opt_data_ifs);
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
 }
 
 void learning_env::run()
 {
-    ebt::Timer timer;
-
     int nsample = 0;
 
-    while (nsample < frame_batch.pos.size()) {
+    while (nsample < indices.size()) {
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_batch.at(nsample));
+        frame::view frames = frame_batch.at(indices[nsample]);
 
-        std::vector<speech::segment> segs = speech::load_segment_batch(seg_batch.at(nsample));
+        std::vector<speech::segment> segs = speech::load_segment_batch(seg_batch.at(indices[nsample]));
 
         std::cout << "sample: " << nsample + 1 << std::endl;
         std::cout << "gold len: " << segs.size() << std::endl;
 
-        std::cout << "frames: " << frames.size() << std::endl;
+        std::cout << "frames: " << frames.nframes << std::endl;
 
-        if (frames.size() < segs.size()) {
+        if (frames.nframes < segs.size()) {
             ++nsample;
             continue;
         }
@@ -237,18 +246,8 @@ void learning_env::run()
         std::shared_ptr<tensor_tree::vertex> var_tree
             = tensor_tree::make_var_tree(comp_graph, param);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
-
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
-
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
-
         std::shared_ptr<autodiff::op_t> frame_mat = comp_graph.var(la::cpu::weak_tensor<double>(
-            frame_cat.data(), { nframes, ndim }));
+            frames.data, { frames.nframes, frames.ndim }));
 
         if (ebt::in(std::string("dropout"), args)) {
             auto d_mask = autodiff::dropout_mask(frame_mat, dropout, gen);
@@ -256,8 +255,9 @@ void learning_env::run()
         }
 
         seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(frames.size(), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+        graph_cache::entry graph_entry = graphs->at(frames.nframes);
+        graph_data.fst = graph_entry.fst;
+        graph_data.topo_order = graph_entry.topo_order;
 
         if (ebt::in(std::string("dropout"), args)) {
             graph_data.weight_func = seg::make_weights(features, var_tree, frame_mat,
@@ -360,5 +360,9 @@ void learning_env::run()
     opt->save_opt_data(opt_data_ofs);
     opt_data_ofs.close();
 
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
 }
 
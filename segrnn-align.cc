@@ -5,7 +5,11 @@
 #include "fst/fst-algo.h"
 #include "seg/seg.h"
 #include <fstream>
+#include <sstream>
 #include "nn/lstm-frame.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/param-file.h"
 
 std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
     std::vector<std::string> const& features,
@@ -23,13 +27,15 @@ struct alignment_env {
 
     std::vector<std::string> features;
 
-    batch::scp frame_scp;
+    frame::scp frame_scp;
     batch::scp label_scp;
 
     int max_seg;
     int min_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
     int layer;
     std::shared_ptr<tensor_tree::vertex> param;
 
@@ -58,6 +64,8 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"features", "", true},
             {"label", "", true},
@@ -95,13 +103,13 @@ alignment_env::alignment_env(std::unordered_map<std::string, std::string> args)
     frame_scp.open(args.at("frame-scp"));
     label_scp.open(args.at("label-scp"));
 
-    std::ifstream param_ifs { args.at("param") };
+    param_file::reader param_src;
+    param_src.open(args.at("param"));
     std::string line;
-    std::getline(param_ifs, line);
+    std::getline(param_src.header(), line);
     layer = std::stoi(line);
     param = make_tensor_tree(features, layer);
-    tensor_tree::load_tensor(param, param_ifs);
-    param_ifs.close();
+    param_src.load(param);
 
     max_seg = 20;
     if (ebt::in(std::string("max-seg"), args)) {
@@ -131,6 +139,19 @@ alignment_env::alignment_env(std::unordered_map<std::string, std::string> args)
     }
 
     assert(id_label[0] == "<eps>");
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
 }
 
 void alignment_env::run()
@@ -139,7 +160,7 @@ void alignment_env::run()
 
     while (nsample < frame_scp.entries.size()) {
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_scp.at(nsample));
+        frame::view frames = frame_scp.at(nsample);
         std::vector<int> label_seq = speech::load_label_seq_batch(label_scp.at(nsample), label_id);
 
         autodiff::computation_graph comp_graph;
@@ -147,19 +168,9 @@ void alignment_env::run()
         std::shared_ptr<tensor_tree::vertex> var_tree
             = tensor_tree::make_var_tree(comp_graph, param);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
-
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
-
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
-
         std::shared_ptr<autodiff::op_t> input
             = comp_graph.var(la::cpu::weak_tensor<double>(
-                frame_cat.data(), { nframes, ndim }));
+                frames.data, { frames.nframes, frames.ndim }));
 
         input->grad_needed = false;
 
@@ -172,9 +183,9 @@ void alignment_env::run()
         }
 
         lstm::trans_seq_t input_seq;
-        input_seq.nframes = frames.size();
+        input_seq.nframes = frames.nframes;
         input_seq.batch_size = 1;
-        input_seq.dim = frames.front().size();
+        input_seq.dim = frames.ndim;
         input_seq.feat = input;
         input_seq.mask = nullptr;
 
@@ -197,8 +208,9 @@ void alignment_env::run()
             std::vector<unsigned int> { hidden_mat.rows(), hidden_mat.cols() });
 
         seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(hidden_t.size(0), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+        graph_cache::entry graph_entry = graphs->at(hidden_t.size(0));
+        graph_data.fst = graph_entry.fst;
+        graph_data.topo_order = graph_entry.topo_order;
 
         graph_data.weight_func = seg::make_weights(features, var_tree->children[0], hidden_m);
 
@@ -228,19 +240,22 @@ void alignment_env::run()
 
         seg::seg_fst<seg::iseg_data> graph { graph_data };
 
+        // one write and one flush per utterance
+        std::ostringstream out;
+
         if (ebt::in(std::string("frames"), args)) {
-            std::cout << frame_scp.entries[nsample].key << std::endl;
+            out << frame_scp.entries[nsample].key << "\n";
             int t = 0;
             for (auto& e: edges) {
                 int head_time = graph.time(graph.head(std::get<1>(e)));
                 for (int j = t; j < head_time; ++j) {
-                    std::cout << id_label.at(pair.output(e)) << std::endl;
+                    out << id_label.at(pair.output(e)) << "\n";
                 }
                 t = head_time;
             }
-            std::cout << "." << std::endl;
+            out << ".\n";
         } else if (ebt::in(std::string("segs"), args)) {
-            std::cout << frame_scp.entries[nsample].key << std::endl;
+            out << frame_scp.entries[nsample].key << "\n";
             for (auto& e: edges) {
                 int tail_time = graph.time(graph.tail(std::get<1>(e)));
                 int head_time = graph.time(graph.head(std::get<1>(e)));
@@ -250,18 +265,20 @@ void alignment_env::run()
                     head_time *= 2 * (layer - 1);
                 }
 
-                std::cout << tail_time << " " << head_time
-                    << " " << id_label.at(pair.output(e)) << std::endl;
+                out << tail_time << " " << head_time
+                    << " " << id_label.at(pair.output(e)) << "\n";
             }
-            std::cout << "." << std::endl;
+            out << ".\n";
         } else {
             for (auto& e: edges) {
-                std::cout << id_label.at(pair.output(e)) << " "
+                out << id_label.at(pair.output(e)) << " "
                     << "(" << graph.time(graph.head(std::get<1>(e))) << ") ";
             }
-            std::cout << std::endl;
+            out << "\n";
         }
 
+        std::cout << out.str() << std::flush;
+
         ++nsample;
 
 #if DEBUG_TOP
@@ -272,5 +289,9 @@ void alignment_env::run()
 
     }
 
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
 }
 
@@ -85,8 +85,6 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
 
 void prediction_env::run()
 {
-    ebt::Timer timer;
-
     int nsample = 1;
 
     while (1) {
@@ -177,8 +177,6 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
 
 void learning_env::run()
 {
-    ebt::Timer timer;
-
     int nsample = 0;
 
     while (nsample < frame_batch.pos.size()) {
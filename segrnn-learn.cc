@@ -3,33 +3,133 @@
 #include "util/util.h"
 #include "util/batch.h"
 #include <fstream>
+#include <sstream>
 #include "ebt/ebt.h"
 #include "seg/loss.h"
 #include "nn/lstm-frame.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/seg-graph.h"
+#include "segbin/seg-score.h"
+#include "segbin/seg-fb.h"
+#include "segbin/prefetch.h"
+#include "segbin/minibatch.h"
+#include "segbin/grad-tree.h"
+#include "segbin/checkpoint.h"
+#include "segbin/telemetry.h"
+#include "segbin/stage-timer.h"
+#include "segbin/worker-pool.h"
+#include <mutex>
 
 std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
     std::vector<std::string> const& features,
-    int layer)
+    int layer, bool dense_scores)
 {
     tensor_tree::vertex root;
 
-    root.children.push_back(seg::make_tensor_tree(features));
+    if (dense_scores) {
+        root.children.push_back(seg_score::make_tensor_tree(features));
+    } else {
+        root.children.push_back(seg::make_tensor_tree(features));
+    }
     root.children.push_back(lstm_frame::make_tensor_tree(layer));
 
     return std::make_shared<tensor_tree::vertex>(root);
 }
 
+struct sample : public frame::sample {
+    std::vector<int> label_seq;
+};
+
+/*
+ * Marginal log loss of one utterance.  grad() backpropagates the loss
+ * through the segment weights down to the hidden states.
+ */
+struct utt_loss {
+    virtual ~utt_loss() {}
+    virtual double loss() = 0;
+    virtual void grad() = 0;
+};
+
+struct fst_loss
+    : public utt_loss {
+
+    seg::iseg_data graph_data;
+    std::shared_ptr<ifst::fst> label_fst;
+    std::shared_ptr<seg::marginal_log_loss> loss_func;
+
+    virtual double loss() override
+    {
+        return loss_func->loss();
+    }
+
+    virtual void grad() override
+    {
+        loss_func->grad();
+        graph_data.weight_func->grad();
+    }
+};
+
+template <class T>
+struct dense_loss
+    : public utt_loss {
+
+    std::shared_ptr<seg_graph::fst> graph;
+    std::shared_ptr<seg_score::basic_dense_weight<T>> weight;
+    std::shared_ptr<seg_fb::basic_marginal_log_loss<T>> loss_func;
+
+    virtual double loss() override
+    {
+        return loss_func->loss();
+    }
+
+    virtual void grad() override
+    {
+        loss_func->grad(weight->s->score_grad);
+        weight->grad();
+    }
+};
+
+template <class T>
+std::shared_ptr<utt_loss> make_dense_loss(std::vector<std::string> const& features,
+    std::shared_ptr<tensor_tree::vertex> var_tree, std::shared_ptr<autodiff::op_t> h_mat,
+    std::shared_ptr<seg_graph::fst> graph, std::vector<int> const& label_seq,
+    bool fast_exp)
+{
+    auto result = std::make_shared<dense_loss<T>>();
+
+    result->graph = graph;
+    result->weight = seg_score::make_weights<T>(features, var_tree, h_mat, *graph);
+    result->loss_func = std::make_shared<seg_fb::basic_marginal_log_loss<T>>(
+        *graph, result->weight->s->scores, label_seq, fast_exp);
+
+    return result;
+}
+
+struct grad_result {
+    std::shared_ptr<tensor_tree::vertex> param_grad;
+    double loss;
+    unsigned int nframes;
+    unsigned int downsampled;
+};
+
 struct learning_env {
 
     std::vector<std::string> features;
 
-    batch::scp frame_scp;
+    frame::scp frame_scp;
     batch::scp label_scp;
 
     int max_seg;
     int min_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
+    bool dense_scores;
+    bool float_scores;
+    bool exact_exp;
+
     std::string output_param;
     std::string output_opt_data;
 
@@ -41,6 +141,8 @@ struct learning_env {
     int layer;
     std::shared_ptr<tensor_tree::vertex> param;
 
+    grad_tree::buffer param_grad;
+
     double dropout;
     double clip;
     double step_size;
@@ -52,12 +154,67 @@ struct learning_env {
 
     std::vector<std::string> rep_labels;
 
-    std::shared_ptr<tensor_tree::optimizer> opt;
+    std::shared_ptr<param_arena::optimizer> opt;
+
+    int batch_size;
+
+    int nthread;
+    std::vector<std::default_random_engine> worker_gen;
+    std::vector<grad_tree::buffer> worker_grad;
+
+    // made once, so that workers keep their thread_local state
+    std::shared_ptr<worker_pool::pool> workers;
+
+    int prefetch_depth;
+    int loader_threads;
+    std::vector<std::shared_ptr<frame::scp>> loader_frame_scp;
+    std::vector<std::shared_ptr<batch::scp>> loader_label_scp;
+
+    std::shared_ptr<checkpoint::writer> checkpoint_writer;
+    int checkpoint_every;
+    int start_epoch;
+    int start_sample;
+
+    // per-sample lines are printed only without --report-every
+    // and --report-seconds
+    std::shared_ptr<telemetry::recorder> stats;
+
+    // stages shared by the utterances of a batch or a synchronous
+    // step go into the batch row
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
 
     std::unordered_map<std::string, std::string> args;
 
     learning_env(std::unordered_map<std::string, std::string> args);
 
+    sample load_sample(frame::scp& f_src, batch::scp& l_src, int i);
+
+    std::shared_ptr<ifst::fst> make_label_fst(std::vector<int> const& label_seq);
+
+    std::shared_ptr<utt_loss> make_loss(std::shared_ptr<tensor_tree::vertex> var_tree,
+        std::shared_ptr<autodiff::op_t> h_mat, int nframes,
+        std::vector<int> const& label_seq, std::default_random_engine& gen);
+
+    int backprop_start(int last_hidden, int h_mat);
+
+    int encoder_dim();
+
+    void train_batch(std::vector<sample>& batch, int nsample);
+
+    grad_result compute_grad(sample& s, std::default_random_engine& gen,
+        grad_tree::buffer& grad);
+
+    void print_result(grad_result const& r, sample const& s, int nsample);
+    void clip_and_update(grad_tree::buffer& grad, double scale = 1);
+    void end_step(int nsample);
+
+    void train_sync(std::vector<sample>& batch, int nsample);
+    void train_async(prefetch::loader<sample>& loader, int& nsample);
+
+    void save_checkpoint(int epoch, int nsample);
+    void resume(std::string filename);
+
     void run();
 
 };
@@ -73,6 +230,8 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"opt-data", "", true},
             {"features", "", true},
@@ -82,11 +241,20 @@ int main(int argc, char *argv[])
             {"dropout", "", false},
             {"seed", "", false},
             {"shuffle", "", false},
+            {"prefetch", "", false},
+            {"loader-threads", "", false},
             {"rep-labels", "", false},
             {"logsoftmax", "", false},
+            {"dense-scores", "", false},
+            {"seg-param", "param has seg weights, converted for --dense-scores", false},
+            {"float", "", false},
+            {"exact-exp", "use std::exp in the dense forward-backward", false},
             {"subsampling", "", false},
             {"type", "std,std-1b", true},
             {"nepoch", "", false},
+            {"batch-size", "", false},
+            {"threads", "", false},
+            {"async", "", false},
             {"opt", "const-step,const-step-momentum,rmsprop,adagrad,adam", true},
             {"step-size", "", true},
             {"clip", "", false},
@@ -94,6 +262,15 @@ int main(int argc, char *argv[])
             {"momentum", "", false},
             {"beta1", "", false},
             {"beta2", "", false},
+            {"checkpoint", "", false},
+            {"checkpoint-every", "", false},
+            {"resume", "", false},
+            {"report-every", "", false},
+            {"report-seconds", "", false},
+            {"report-file", "", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -128,7 +305,29 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
     std::string line;
     std::getline(param_ifs, line);
     layer = std::stoi(line);
-    param = make_tensor_tree(features, layer);
+    dense_scores = ebt::in(std::string("dense-scores"), args);
+    float_scores = ebt::in(std::string("float"), args);
+    exact_exp = ebt::in(std::string("exact-exp"), args);
+
+    if (float_scores && !dense_scores) {
+        throw std::logic_error("--float requires --dense-scores");
+    }
+
+    if (exact_exp && !dense_scores) {
+        throw std::logic_error("--exact-exp requires --dense-scores");
+    }
+
+    bool seg_param = ebt::in(std::string("seg-param"), args);
+
+    if (seg_param && !dense_scores) {
+        throw std::logic_error("--seg-param requires --dense-scores");
+    }
+
+    if (seg_param) {
+        seg_score::make_tensor_tree(features);
+    }
+
+    param = make_tensor_tree(features, layer, dense_scores && !seg_param);
     tensor_tree::load_tensor(param, param_ifs);
     param_ifs.close();
 
@@ -191,78 +390,435 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
         rep_labels = ebt::split(args.at("rep-labels"), ",");
     }
 
+    if (dense_scores && (args.at("type") != "std" || rep_labels.size() > 0)) {
+        throw std::logic_error("--dense-scores only supports --type std without --rep-labels");
+    }
+
+    if (seg_param) {
+        param->children[0] = seg_score::convert(features, param->children[0],
+            label_id, id_label, encoder_dim(), max_seg);
+    }
+
+    param_grad = grad_tree::buffer { make_tensor_tree(features, layer, dense_scores), param };
+
     indices.resize(frame_scp.entries.size());
 
     for (int i = 0; i < indices.size(); ++i) {
         indices[i] = i;
     }
 
-    if (args.at("opt") == "const-step") {
-        opt = std::make_shared<tensor_tree::const_step_opt>(
-            tensor_tree::const_step_opt{param, step_size});
-    } else if (args.at("opt") == "const-step-momentum") {
-        double momentum = std::stod(args.at("momentum"));
-        opt = std::make_shared<tensor_tree::const_step_momentum_opt>(
-            tensor_tree::const_step_momentum_opt{param, step_size, momentum});
+    batch_size = 1;
+    if (ebt::in(std::string("batch-size"), args)) {
+        batch_size = std::stoi(args.at("batch-size"));
+    }
+
+    nthread = 1;
+    if (ebt::in(std::string("threads"), args)) {
+        nthread = std::stoi(args.at("threads"));
+    }
+
+    if (nthread > 1 && batch_size > 1) {
+        throw std::logic_error("--threads and --batch-size cannot be used together");
+    }
+
+    // a single thread trains with gen and param_grad, but its engine
+    // is kept so that checkpoints have the same layout
+    for (int i = 0; i < nthread; ++i) {
+        worker_gen.push_back(std::default_random_engine { (unsigned int) (seed + i) });
+    }
+
+    if (nthread > 1) {
+        for (int i = 0; i < nthread; ++i) {
+            worker_grad.push_back(grad_tree::buffer { make_tensor_tree(features, layer, dense_scores), param });
+        }
+
+        workers = std::make_shared<worker_pool::pool>(nthread);
+    }
+
+    prefetch_depth = 0;
+    if (ebt::in(std::string("prefetch"), args)) {
+        prefetch_depth = std::stoi(args.at("prefetch"));
+    }
+
+    loader_threads = 1;
+    if (ebt::in(std::string("loader-threads"), args)) {
+        loader_threads = std::stoi(args.at("loader-threads"));
+    }
+
+    if (prefetch_depth > 0) {
+        for (int i = 0; i < loader_threads; ++i) {
+            loader_frame_scp.push_back(std::make_shared<frame::scp>());
+            loader_frame_scp.back()->open(args.at("frame-scp"));
+
+            loader_label_scp.push_back(std::make_shared<batch::scp>());
+            loader_label_scp.back()->open(args.at("label-scp"));
+        }
+    }
+
+    opt = std::make_shared<param_arena::optimizer>(param, args.at("opt"), step_size);
+
+    if (args.at("opt") == "const-step-momentum") {
+        opt->momentum = std::stod(args.at("momentum"));
     } else if (args.at("opt") == "rmsprop") {
-        double decay = std::stod(args.at("decay"));
-        opt = std::make_shared<tensor_tree::rmsprop_opt>(
-            tensor_tree::rmsprop_opt{param, step_size, decay});
-    } else if (args.at("opt") == "adagrad") {
-        opt = std::make_shared<tensor_tree::adagrad_opt>(
-            tensor_tree::adagrad_opt{param, step_size});
+        opt->decay = std::stod(args.at("decay"));
     } else if (args.at("opt") == "adam") {
-        double beta1 = std::stod(args.at("beta1"));
-        double beta2 = std::stod(args.at("beta2"));
-        opt = std::make_shared<tensor_tree::adam_opt>(
-            tensor_tree::adam_opt{param, step_size, beta1, beta2});
+        opt->beta1 = std::stod(args.at("beta1"));
+        opt->beta2 = std::stod(args.at("beta2"));
+    }
+
+    // the opt data of a seg model does not fit the converted weights
+    if (!seg_param) {
+        std::ifstream opt_data_ifs { args.at("opt-data") };
+        opt->load_opt_data(opt_data_ifs);
+        opt_data_ifs.close();
+    }
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
+
+    checkpoint_every = 0;
+    if (ebt::in(std::string("checkpoint-every"), args)) {
+        checkpoint_every = std::stoi(args.at("checkpoint-every"));
+    }
+
+    // async workers run the whole epoch and use their random engines
+    // while others would save them, so only the end of an epoch is a
+    // consistent point to save
+    if (checkpoint_every > 0 && nthread > 1 && ebt::in(std::string("async"), args)) {
+        throw std::logic_error("--checkpoint-every does not work with --async");
+    }
+
+    if (ebt::in(std::string("checkpoint"), args)) {
+        checkpoint_writer = std::make_shared<checkpoint::writer>(args.at("checkpoint"));
+    }
+
+    start_epoch = 0;
+    start_sample = 0;
+
+    if (ebt::in(std::string("resume"), args)) {
+        resume(args.at("resume"));
+    }
+
+    if (ebt::in(std::string("report-every"), args) || ebt::in(std::string("report-seconds"), args)) {
+        int report_every = 0;
+        if (ebt::in(std::string("report-every"), args)) {
+            report_every = std::stoi(args.at("report-every"));
+        }
+
+        double report_seconds = 0;
+        if (ebt::in(std::string("report-seconds"), args)) {
+            report_seconds = std::stod(args.at("report-seconds"));
+        }
+
+        std::string report_file;
+        if (ebt::in(std::string("report-file"), args)) {
+            report_file = args.at("report-file");
+        }
+
+        stats = std::make_shared<telemetry::recorder>(report_file,
+            report_every, report_seconds);
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(args.at("trace"));
+    }
+}
+
+/*
+ * The random engines are saved in the order gen, worker_gen, so a
+ * run can only be resumed with the same number of threads.
+ */
+void learning_env::save_checkpoint(int epoch, int nsample)
+{
+    checkpoint::state s = checkpoint::snapshot(param, *opt);
+
+    s.epoch = epoch;
+    s.nsample = nsample;
+    s.indices = indices;
+
+    s.rng.push_back(checkpoint::save_rng(gen));
+    for (auto& g: worker_gen) {
+        s.rng.push_back(checkpoint::save_rng(g));
+    }
+
+    checkpoint_writer->write(std::move(s));
+}
+
+void learning_env::resume(std::string filename)
+{
+    std::ifstream ifs { filename };
+    checkpoint::state s = checkpoint::load(ifs, param);
+
+    if (s.indices.size() != indices.size()) {
+        throw std::logic_error("checkpoint from a different data set");
+    }
+
+    if (s.rng.size() != worker_gen.size() + 1) {
+        throw std::logic_error("checkpoint from a run with a different number of threads");
+    }
+
+    std::istringstream opt_data_iss { s.opt_data };
+    opt->load_opt_data(opt_data_iss);
+
+    start_epoch = s.epoch;
+    start_sample = s.nsample;
+    indices = s.indices;
+
+    checkpoint::load_rng(gen, s.rng[0]);
+    for (int i = 0; i < worker_gen.size(); ++i) {
+        checkpoint::load_rng(worker_gen[i], s.rng[i + 1]);
+    }
+
+    std::cout << "resuming at epoch " << start_epoch + 1
+        << " sample " << start_sample << std::endl;
+}
+
+sample learning_env::load_sample(frame::scp& f_src, batch::scp& l_src, int i)
+{
+    sample result;
+
+    result.key = f_src.entries[i].key;
+
+    stage_timer::utterance utt { profile.get(), timeline.get() };
+    utt.set_key(result.key);
+    stage_timer::scope load_time { "load" };
+
+    result.frames = f_src.at(i, result.buf);
+    result.label_seq = speech::load_label_seq_batch(l_src.at(i), label_id);
+
+    utt.set_nframes(result.frames.nframes);
+
+    return result;
+}
+
+std::shared_ptr<ifst::fst> learning_env::make_label_fst(std::vector<int> const& label_seq)
+{
+    std::shared_ptr<ifst::fst> label_fst;
+    if (args.at("type") == "std") {
+        if (rep_labels.size() > 0) {
+            label_fst = std::make_shared<ifst::fst>(
+                seg::make_label_fst(label_seq, label_id, id_label, rep_labels));
+        } else {
+            label_fst = std::make_shared<ifst::fst>(
+                seg::make_label_fst(label_seq, label_id, id_label));
+        }
+    } else if (args.at("type") == "std-1b") {
+        label_fst = std::make_shared<ifst::fst>(
+            seg::make_label_fst_1b(label_seq, label_id, id_label));
     } else {
-        throw std::logic_error("unknown optimizer " + args.at("opt"));
+        throw std::logic_error("unknown type " + args.at("type"));
     }
 
-    std::ifstream opt_data_ifs { args.at("opt-data") };
-    opt->load_opt_data(opt_data_ifs);
-    opt_data_ifs.close();
+    return label_fst;
 }
 
-void learning_env::run()
+std::shared_ptr<utt_loss> learning_env::make_loss(std::shared_ptr<tensor_tree::vertex> var_tree,
+    std::shared_ptr<autodiff::op_t> h_mat, int nframes,
+    std::vector<int> const& label_seq, std::default_random_engine& gen)
+{
+    if (dense_scores) {
+        stage_timer::scope graph_time { "make_graph" };
+        auto graph = seg_graph::make_graph(nframes, label_id, id_label, min_seg, max_seg, stride);
+        graph_time.stop();
+
+        stage_timer::scope weights_time { "make_weights" };
+
+        if (float_scores) {
+            return make_dense_loss<float>(features, var_tree->children[0], h_mat, graph, label_seq,
+                !exact_exp);
+        } else {
+            return make_dense_loss<double>(features, var_tree->children[0], h_mat, graph, label_seq,
+                !exact_exp);
+        }
+    }
+
+    auto result = std::make_shared<fst_loss>();
+
+    graph_cache::entry graph_entry = graphs->at(nframes);
+    result->graph_data.fst = graph_entry.fst;
+    result->graph_data.topo_order = graph_entry.topo_order;
+
+    stage_timer::scope weights_time { "make_weights" };
+
+    if (ebt::in(std::string("dropout"), args)) {
+        result->graph_data.weight_func = seg::make_weights(features, var_tree->children[0], h_mat,
+            dropout, &gen);
+    } else {
+        result->graph_data.weight_func = seg::make_weights(features, var_tree->children[0], h_mat);
+    }
+
+    result->label_fst = make_label_fst(label_seq);
+
+    result->loss_func = std::shared_ptr<seg::marginal_log_loss>(
+        new seg::marginal_log_loss { result->graph_data, *result->label_fst });
+
+    return result;
+}
+
+/*
+ * The weights from seg::make_weights push their gradients into the
+ * hidden states themselves, so backprop starts at the last hidden
+ * state.  The dense scorer adds no operations to the graph but leaves
+ * its gradient on h_mat, so backprop starts there.
+ */
+int learning_env::backprop_start(int last_hidden, int h_mat)
+{
+    if (dense_scores) {
+        return h_mat;
+    } else {
+        return last_hidden;
+    }
+}
+
+/*
+ * Dimension of the hidden states, from the encoder run without dropout
+ * over the first utterance.
+ */
+int learning_env::encoder_dim()
 {
-    ebt::Timer timer;
+    if (ebt::in(std::string("logsoftmax"), args)) {
+        return label_id.size();
+    }
+
+    frame::mat buf;
+    frame::view frames = frame_scp.at(0, buf);
+
+    autodiff::computation_graph comp_graph;
+    std::shared_ptr<tensor_tree::vertex> var_tree
+        = tensor_tree::make_var_tree(comp_graph, param);
+
+    std::shared_ptr<autodiff::op_t> input
+        = comp_graph.var(la::cpu::weak_tensor<double>(
+            frames.data, { frames.nframes, frames.ndim }));
 
-    for (int epoch = 0; epoch < nepoch; ++epoch) {
+    std::shared_ptr<lstm::transcriber> trans = lstm_frame::make_transcriber(
+        param->children[1]->children[0], 0.0, nullptr,
+        ebt::in(std::string("subsampling"), args));
+
+    lstm::trans_seq_t input_seq;
+    input_seq.nframes = frames.nframes;
+    input_seq.batch_size = 1;
+    input_seq.dim = frames.ndim;
+    input_seq.feat = input;
+    input_seq.mask = nullptr;
+
+    lstm::trans_seq_t output_seq = (*trans)(var_tree->children[1]->children[0], input_seq);
+
+    auto& hidden_t = autodiff::get_output<la::cpu::tensor_like<double>>(output_seq.feat);
+
+    return hidden_t.size(1);
+}
+
+void learning_env::run()
+{
+    for (int epoch = start_epoch; epoch < nepoch; ++epoch) {
 
         int nsample = 0;
 
-        if (ebt::in(std::string("shuffle"), args)) {
+        // a resumed epoch keeps the order of the checkpoint
+        if (epoch == start_epoch && ebt::in(std::string("resume"), args)) {
+            nsample = start_sample;
+        } else if (ebt::in(std::string("shuffle"), args)) {
             std::shuffle(indices.begin(), indices.end(), gen);
         }
 
+        int last_checkpoint = nsample;
+
+        std::vector<int> order { indices.begin() + nsample, indices.end() };
+
+        prefetch::loader<sample> loader { order, prefetch_depth,
+            prefetch_depth > 0 ? loader_threads : 0,
+            [&](int thread, int i) -> sample {
+                if (prefetch_depth > 0) {
+                    return load_sample(*loader_frame_scp[thread], *loader_label_scp[thread], i);
+                } else {
+                    return load_sample(frame_scp, label_scp, i);
+                }
+            }};
+
         while (nsample < indices.size()) {
 
-            std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_scp.at(indices[nsample]));
+            if (checkpoint_writer != nullptr && checkpoint_every > 0
+                    && nsample - last_checkpoint >= checkpoint_every) {
+                save_checkpoint(epoch, nsample);
+                last_checkpoint = nsample;
+            }
+
+            if (nthread > 1 && ebt::in(std::string("async"), args)) {
+                train_async(loader, nsample);
+
+                continue;
+            }
+
+            if (nthread > 1) {
+                std::vector<sample> batch;
+
+                while (batch.size() < nthread && nsample < indices.size()) {
+                    batch.push_back(loader.next());
+                    ++nsample;
+                }
+
+                train_sync(batch, nsample);
+
+                continue;
+            }
+
+            if (batch_size > 1) {
+                std::vector<sample> batch;
+
+                while (batch.size() < batch_size && nsample < indices.size()) {
+                    batch.push_back(loader.next());
+                    ++nsample;
+                }
+
+                train_batch(batch, nsample);
 
-            std::vector<int> label_seq = speech::load_label_seq_batch(label_scp.at(indices[nsample]), label_id);
+                continue;
+            }
 
-            std::cout << "sample: " << nsample + 1 << std::endl;
-            std::cout << "gold len: " << label_seq.size() << std::endl;
+            sample s = loader.next();
+
+            frame::view& frames = s.frames;
+            std::vector<int>& label_seq = s.label_seq;
+
+            if (stats == nullptr) {
+                std::cout << "sample: " << nsample + 1 << std::endl;
+                std::cout << "gold len: " << label_seq.size() << std::endl;
+            }
+
+            stage_timer::utterance utt { profile.get(), timeline.get(), (int) frames.nframes };
+            utt.set_key(s.key);
 
             autodiff::computation_graph comp_graph;
             std::shared_ptr<tensor_tree::vertex> var_tree
                 = tensor_tree::make_var_tree(comp_graph, param);
 
-            std::vector<double> frame_cat;
-            frame_cat.reserve(frames.size() * frames.front().size());
-
-            for (int i = 0; i < frames.size(); ++i) {
-                frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-            }
+            param_grad.bind(var_tree);
 
-            unsigned int nframes = frames.size();
-            unsigned int ndim = frames.front().size();
+            stage_timer::scope encoder_time { "encoder" };
 
             std::shared_ptr<autodiff::op_t> input
                 = comp_graph.var(la::cpu::weak_tensor<double>(
-                    frame_cat.data(), { nframes, ndim }));
+                    frames.data, { frames.nframes, frames.ndim }));
 
             input->grad_needed = false;
 
@@ -274,9 +830,9 @@ void learning_env::run()
             }
 
             lstm::trans_seq_t input_seq;
-            input_seq.nframes = frames.size();
+            input_seq.nframes = frames.nframes;
             input_seq.batch_size = 1;
-            input_seq.dim = frames.front().size();
+            input_seq.dim = frames.ndim;
             input_seq.feat = input;
             input_seq.mask = nullptr;
 
@@ -294,71 +850,61 @@ void learning_env::run()
 
             auto& hidden_t = autodiff::get_output<la::cpu::tensor_like<double>>(hidden);
 
-            std::cout << "frames: " << frames.size() << " downsampled: " << hidden_t.size(0) << std::endl;
+            encoder_time.stop();
+
+            if (stats == nullptr) {
+                std::cout << "frames: " << frames.nframes << " downsampled: " << hidden_t.size(0) << std::endl;
+            } else {
+                stats->count("frames", frames.nframes);
+            }
 
             if (hidden_t.size(0) < label_seq.size()) {
+                if (stats != nullptr) {
+                    stats->count("too_short");
+                    stats->step();
+                }
+
                 ++nsample;
                 continue;
             }
 
-            seg::iseg_data graph_data;
-            graph_data.fst = seg::make_graph(hidden_t.size(0), label_id, id_label, min_seg, max_seg, stride);
-            graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
-
             auto& m = hidden_t.as_matrix();
             auto h_mat = autodiff::weak_var(hidden, 0, std::vector<unsigned int> { m.rows(), m.cols() });
 
-            if (ebt::in(std::string("dropout"), args)) {
-                graph_data.weight_func = seg::make_weights(features, var_tree->children[0], h_mat,
-                    dropout, &gen);
-            } else {
-                graph_data.weight_func = seg::make_weights(features, var_tree->children[0], h_mat);
-            }
+            std::shared_ptr<utt_loss> loss_func = make_loss(var_tree, h_mat,
+                hidden_t.size(0), label_seq, gen);
 
-            seg::loss_func *loss_func;
+            stage_timer::scope loss_time { "loss" };
+            double ell = loss_func->loss();
+            loss_time.stop();
 
-            std::shared_ptr<ifst::fst> label_fst;
-            if (args.at("type") == "std") {
-                if (rep_labels.size() > 0) {
-                    label_fst = std::make_shared<ifst::fst>(
-                        seg::make_label_fst(label_seq, label_id, id_label, rep_labels));
-                } else {
-                    label_fst = std::make_shared<ifst::fst>(
-                        seg::make_label_fst(label_seq, label_id, id_label));
-                }
-            } else if (args.at("type") == "std-1b") {
-                label_fst = std::make_shared<ifst::fst>(
-                    seg::make_label_fst_1b(label_seq, label_id, id_label));
+            if (stats == nullptr) {
+                std::cout << "loss: " << ell << std::endl;
+                std::cout << "E: " << ell / label_seq.size() << std::endl;
             } else {
-                throw std::logic_error("unknown type " + args.at("type"));
+                stats->observe("loss", ell);
+                stats->observe("E", ell / label_seq.size());
             }
 
-            loss_func = new seg::marginal_log_loss { graph_data, *label_fst };
-
-            double ell = loss_func->loss();
-
-            std::cout << "loss: " << ell << std::endl;
-            std::cout << "E: " << ell / label_seq.size() << std::endl;
-
-            std::shared_ptr<tensor_tree::vertex> param_grad = make_tensor_tree(features, layer);
-
             if (ell > 0) {
+                stage_timer::scope grad_time { "loss_grad" };
                 loss_func->grad();
+                grad_time.stop();
 
-                graph_data.weight_func->grad();
+                stage_timer::scope backward_time { "backward" };
 
                 std::vector<std::shared_ptr<autodiff::op_t>> topo_order;
 
-                for (int i = hidden->id; i >= 0; --i) {
+                for (int i = backprop_start(hidden->id, h_mat->id); i >= 0; --i) {
                     topo_order.push_back(comp_graph.vertices.at(i));
                 }
 
                 autodiff::guarded_grad(topo_order, autodiff::grad_funcs);
 
-                tensor_tree::copy_grad(param_grad, var_tree);
+                backward_time.stop();
 
-                {
-                    auto vars = tensor_tree::leaves_pre_order(param_grad);
+                if (stats == nullptr) {
+                    auto vars = tensor_tree::leaves_pre_order(param_grad.tree);
                     std::cout << vars.back()->name << " "
                         << "analytic grad: " << tensor_tree::get_tensor(vars[0]).data()[0]
                         << std::endl;
@@ -369,42 +915,40 @@ void learning_env::run()
 
                 double v1 = tensor_tree::get_tensor(vars[0]).data()[0];
 
-                if (ebt::in(std::string("clip"), args)) {
-                    double n = tensor_tree::norm(param_grad);
-
-                    std::cout << "grad norm: " << n;
-
-                    if (n > clip) {
-                        tensor_tree::axpy(param_grad, clip / n - 1, param_grad);
-
-                        std::cout << " clip: " << clip << " gradient clipped";
-                    }
-
-                    std::cout << std::endl;
-                }
-
-                opt->update(param_grad);
+                clip_and_update(param_grad);
 
                 double v2 = tensor_tree::get_tensor(vars[0]).data()[0];
 
-                std::cout << "weight: " << v1 << " update: " << v2 - v1
-                    << " ratio: " << (v2 - v1) / v1 << std::endl;
+                if (stats == nullptr) {
+                    std::cout << "weight: " << v1 << " update: " << v2 - v1
+                        << " ratio: " << (v2 - v1) / v1 << std::endl;
+                } else {
+                    stats->gauge("update_ratio", (v2 - v1) / v1);
+                }
 
             }
 
             if (ell < 0) {
-                std::cout << "loss is less than zero.  skipping." << std::endl;
+                if (stats == nullptr) {
+                    std::cout << "loss is less than zero.  skipping." << std::endl;
+                } else {
+                    stats->count("negative_loss");
+                }
             }
 
-            double n = tensor_tree::norm(param);
-
-            std::cout << "norm: " << n << std::endl;
-
-            std::cout << std::endl;
+            end_step(1);
 
             ++nsample;
+        }
+
+        if (prefetch_depth > 0) {
+            std::cout << "prefetch stalls: " << loader.stalls
+                << " wait: " << loader.stall_time << std::endl;
+        }
 
-            delete loss_func;
+        // resuming from the end of an epoch shuffles for the next one
+        if (checkpoint_writer != nullptr) {
+            save_checkpoint(epoch, nsample);
         }
     }
 
@@ -417,5 +961,488 @@ void learning_env::run()
     opt->save_opt_data(opt_data_ofs);
     opt_data_ofs.close();
 
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cout);
+        graphs->report(std::cout);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
+}
+
+/*
+ * Run the encoder once over the padded batch, add up the gradients
+ * of the marginal log loss of each utterance on its slice of the
+ * hidden states, and update the parameters once.
+ */
+void learning_env::train_batch(std::vector<sample>& batch, int nsample)
+{
+    if (stats == nullptr) {
+        std::cout << "sample: " << nsample - batch.size() + 1 << "-" << nsample << std::endl;
+    }
+
+    std::vector<frame::view> utts;
+    for (auto& s: batch) {
+        utts.push_back(s.frames);
+    }
+
+    minibatch::padded_batch padded;
+    minibatch::pad(padded, utts);
+
+    int total_frames = 0;
+    for (auto& n: padded.lengths) {
+        total_frames += n;
+    }
+
+    stage_timer::utterance batch_utt { profile.get(), timeline.get(), total_frames };
+    batch_utt.set_batch(batch.size());
+
+    autodiff::computation_graph comp_graph;
+    std::shared_ptr<tensor_tree::vertex> var_tree
+        = tensor_tree::make_var_tree(comp_graph, param);
+
+    param_grad.bind(var_tree);
+
+    stage_timer::scope encoder_time { "encoder" };
+
+    lstm::trans_seq_t input_seq = minibatch::make_input_seq(comp_graph, padded);
+
+    std::shared_ptr<lstm::transcriber> trans;
+    if (ebt::in(std::string("subsampling"), args)) {
+        trans = lstm_frame::make_transcriber(param->children[1]->children[0], dropout, &gen, true);
+    } else {
+        trans = lstm_frame::make_transcriber(param->children[1]->children[0], dropout, &gen, false);
+    }
+
+    lstm::trans_seq_t output_seq = (*trans)(var_tree->children[1]->children[0], input_seq);
+
+    if (ebt::in(std::string("logsoftmax"), args)) {
+        lstm::fc_transcriber fc_trans { (int) label_id.size() };
+        lstm::logsoftmax_transcriber logsoftmax_trans;
+        auto score = fc_trans(var_tree->children[1]->children[1], output_seq);
+
+        output_seq = logsoftmax_trans(nullptr, score);
+    }
+
+    std::shared_ptr<autodiff::op_t> hidden = output_seq.feat;
+
+    encoder_time.stop();
+
+    // utterances too short for their labels get no slice
+    std::vector<unsigned int> lengths;
+    std::vector<unsigned int> slice_lengths;
+
+    for (int b = 0; b < batch.size(); ++b) {
+        lengths.push_back(minibatch::output_length(padded.lengths[b],
+            padded.nframes, output_seq.nframes));
+
+        if (lengths.back() < batch[b].label_seq.size()) {
+            slice_lengths.push_back(0);
+        } else {
+            slice_lengths.push_back(lengths.back());
+        }
+    }
+
+    minibatch::slices h_mats { comp_graph, hidden, output_seq.batch_size,
+        output_seq.dim, slice_lengths };
+
+    bool has_grad = false;
+
+    for (int b = 0; b < batch.size(); ++b) {
+        std::vector<int>& label_seq = batch[b].label_seq;
+
+        if (stats == nullptr) {
+            std::cout << "gold len: " << label_seq.size()
+                << " frames: " << padded.lengths[b] << " downsampled: " << lengths[b] << std::endl;
+        } else {
+            stats->count("frames", padded.lengths[b]);
+        }
+
+        if (h_mats.vars[b] == nullptr) {
+            if (stats != nullptr) {
+                stats->count("too_short");
+            }
+
+            continue;
+        }
+
+        stage_timer::utterance utt { profile.get(), timeline.get(), (int) padded.lengths[b] };
+        utt.set_key(batch[b].key);
+
+        std::shared_ptr<utt_loss> loss_func = make_loss(var_tree, h_mats.vars[b],
+            lengths[b], label_seq, gen);
+
+        stage_timer::scope loss_time { "loss" };
+        double ell = loss_func->loss();
+        loss_time.stop();
+
+        if (stats == nullptr) {
+            std::cout << "loss: " << ell << std::endl;
+            std::cout << "E: " << ell / label_seq.size() << std::endl;
+        } else {
+            stats->observe("loss", ell);
+            stats->observe("E", ell / label_seq.size());
+        }
+
+        if (ell > 0) {
+            stage_timer::scope grad_time { "loss_grad" };
+            loss_func->grad();
+
+            has_grad = true;
+        }
+
+        if (ell < 0) {
+            if (stats == nullptr) {
+                std::cout << "loss is less than zero.  skipping." << std::endl;
+            } else {
+                stats->count("negative_loss");
+            }
+        }
+    }
+
+    if (has_grad) {
+        stage_timer::scope backward_time { "backward" };
+
+        h_mats.scatter_grad();
+
+        // the slices are leaves after hidden, so backprop starts there
+        std::vector<std::shared_ptr<autodiff::op_t>> topo_order;
+
+        for (int i = hidden->id; i >= 0; --i) {
+            topo_order.push_back(comp_graph.vertices.at(i));
+        }
+
+        autodiff::guarded_grad(topo_order, autodiff::grad_funcs);
+
+        backward_time.stop();
+
+        clip_and_update(param_grad);
+    }
+
+    end_step(batch.size());
+}
+
+/*
+ * Forward and backward pass of one utterance on its own graph.
+ * Nothing is printed and param is only read, so several threads
+ * can run this at the same time, each with its own gradient buffer.
+ * param_grad is the tree of grad, or null when the utterance is
+ * skipped or has zero loss.
+ */
+grad_result learning_env::compute_grad(sample& s, std::default_random_engine& gen,
+    grad_tree::buffer& grad)
+{
+    grad_result result;
+    result.loss = 0;
+
+    frame::view& frames = s.frames;
+    std::vector<int>& label_seq = s.label_seq;
+
+    stage_timer::utterance utt { profile.get(), timeline.get(), (int) frames.nframes };
+    utt.set_key(s.key);
+
+    autodiff::computation_graph comp_graph;
+    std::shared_ptr<tensor_tree::vertex> var_tree
+        = tensor_tree::make_var_tree(comp_graph, param);
+
+    grad.bind(var_tree);
+
+    stage_timer::scope encoder_time { "encoder" };
+
+    std::shared_ptr<autodiff::op_t> input
+        = comp_graph.var(la::cpu::weak_tensor<double>(
+            frames.data, { frames.nframes, frames.ndim }));
+
+    input->grad_needed = false;
+
+    std::shared_ptr<lstm::transcriber> trans;
+    if (ebt::in(std::string("subsampling"), args)) {
+        trans = lstm_frame::make_transcriber(param->children[1]->children[0], dropout, &gen, true);
+    } else {
+        trans = lstm_frame::make_transcriber(param->children[1]->children[0], dropout, &gen, false);
+    }
+
+    lstm::trans_seq_t input_seq;
+    input_seq.nframes = frames.nframes;
+    input_seq.batch_size = 1;
+    input_seq.dim = frames.ndim;
+    input_seq.feat = input;
+    input_seq.mask = nullptr;
+
+    lstm::trans_seq_t output_seq = (*trans)(var_tree->children[1]->children[0], input_seq);
+
+    if (ebt::in(std::string("logsoftmax"), args)) {
+        lstm::fc_transcriber fc_trans { (int) label_id.size() };
+        lstm::logsoftmax_transcriber logsoftmax_trans;
+        auto score = fc_trans(var_tree->children[1]->children[1], output_seq);
+
+        output_seq = logsoftmax_trans(nullptr, score);
+    }
+
+    std::shared_ptr<autodiff::op_t> hidden = output_seq.feat;
+
+    auto& hidden_t = autodiff::get_output<la::cpu::tensor_like<double>>(hidden);
+
+    encoder_time.stop();
+
+    result.nframes = frames.nframes;
+    result.downsampled = hidden_t.size(0);
+
+    if (hidden_t.size(0) < label_seq.size()) {
+        return result;
+    }
+
+    auto& m = hidden_t.as_matrix();
+    auto h_mat = autodiff::weak_var(hidden, 0, std::vector<unsigned int> { m.rows(), m.cols() });
+
+    std::shared_ptr<utt_loss> loss_func = make_loss(var_tree, h_mat,
+        hidden_t.size(0), label_seq, gen);
+
+    stage_timer::scope loss_time { "loss" };
+    result.loss = loss_func->loss();
+    loss_time.stop();
+
+    if (result.loss > 0) {
+        stage_timer::scope grad_time { "loss_grad" };
+        loss_func->grad();
+        grad_time.stop();
+
+        stage_timer::scope backward_time { "backward" };
+
+        std::vector<std::shared_ptr<autodiff::op_t>> topo_order;
+
+        for (int i = backprop_start(hidden->id, h_mat->id); i >= 0; --i) {
+            topo_order.push_back(comp_graph.vertices.at(i));
+        }
+
+        autodiff::guarded_grad(topo_order, autodiff::grad_funcs);
+
+        backward_time.stop();
+
+        result.param_grad = grad.tree;
+    }
+
+    return result;
+}
+
+void learning_env::print_result(grad_result const& r, sample const& s, int nsample)
+{
+    if (stats != nullptr) {
+        stats->count("frames", r.nframes);
+
+        if (r.downsampled < s.label_seq.size()) {
+            stats->count("too_short");
+            return;
+        }
+
+        stats->observe("loss", r.loss);
+        stats->observe("E", r.loss / s.label_seq.size());
+
+        if (r.loss < 0) {
+            stats->count("negative_loss");
+        }
+
+        return;
+    }
+
+    std::cout << "sample: " << nsample << std::endl;
+    std::cout << "gold len: " << s.label_seq.size() << std::endl;
+    std::cout << "frames: " << r.nframes << " downsampled: " << r.downsampled << std::endl;
+
+    if (r.downsampled < s.label_seq.size()) {
+        return;
+    }
+
+    std::cout << "loss: " << r.loss << std::endl;
+    std::cout << "E: " << r.loss / s.label_seq.size() << std::endl;
+
+    if (r.loss < 0) {
+        std::cout << "loss is less than zero.  skipping." << std::endl;
+    }
+}
+
+/*
+ * Updates with scale times the gradient in grad.  The norm and the
+ * check for nan and inf take one pass over the buffer, clipping folds
+ * into scale, and the optimizer applies scale as it reads the arena,
+ * so the update is one more pass.  A gradient that is not finite is
+ * dropped rather than fed to the optimizer.
+ */
+void learning_env::clip_and_update(grad_tree::buffer& grad, double scale)
+{
+    stage_timer::scope update_time { "update" };
+
+    param_arena::grad_stats g = grad.stats();
+
+    if (!g.finite) {
+        if (stats == nullptr) {
+            std::cout << "gradient has nan or inf.  skipping." << std::endl;
+        } else {
+            stats->count("nonfinite_grad");
+        }
+
+        return;
+    }
+
+    if (ebt::in(std::string("clip"), args)) {
+        double n = scale * g.norm;
+
+        if (stats == nullptr) {
+            std::cout << "grad norm: " << n;
+        } else {
+            stats->observe("grad_norm", n);
+        }
+
+        if (n > clip) {
+            scale *= clip / n;
+
+            if (stats == nullptr) {
+                std::cout << " clip: " << clip << " gradient clipped";
+            } else {
+                stats->count("clipped");
+            }
+        }
+
+        if (stats == nullptr) {
+            std::cout << std::endl;
+        }
+    }
+
+    opt->update(grad.data(), grad.size(), scale);
+}
+
+/*
+ * Ends a step of nsample samples, either with the norm of the
+ * parameters on stdout, or in the telemetry, where the pass over the
+ * model is only taken for a report.
+ */
+void learning_env::end_step(int nsample)
+{
+    if (stats == nullptr) {
+        double n = tensor_tree::norm(param);
+
+        std::cout << "norm: " << n << std::endl;
+
+        std::cout << std::endl;
+    } else {
+        if (stats->due()) {
+            stats->gauge("param_norm", tensor_tree::norm(param));
+        }
+
+        stats->step(nsample);
+    }
+}
+
+/*
+ * Synchronous data parallelism: sample i of the step goes to worker i
+ * with its own random engine, and the gradients are added up in worker
+ * order, so the result does not depend on thread scheduling.
+ */
+void learning_env::train_sync(std::vector<sample>& batch, int nsample)
+{
+    std::vector<grad_result> results;
+    results.resize(batch.size());
+
+    workers->run(batch.size(), [&](int i) {
+        results[i] = compute_grad(batch[i], worker_gen[i], worker_grad[i]);
+    });
+
+    // the gradients are added up in the buffer of the first worker
+    // that has one
+    grad_tree::buffer *sum = nullptr;
+    int ngrad = 0;
+
+    int total_frames = 0;
+    for (auto& s: batch) {
+        total_frames += s.frames.nframes;
+    }
+
+    stage_timer::utterance utt { profile.get(), timeline.get(), total_frames };
+    utt.set_batch(batch.size());
+
+    for (int i = 0; i < batch.size(); ++i) {
+        print_result(results[i], batch[i], nsample - batch.size() + i + 1);
+
+        if (results[i].param_grad == nullptr) {
+            continue;
+        }
+
+        if (sum == nullptr) {
+            sum = &worker_grad[i];
+        } else {
+            tensor_tree::iadd(sum->tree, results[i].param_grad);
+        }
+
+        ++ngrad;
+    }
+
+    // the mean, so that the step size does not grow with --threads
+    if (sum != nullptr) {
+        clip_and_update(*sum, 1.0 / ngrad);
+    }
+
+    end_step(batch.size());
 }
 
+/*
+ * Hogwild-style data parallelism: every worker takes the next sample,
+ * computes its gradient against the current parameters, and updates
+ * right away without waiting for the others.  Updates are serialized,
+ * but a worker may read the parameters while another one updates them,
+ * so runs are not reproducible.
+ */
+void learning_env::train_async(prefetch::loader<sample>& loader, int& nsample)
+{
+    std::mutex load_mutex;
+    std::mutex update_mutex;
+
+    workers->run(nthread, [&](int i) {
+        while (1) {
+            sample s;
+            int k;
+
+            {
+                std::lock_guard<std::mutex> lock { load_mutex };
+
+                if (nsample >= indices.size()) {
+                    break;
+                }
+
+                s = loader.next();
+                k = ++nsample;
+            }
+
+            grad_result r = compute_grad(s, worker_gen[i], worker_grad[i]);
+
+            std::lock_guard<std::mutex> lock { update_mutex };
+
+            print_result(r, s, k);
+
+            if (r.param_grad != nullptr) {
+                stage_timer::utterance utt { profile.get(), timeline.get(), (int) s.frames.nframes };
+                utt.set_key(s.key);
+                clip_and_update(worker_grad[i]);
+            }
+
+            if (stats == nullptr) {
+                std::cout << std::endl;
+            } else {
+                stats->step();
+            }
+        }
+    });
+
+    if (stats == nullptr) {
+        double n = tensor_tree::norm(param);
+
+        std::cout << "norm: " << n << std::endl;
+
+        std::cout << std::endl;
+    }
+}
@@ -5,39 +5,91 @@
 #include "fst/fst-algo.h"
 #include "nn/lstm-frame.h"
 #include <fstream>
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/seg-graph.h"
+#include "segbin/seg-score.h"
+#include "segbin/seg-viterbi.h"
+#include "segbin/reorder.h"
+#include "segbin/param-file.h"
+#include "segbin/stage-timer.h"
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
     std::vector<std::string> const& features,
-    int layer)
+    int layer, bool dense_scores)
 {
     tensor_tree::vertex root;
 
-    root.children.push_back(seg::make_tensor_tree(features));
+    if (dense_scores) {
+        root.children.push_back(seg_score::make_tensor_tree(features));
+    } else {
+        root.children.push_back(seg::make_tensor_tree(features));
+    }
     root.children.push_back(lstm_frame::make_tensor_tree(layer));
 
     return std::make_shared<tensor_tree::vertex>(root);
 }
 
+template <class graph_t>
+void print_path(std::ostream& out, graph_t& graph, std::vector<int> const& path,
+    std::vector<std::string> const& id_label, std::string const& key, bool print_times)
+{
+    if (print_times) {
+        out << key << std::endl;
+        for (auto& e: path) {
+            out << graph.time(graph.tail(e))
+                << " " << graph.time(graph.head(e))
+                << " " << id_label.at(graph.output(e)) << std::endl;
+        }
+        out << "." << std::endl;
+    } else {
+        for (auto& e: path) {
+            out << id_label.at(graph.output(e)) << " ";
+        }
+        out << "(" << key << ")";
+        out << std::endl;
+    }
+}
+
 struct prediction_env {
 
     std::vector<std::string> features;
 
-    batch::scp frame_scp;
+    frame::scp frame_scp;
 
     int min_seg;
     int max_seg;
     int stride;
 
+    std::shared_ptr<graph_cache::lru> graphs;
+
     int layer;
     std::shared_ptr<tensor_tree::vertex> param;
 
+    // scorer parameters converted from the seg weights of param, made
+    // once the first utterance gives the hidden dimension
+    std::once_flag convert_once;
+    std::shared_ptr<tensor_tree::vertex> dense_param;
+
     std::vector<std::string> id_label;
     std::unordered_map<std::string, int> label_id;
 
+    int nthread;
+    std::vector<std::shared_ptr<frame::scp>> thread_frame_scp;
+
+    std::shared_ptr<stage_timer::profile> profile;
+    std::shared_ptr<trace::recorder> timeline;
+
     std::unordered_map<std::string, std::string> args;
 
     prediction_env(std::unordered_map<std::string, std::string> args);
 
+    std::string decode(frame::scp& f_scp, int nsample);
+
     void run();
 
 };
@@ -52,12 +104,21 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"features", "", true},
             {"subsampling", "", false},
             {"logsoftmax", "", false},
             {"label", "", true},
             {"print-path", "", false},
+            {"threads", "", false},
+            {"dense-scores", "", false},
+            {"seg-param", "param has seg weights, converted for --dense-scores", false},
+            {"float", "", false},
+            {"stage-times", "", false},
+            {"frame-shift", "", false},
+            {"trace", "", false},
         }
     };
 
@@ -87,13 +148,30 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
 
     frame_scp.open(args.at("frame-scp"));
 
-    std::ifstream param_ifs { args.at("param") };
+    param_file::reader param_src;
+    param_src.open(args.at("param"));
     std::string line;
-    std::getline(param_ifs, line);
+    std::getline(param_src.header(), line);
     layer = std::stoi(line);
-    param = make_tensor_tree(features, layer);
-    tensor_tree::load_tensor(param, param_ifs);
-    param_ifs.close();
+
+    bool dense_scores = ebt::in(std::string("dense-scores"), args);
+    bool seg_param = ebt::in(std::string("seg-param"), args);
+
+    if (ebt::in(std::string("float"), args) && !dense_scores) {
+        throw std::logic_error("--float requires --dense-scores");
+    }
+
+    if (seg_param && !dense_scores) {
+        throw std::logic_error("--seg-param requires --dense-scores");
+    }
+
+    if (seg_param) {
+        // fails on features the dense scorer does not have
+        seg_score::make_tensor_tree(features);
+    }
+
+    param = make_tensor_tree(features, layer, dense_scores && !seg_param);
+    param_src.load(param);
 
     max_seg = 20;
     if (ebt::in(std::string("max-seg"), args)) {
@@ -116,96 +194,208 @@ prediction_env::prediction_env(std::unordered_map<std::string, std::string> args
     }
 
     assert(id_label[0] == "<eps>");
+
+    nthread = 1;
+    if (ebt::in(std::string("threads"), args)) {
+        nthread = std::stoi(args.at("threads"));
+    }
+
+    for (int i = 1; i < nthread; ++i) {
+        thread_frame_scp.push_back(std::make_shared<frame::scp>());
+        thread_frame_scp.back()->open(args.at("frame-scp"));
+    }
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
+
+    if (ebt::in(std::string("stage-times"), args)) {
+        double frame_shift = 0.01;
+        if (ebt::in(std::string("frame-shift"), args)) {
+            frame_shift = std::stod(args.at("frame-shift"));
+        }
+
+        profile = std::make_shared<stage_timer::profile>(frame_shift);
+    }
+
+    if (ebt::in(std::string("trace"), args)) {
+        timeline = std::make_shared<trace::recorder>(args.at("trace"));
+    }
 }
 
-void prediction_env::run()
+std::string prediction_env::decode(frame::scp& f_scp, int nsample)
 {
-    int nsample = 0;
+    std::ostringstream out;
 
-    while (nsample < frame_scp.entries.size()) {
+    stage_timer::utterance utt { profile.get(), timeline.get() };
+    utt.set_key(f_scp.entries[nsample].key);
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_scp.at(nsample));
+    stage_timer::scope load_time { "load" };
+    frame::view frames = f_scp.at(nsample);
+    utt.set_nframes(frames.nframes);
+    load_time.stop();
 
-        autodiff::computation_graph comp_graph;
-        std::shared_ptr<tensor_tree::vertex> var_tree
-            = tensor_tree::make_var_tree(comp_graph, param);
+    stage_timer::scope encoder_time { "encoder" };
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
+    autodiff::computation_graph comp_graph;
+    std::shared_ptr<tensor_tree::vertex> var_tree
+        = tensor_tree::make_var_tree(comp_graph, param);
 
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
+    std::shared_ptr<autodiff::op_t> input
+        = comp_graph.var(la::cpu::weak_tensor<double>(
+            frames.data, { frames.nframes, frames.ndim }));
 
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
+    input->grad_needed = false;
 
-        std::shared_ptr<autodiff::op_t> input
-            = comp_graph.var(la::cpu::weak_tensor<double>(
-                frame_cat.data(), { nframes, ndim }));
+    std::shared_ptr<lstm::transcriber> trans;
 
-        input->grad_needed = false;
+    if (ebt::in(std::string("subsampling"), args)) {
+        trans = lstm_frame::make_transcriber(param->children[1]->children[0], 0.0, nullptr, true);
+    } else {
+        trans = lstm_frame::make_transcriber(param->children[1]->children[0], 0.0, nullptr, false);
+    }
 
-        std::shared_ptr<lstm::transcriber> trans;
+    lstm::trans_seq_t input_seq;
+    input_seq.nframes = frames.nframes;
+    input_seq.batch_size = 1;
+    input_seq.dim = frames.ndim;
+    input_seq.feat = input;
+    input_seq.mask = nullptr;
 
-        if (ebt::in(std::string("subsampling"), args)) {
-            trans = lstm_frame::make_transcriber(param->children[1]->children[0], 0.0, nullptr, true);
-        } else {
-            trans = lstm_frame::make_transcriber(param->children[1]->children[0], 0.0, nullptr, false);
-        }
+    lstm::trans_seq_t output_seq = (*trans)(var_tree->children[1]->children[0], input_seq);
+
+    if (ebt::in(std::string("logsoftmax"), args)) {
+        lstm::fc_transcriber fc_trans { (int) label_id.size() };
+        lstm::logsoftmax_transcriber logsoftmax_trans;
+        auto score = fc_trans(var_tree->children[1]->children[1], output_seq);
+
+        output_seq = logsoftmax_trans(nullptr, score);
+    }
+
+    std::shared_ptr<autodiff::op_t> hidden = output_seq.feat;
+
+    auto& hidden_t = autodiff::get_output<la::cpu::tensor_like<double>>(hidden);
+
+    encoder_time.stop();
+
+    auto& hidden_mat = hidden_t.as_matrix();
+    auto hidden_m = autodiff::weak_var(hidden, 0,
+        std::vector<unsigned int> { hidden_mat.rows(), hidden_mat.cols() });
 
-        lstm::trans_seq_t input_seq;
-        input_seq.nframes = frames.size();
-        input_seq.batch_size = 1;
-        input_seq.dim = frames.front().size();
-        input_seq.feat = input;
-        input_seq.mask = nullptr;
+    std::string const& key = f_scp.entries[nsample].key;
+    bool print_times = ebt::in(std::string("print-path"), args);
 
-        lstm::trans_seq_t output_seq = (*trans)(var_tree->children[1]->children[0], input_seq);
+    if (ebt::in(std::string("dense-scores"), args)) {
+        stage_timer::scope graph_time { "make_graph" };
+        std::shared_ptr<seg_graph::fst> graph = seg_graph::make_graph(hidden_t.size(0),
+            label_id, id_label, min_seg, max_seg, stride);
+        graph_time.stop();
 
-        if (ebt::in(std::string("logsoftmax"), args)) {
-            lstm::fc_transcriber fc_trans { (int) label_id.size() };
-            lstm::logsoftmax_transcriber logsoftmax_trans;
-            auto score = fc_trans(var_tree->children[1]->children[1], output_seq);
+        std::vector<int> path;
 
-            output_seq = logsoftmax_trans(nullptr, score);
+        std::shared_ptr<tensor_tree::vertex> seg_var_tree = var_tree->children[0];
+
+        if (ebt::in(std::string("seg-param"), args)) {
+            std::call_once(convert_once, [&]() {
+                dense_param = seg_score::convert(features, param->children[0],
+                    label_id, id_label, hidden_t.size(1), max_seg);
+            });
+
+            seg_var_tree = tensor_tree::make_var_tree(comp_graph, dense_param);
         }
 
-        std::shared_ptr<autodiff::op_t> hidden = output_seq.feat;
+        if (ebt::in(std::string("float"), args)) {
+            stage_timer::scope weights_time { "make_weights" };
+            seg_score::basic_scorer<float> scores { features, seg_var_tree, hidden_m, *graph };
+            weights_time.stop();
 
-        auto& hidden_t = autodiff::get_output<la::cpu::tensor_like<double>>(hidden);
+            stage_timer::scope search_time { "search" };
+            path = seg_viterbi::best_path(*graph, scores.scores);
+        } else {
+            stage_timer::scope weights_time { "make_weights" };
+            seg_score::scorer scores { features, seg_var_tree, hidden_m, *graph };
+            weights_time.stop();
 
-        auto& hidden_mat = hidden_t.as_matrix();
-        auto hidden_m = autodiff::weak_var(hidden, 0,
-            std::vector<unsigned int> { hidden_mat.rows(), hidden_mat.cols() });
+            stage_timer::scope search_time { "search" };
+            path = seg_viterbi::best_path(*graph, scores.scores);
+        }
 
+        stage_timer::scope output_time { "output" };
+        print_path(out, *graph, path, id_label, key, print_times);
+    } else {
         seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(hidden_t.size(0), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+        graph_cache::entry graph_entry = graphs->at(hidden_t.size(0));
+        graph_data.fst = graph_entry.fst;
+        graph_data.topo_order = graph_entry.topo_order;
 
+        stage_timer::scope weights_time { "make_weights" };
         graph_data.weight_func = seg::make_weights(features, var_tree->children[0], hidden_m);
+        weights_time.stop();
 
         seg::seg_fst<seg::iseg_data> graph { graph_data };
 
+        // the weights are computed as the search asks for them
+        stage_timer::scope search_time { "search" };
         std::vector<int> path = fst::shortest_path(graph, *graph_data.topo_order);
+        search_time.stop();
 
-        if (ebt::in(std::string("print-path"), args)) {
-            std::cout << frame_scp.entries[nsample].key << std::endl;
-            for (auto& e: path) {
-                std::cout << graph.time(graph.tail(e))
-                    << " " << graph.time(graph.head(e))
-                    << " " << id_label.at(graph.output(e)) << std::endl;
-            }
-            std::cout << "." << std::endl;
-        } else {
-            for (auto& e: path) {
-                std::cout << id_label.at(graph.output(e)) << " ";
+        stage_timer::scope output_time { "output" };
+        print_path(out, graph, path, id_label, key, print_times);
+    }
+
+    return out.str();
+}
+
+void prediction_env::run()
+{
+    reorder::buffer output { std::cout };
+
+    std::atomic<int> next_sample { 0 };
+
+    auto work = [&](frame::scp& f_scp) {
+        while (1) {
+            int nsample = next_sample++;
+
+            if (nsample >= frame_scp.entries.size()) {
+                break;
             }
-            std::cout << "(" << frame_scp.entries[nsample].key << ")";
-            std::cout << std::endl;
+
+            output.put(nsample, decode(f_scp, nsample));
         }
+    };
+
+    std::vector<std::thread> threads;
 
-        ++nsample;
+    for (int i = 0; i < thread_frame_scp.size(); ++i) {
+        threads.push_back(std::thread { work, std::ref(*thread_frame_scp[i]) });
     }
-}
 
+    work(frame_scp);
+
+    for (auto& t: threads) {
+        t.join();
+    }
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
+
+    if (profile != nullptr) {
+        profile->report(std::cerr);
+        graphs->report(std::cerr);
+    }
+
+    if (timeline != nullptr) {
+        timeline->write();
+    }
+}
\ No newline at end of file
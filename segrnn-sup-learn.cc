@@ -5,6 +5,9 @@
 #include "ebt/ebt.h"
 #include "seg/loss.h"
 #include "nn/lstm-frame.h"
+#include "segbin/frame.h"
+#include "segbin/graph-cache.h"
+#include "segbin/prefetch.h"
 
 std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
     std::vector<std::string> const& features,
@@ -18,6 +21,10 @@ std::shared_ptr<tensor_tree::vertex> make_tensor_tree(
     return std::make_shared<tensor_tree::vertex>(root);
 }
 
+struct sample : public frame::sample {
+    std::vector<speech::segment> segs;
+};
+
 struct learning_env {
 
     std::vector<std::string> features;
@@ -26,9 +33,13 @@ struct learning_env {
     int max_seg;
     int stride;
 
-    speech::batch_indices frame_batch;
+    std::shared_ptr<graph_cache::lru> graphs;
+
+    frame::scp frame_batch;
     speech::batch_indices seg_batch;
 
+    std::vector<int> indices;
+
     int layer;
     std::shared_ptr<tensor_tree::vertex> param;
     std::shared_ptr<tensor_tree::vertex> opt_data;
@@ -51,10 +62,17 @@ struct learning_env {
 
     std::shared_ptr<tensor_tree::optimizer> opt;
 
+    int prefetch_depth;
+    int loader_threads;
+    std::vector<std::shared_ptr<frame::scp>> loader_frame_batch;
+    std::vector<std::shared_ptr<speech::batch_indices>> loader_seg_batch;
+
     std::unordered_map<std::string, std::string> args;
 
     learning_env(std::unordered_map<std::string, std::string> args);
 
+    sample load_sample(frame::scp& f_src, speech::batch_indices& l_src, int i);
+
     void run();
 
 };
@@ -70,6 +88,8 @@ int main(int argc, char *argv[])
             {"min-seg", "", false},
             {"max-seg", "", false},
             {"stride", "", false},
+            {"graph-cache", "", false},
+            {"graph-cache-file", "", false},
             {"param", "", true},
             {"opt-data", "", true},
             {"features", "", true},
@@ -82,6 +102,8 @@ int main(int argc, char *argv[])
             {"logsoftmax", "", false},
             {"subsampling", "", false},
             {"shuffle", "", false},
+            {"prefetch", "", false},
+            {"loader-threads", "", false},
             {"loss", "hinge-loss,log-loss", true},
             {"opt", "const-step,const-step-momentum,rmsprop,adagrad,adam", true},
             {"step-size", "", true},
@@ -140,7 +162,7 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
         stride = std::stoi(args.at("stride"));
     }
 
-    frame_batch.open(args.at("frame-batch"));
+    frame_batch.open_batch(args.at("frame-batch"));
     seg_batch.open(args.at("seg-batch"));
 
     output_param = "param-last";
@@ -184,23 +206,33 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
         sils.push_back(label_id.at(s));
     }
 
-    if (ebt::in(std::string("shuffle"), args)) {
-        std::vector<int> indices;
-        indices.resize(frame_batch.pos.size());
+    indices.resize(frame_batch.entries.size());
 
-        for (int i = 0; i < indices.size(); ++i) {
-            indices[i] = i;
-        }
+    for (int i = 0; i < indices.size(); ++i) {
+        indices[i] = i;
+    }
+
+    if (ebt::in(std::string("shuffle"), args)) {
         std::shuffle(indices.begin(), indices.end(), gen);
+    }
 
-        std::vector<unsigned long> pos = frame_batch.pos;
-        for (int i = 0; i < indices.size(); ++i) {
-            frame_batch.pos[i] = pos[indices[i]];
-        }
+    prefetch_depth = 0;
+    if (ebt::in(std::string("prefetch"), args)) {
+        prefetch_depth = std::stoi(args.at("prefetch"));
+    }
 
-        pos = seg_batch.pos;
-        for (int i = 0; i < indices.size(); ++i) {
-            seg_batch.pos[i] = pos[indices[i]];
+    loader_threads = 1;
+    if (ebt::in(std::string("loader-threads"), args)) {
+        loader_threads = std::stoi(args.at("loader-threads"));
+    }
+
+    if (prefetch_depth > 0) {
+        for (int i = 0; i < loader_threads; ++i) {
+            loader_frame_batch.push_back(std::make_shared<frame::scp>());
+            loader_frame_batch.back()->open_batch(args.at("frame-batch"));
+
+            loader_seg_batch.push_back(std::make_shared<speech::batch_indices>());
+            loader_seg_batch.back()->open(args.at("seg-batch"));
         }
     }
 
@@ -231,19 +263,51 @@ learning_env::learning_env(std::unordered_map<std::string, std::string> args)
     std::getline(opt_data_ifs, line);
     opt->load_opt_data(opt_data_ifs);
     opt_data_ifs.close();
+
+    int graph_cache_size = 64;
+    if (ebt::in(std::string("graph-cache"), args)) {
+        graph_cache_size = std::stoi(args.at("graph-cache"));
+    }
+
+    graphs = std::make_shared<graph_cache::lru>(label_id, id_label,
+        min_seg, max_seg, stride, graph_cache_size);
+
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ifstream graph_cache_ifs { args.at("graph-cache-file") };
+        graphs->load(graph_cache_ifs);
+    }
 }
 
-void learning_env::run()
+sample learning_env::load_sample(frame::scp& f_src, speech::batch_indices& l_src, int i)
 {
-    ebt::Timer timer;
+    sample result;
+
+    result.frames = f_src.at(i, result.buf);
+    result.segs = speech::load_segment_batch(l_src.at(i));
 
+    return result;
+}
+
+void learning_env::run()
+{
     int nsample = 0;
 
-    while (nsample < frame_batch.pos.size()) {
+    prefetch::loader<sample> loader { indices, prefetch_depth,
+        prefetch_depth > 0 ? loader_threads : 0,
+        [&](int thread, int i) -> sample {
+            if (prefetch_depth > 0) {
+                return load_sample(*loader_frame_batch[thread], *loader_seg_batch[thread], i);
+            } else {
+                return load_sample(frame_batch, seg_batch, i);
+            }
+        }};
+
+    while (nsample < indices.size()) {
 
-        std::vector<std::vector<double>> frames = speech::load_frame_batch(frame_batch.at(nsample));
+        sample s = loader.next();
 
-        std::vector<speech::segment> segs = speech::load_segment_batch(seg_batch.at(nsample));
+        frame::view& frames = s.frames;
+        std::vector<speech::segment>& segs = s.segs;
 
         std::cout << "sample: " << nsample + 1 << std::endl;
         std::cout << "gold len: " << segs.size() << std::endl;
@@ -252,19 +316,9 @@ void learning_env::run()
         std::shared_ptr<tensor_tree::vertex> var_tree
             = tensor_tree::make_var_tree(comp_graph, param);
 
-        std::vector<double> frame_cat;
-        frame_cat.reserve(frames.size() * frames.front().size());
-
-        for (int i = 0; i < frames.size(); ++i) {
-            frame_cat.insert(frame_cat.end(), frames[i].begin(), frames[i].end());
-        }
-
-        unsigned int nframes = frames.size();
-        unsigned int ndim = frames.front().size();
-
         std::shared_ptr<autodiff::op_t> input
             = comp_graph.var(la::cpu::weak_tensor<double>(
-                frame_cat.data(), { nframes, ndim }));
+                frames.data, { frames.nframes, frames.ndim }));
 
         input->grad_needed = false;
 
@@ -276,9 +330,9 @@ void learning_env::run()
         }
 
         lstm::trans_seq_t input_seq;
-        input_seq.nframes = frames.size();
+        input_seq.nframes = frames.nframes;
         input_seq.batch_size = 1;
-        input_seq.dim = frames.front().size();
+        input_seq.dim = frames.ndim;
         input_seq.feat = input;
         input_seq.mask = nullptr;
 
@@ -295,7 +349,7 @@ void learning_env::run()
         std::shared_ptr<autodiff::op_t> hidden = output_seq.feat;
         auto& hidden_t = autodiff::get_output<la::cpu::tensor_like<double>>(hidden);
 
-        std::cout << "frames: " << frames.size() << " downsampled: " << hidden_t.size(0) << std::endl;
+        std::cout << "frames: " << frames.nframes << " downsampled: " << hidden_t.size(0) << std::endl;
 
         if (hidden_t.size(0) < segs.size()) {
             ++nsample;
@@ -303,8 +357,9 @@ void learning_env::run()
         }
 
         seg::iseg_data graph_data;
-        graph_data.fst = seg::make_graph(hidden_t.size(0), label_id, id_label, min_seg, max_seg, stride);
-        graph_data.topo_order = std::make_shared<std::vector<int>>(fst::topo_order(*graph_data.fst));
+        graph_cache::entry graph_entry = graphs->at(hidden_t.size(0));
+        graph_data.fst = graph_entry.fst;
+        graph_data.topo_order = graph_entry.topo_order;
 
         auto& m = hidden_t.as_matrix();
         auto h_mat = autodiff::weak_var(hidden, 0, std::vector<unsigned int> { m.rows(), m.cols() });
@@ -412,6 +467,11 @@ void learning_env::run()
 
     }
 
+    if (prefetch_depth > 0) {
+        std::cout << "prefetch stalls: " << loader.stalls
+            << " wait: " << loader.stall_time << std::endl;
+    }
+
     std::ofstream param_ofs { output_param };
     param_ofs << layer << std::endl;
     tensor_tree::save_tensor(param, param_ofs);
@@ -422,5 +482,9 @@ void learning_env::run()
     opt->save_opt_data(opt_data_ofs);
     opt_data_ofs.close();
 
+    if (ebt::in(std::string("graph-cache-file"), args)) {
+        std::ofstream graph_cache_ofs { args.at("graph-cache-file") };
+        graphs->save(graph_cache_ofs);
+    }
 }
 
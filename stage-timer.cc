@@ -0,0 +1,183 @@
+#include "segbin/stage-timer.h"
+#include <iomanip>
+
+namespace stage_timer {
+
+    namespace {
+
+        thread_local profile *current_profile = nullptr;
+        thread_local trace::recorder *current_trace = nullptr;
+        thread_local int current_nframes = 0;
+        thread_local int current_nutt = 1;
+        thread_local std::string current_key;
+
+        char const *bucket_names[nbuckets + 1] = {
+            "<128", "<256", "<512", "<1024", "<2048", ">=2048", "batch" };
+
+    }
+
+    int bucket(int nframes)
+    {
+        int b = 0;
+
+        for (int limit = 128; b < nbuckets - 1 && nframes >= limit; limit *= 2) {
+            ++b;
+        }
+
+        return b;
+    }
+
+    profile::profile(double frame_shift)
+        : frame_shift(frame_shift)
+    {}
+
+    void profile::add(std::string const& stage, int nframes, double seconds,
+        int nutt)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        auto it = stages.find(stage);
+
+        if (it == stages.end()) {
+            order.push_back(stage);
+            it = stages.insert(std::make_pair(stage,
+                std::vector<cell>(nbuckets + 1, cell { 0, 0, 0 }))).first;
+        }
+
+        cell& c = it->second[nutt > 1 ? batch_row : bucket(nframes)];
+
+        c.count += nutt;
+        c.seconds += seconds;
+        c.frames += nframes;
+    }
+
+    void profile::report(std::ostream& os)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        auto print = [&](std::string const& stage, std::string const& length, cell const& c) {
+            os << std::left << std::setw(14) << stage
+                << std::setw(8) << length
+                << std::right << std::setw(8) << c.count
+                << std::setw(12) << std::fixed << std::setprecision(3) << c.seconds
+                << std::setw(12) << std::setprecision(3) << 1000 * c.seconds / c.count
+                << std::setw(10) << std::setprecision(4) << c.seconds / (c.frames * frame_shift)
+                << std::defaultfloat << std::endl;
+        };
+
+        os << std::left << std::setw(14) << "stage"
+            << std::setw(8) << "frames"
+            << std::right << std::setw(8) << "utts"
+            << std::setw(12) << "seconds"
+            << std::setw(12) << "ms/utt"
+            << std::setw(10) << "rtf" << std::endl;
+
+        cell total { 0, 0, 0 };
+
+        for (auto& stage: order) {
+            cell all { 0, 0, 0 };
+
+            for (int b = 0; b <= batch_row; ++b) {
+                cell const& c = stages.at(stage)[b];
+
+                if (c.count == 0) {
+                    continue;
+                }
+
+                print(stage, bucket_names[b], c);
+
+                all.count += c.count;
+                all.seconds += c.seconds;
+                all.frames += c.frames;
+            }
+
+            print(stage, "all", all);
+
+            total.seconds += all.seconds;
+            total.frames = std::max(total.frames, all.frames);
+            total.count = std::max(total.count, all.count);
+        }
+
+        // the stage seen the most gives the amount of audio
+        if (total.count > 0) {
+            print("total", "all", total);
+        }
+    }
+
+    utterance::utterance(profile *p, trace::recorder *t, int nframes)
+        : prev_profile(current_profile), prev_trace(current_trace)
+        , prev_nframes(current_nframes), prev_nutt(current_nutt)
+        , prev_key(current_key)
+    {
+        current_profile = p;
+        current_trace = t;
+        current_nframes = nframes;
+        current_nutt = 1;
+        current_key.clear();
+    }
+
+    void utterance::set_nframes(int nframes)
+    {
+        current_nframes = nframes;
+    }
+
+    void utterance::set_key(std::string const& key)
+    {
+        current_key = key;
+    }
+
+    void utterance::set_batch(int nutt)
+    {
+        current_nutt = nutt;
+    }
+
+    utterance::~utterance()
+    {
+        current_profile = prev_profile;
+        current_trace = prev_trace;
+        current_nframes = prev_nframes;
+        current_nutt = prev_nutt;
+        current_key = prev_key;
+    }
+
+    scope::scope(char const *stage)
+        : stage(stage), p(current_profile), t(current_trace)
+    {
+        if (p != nullptr || t != nullptr) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    scope::~scope()
+    {
+        stop();
+    }
+
+    void scope::stop()
+    {
+        if (p == nullptr && t == nullptr) {
+            return;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        if (p != nullptr) {
+            std::chrono::duration<double> d = end - start;
+            p->add(stage, current_nframes, d.count(), current_nutt);
+        }
+
+        if (t != nullptr) {
+            t->add(stage, current_key, start, end);
+        }
+
+        p = nullptr;
+        t = nullptr;
+    }
+
+    void scope::cancel()
+    {
+        p = nullptr;
+        t = nullptr;
+    }
+
+}
@@ -0,0 +1,118 @@
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <ostream>
+#include <mutex>
+#include <chrono>
+#include "segbin/trace.h"
+
+namespace stage_timer {
+
+    // utterances shorter than 128, 256, ..., 2048 frames, and longer
+    constexpr int nbuckets = 6;
+
+    // stages shared by the utterances of a batch, after the buckets
+    constexpr int batch_row = nbuckets;
+
+    int bucket(int nframes);
+
+    /*
+     * Wall-clock time of the stages of a pipeline, such as the encoder,
+     * graph construction or the optimizer update, in histograms over
+     * utterance length.  The report gives the real-time factor of every
+     * stage, the time spent over the duration of the audio, with
+     * frame_shift seconds of audio per input frame.
+     *
+     * A stage run once for nutt > 1 utterances, such as the encoder of
+     * a padded batch or the update of a synchronous step, goes into a
+     * batch row of its own with the frames of all the utterances, so
+     * the buckets only hold the work of single utterances.
+     *
+     * add() is thread-safe.
+     */
+    struct profile {
+
+        double frame_shift;
+
+        profile(double frame_shift = 0.01);
+
+        void add(std::string const& stage, int nframes, double seconds,
+            int nutt = 1);
+
+        void report(std::ostream& os);
+
+    private:
+        struct cell {
+            long count;
+            double seconds;
+            double frames;
+        };
+
+        std::mutex mutex;
+
+        // stages in the order they were first seen
+        std::vector<std::string> order;
+        std::unordered_map<std::string, std::vector<cell>> stages;
+    };
+
+    /*
+     * Makes p, t and the utterance the context of the stages timed by
+     * the calling thread until the end of the scope, so that code deep
+     * in the pipeline, such as the graph cache, can time its stages
+     * without being handed the profile.  Stages go into the profile p
+     * and the timeline t, either of which may be null.  Nothing is
+     * timed when both are null or outside of an utterance.
+     *
+     * The length and key can be set once the frames are loaded; stages
+     * are bucketed by the length at the time they end, so loading can
+     * be timed as well.  set_batch(nutt) makes the context a batch of
+     * nutt utterances of nframes frames in all.
+     */
+    struct utterance {
+        utterance(profile *p, trace::recorder *t, int nframes = 0);
+        ~utterance();
+
+        void set_nframes(int nframes);
+        void set_key(std::string const& key);
+        void set_batch(int nutt);
+
+        utterance(utterance const&) = delete;
+        utterance& operator=(utterance const&) = delete;
+
+    private:
+        profile *prev_profile;
+        trace::recorder *prev_trace;
+        int prev_nframes;
+        int prev_nutt;
+        std::string prev_key;
+    };
+
+    /*
+     * Times the stage from construction to stop() or the end of the
+     * scope.  The name has to outlive the trace.
+     */
+    struct scope {
+        scope(char const *stage);
+        ~scope();
+
+        scope(scope const&) = delete;
+        scope& operator=(scope const&) = delete;
+
+        void stop();
+
+        // ends the scope without recording it
+        void cancel();
+
+    private:
+        char const *stage;
+        profile *p;
+        trace::recorder *t;
+        std::chrono::steady_clock::time_point start;
+    };
+
+}
+
+#endif
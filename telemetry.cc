@@ -0,0 +1,200 @@
+#include "segbin/telemetry.h"
+#include <iostream>
+#include <sstream>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+namespace telemetry {
+
+    ring::ring(int size)
+        : values(size), next(0), count(0)
+    {}
+
+    void ring::push(double v)
+    {
+        values[next] = v;
+        next = (next + 1) % values.size();
+        ++count;
+    }
+
+    recorder::recorder(std::string filename, int every, double seconds,
+            int window_size)
+        : every(every), seconds(seconds), window_size(window_size)
+        , samples(0), last_samples(0)
+    {
+        if (filename.empty()) {
+            os = &std::cout;
+        } else {
+            ofs.open(filename);
+
+            if (!ofs) {
+                throw std::logic_error("unable to open " + filename);
+            }
+
+            os = &ofs;
+        }
+
+        start = std::chrono::steady_clock::now();
+        last_time = start;
+    }
+
+    recorder::~recorder()
+    {
+        // the tail of the run since the last report
+        if (samples > last_samples) {
+            report();
+        }
+    }
+
+    void recorder::count(std::string const& name, double v)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        counters[name] += v;
+    }
+
+    void recorder::gauge(std::string const& name, double v)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        gauges[name] = v;
+    }
+
+    void recorder::observe(std::string const& name, double v)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        auto it = windows.find(name);
+
+        if (it == windows.end()) {
+            it = windows.insert(std::make_pair(name, ring { window_size })).first;
+        }
+
+        it->second.push(v);
+    }
+
+    bool recorder::due()
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        return is_due();
+    }
+
+    void recorder::step(int n)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        // due() is asked before the sample is counted
+        bool report_now = is_due();
+
+        samples += n;
+
+        if (report_now) {
+            write_report();
+        }
+    }
+
+    void recorder::report()
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        write_report();
+    }
+
+    bool recorder::is_due() const
+    {
+        if (every > 0 && samples + 1 - last_samples >= every) {
+            return true;
+        }
+
+        if (seconds > 0) {
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - last_time;
+
+            if (d.count() >= seconds) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    namespace {
+
+        // JSON has no nan or inf
+        void write_number(std::ostream& os, double v)
+        {
+            if (std::isfinite(v)) {
+                os << v;
+            } else {
+                os << "null";
+            }
+        }
+
+    }
+
+    void recorder::write_report()
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - start;
+        std::chrono::duration<double> interval = now - last_time;
+
+        std::ostringstream line;
+        line.precision(std::numeric_limits<float>::max_digits10);
+
+        line << "{\"samples\": " << samples
+            << ", \"time\": " << elapsed.count();
+
+        line << ", \"samples/sec\": ";
+        write_number(line, (samples - last_samples) / interval.count());
+
+        line << ", \"counters\": {";
+        for (auto it = counters.begin(); it != counters.end(); ++it) {
+            line << (it == counters.begin() ? "" : ", ") << "\"" << it->first << "\": ";
+            write_number(line, it->second);
+        }
+        line << "}";
+
+        line << ", \"gauges\": {";
+        for (auto it = gauges.begin(); it != gauges.end(); ++it) {
+            line << (it == gauges.begin() ? "" : ", ") << "\"" << it->first << "\": ";
+            write_number(line, it->second);
+        }
+        line << "}";
+
+        line << ", \"windows\": {";
+        for (auto it = windows.begin(); it != windows.end(); ++it) {
+            ring const& r = it->second;
+            int n = std::min<long>(r.count, r.values.size());
+
+            double sum = 0;
+            double min = std::numeric_limits<double>::infinity();
+            double max = -std::numeric_limits<double>::infinity();
+
+            for (int i = 0; i < n; ++i) {
+                sum += r.values[i];
+                min = std::min(min, r.values[i]);
+                max = std::max(max, r.values[i]);
+            }
+
+            line << (it == windows.begin() ? "" : ", ") << "\"" << it->first << "\": {"
+                << "\"n\": " << n << ", \"mean\": ";
+            write_number(line, sum / n);
+            line << ", \"min\": ";
+            write_number(line, min);
+            line << ", \"max\": ";
+            write_number(line, max);
+            line << "}";
+        }
+        line << "}}\n";
+
+        std::string s = line.str();
+        os->write(s.data(), s.size());
+        os->flush();
+
+        last_samples = samples;
+        last_time = now;
+    }
+
+}
@@ -0,0 +1,94 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+
+namespace telemetry {
+
+    /*
+     * The last values of a metric, overwriting the oldest one once
+     * full.
+     */
+    struct ring {
+        std::vector<double> values;
+        int next;
+        long count;
+
+        ring(int size);
+
+        void push(double v);
+    };
+
+    /*
+     * Training metrics reported as one JSON line per interval instead
+     * of a few lines per sample.
+     *
+     * Counters add up over the whole run, gauges keep their last value,
+     * and windows keep the last window_size values of a metric and are
+     * reported with their mean, min and max.  A report is due every
+     * `every` samples or every `seconds` seconds, whichever comes first;
+     * 0 turns either off.  Diagnostics that need a pass over the model,
+     * such as the norm of the parameters, should only be computed when
+     * due() is true.
+     *
+     * Reports go to filename, or to stdout when it is empty.  Names are
+     * written as they are and should not need escaping.  All members
+     * are thread-safe.
+     */
+    struct recorder {
+
+        recorder(std::string filename, int every, double seconds,
+            int window_size = 1000);
+
+        ~recorder();
+
+        recorder(recorder const&) = delete;
+        recorder& operator=(recorder const&) = delete;
+
+        void count(std::string const& name, double v = 1);
+
+        void gauge(std::string const& name, double v);
+
+        void observe(std::string const& name, double v);
+
+        bool due();
+
+        // ends n samples, and writes a report if one is due
+        void step(int n = 1);
+
+        void report();
+
+    private:
+        std::ofstream ofs;
+        std::ostream *os;
+
+        int every;
+        double seconds;
+        int window_size;
+
+        std::mutex mutex;
+
+        long samples;
+        long last_samples;
+
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point last_time;
+
+        std::map<std::string, double> counters;
+        std::map<std::string, double> gauges;
+        std::map<std::string, ring> windows;
+
+        bool is_due() const;
+        void write_report();
+    };
+
+}
+
+#endif
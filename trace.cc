@@ -0,0 +1,188 @@
+#include "segbin/trace.h"
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+
+namespace trace {
+
+    namespace {
+
+        std::atomic<long> next_id { 0 };
+
+        /*
+         * The buffer of the calling thread.  The registry is only held
+         * weakly, so a thread that outlives the recorder does not keep
+         * its buffers alive, and the buffer goes back to the registry
+         * when the thread exits.
+         */
+        struct handle {
+            long owner = -1;
+            std::weak_ptr<recorder::registry> reg;
+            buffer *buf = nullptr;
+
+            void release()
+            {
+                if (std::shared_ptr<recorder::registry> r = reg.lock()) {
+                    std::lock_guard<std::mutex> lock { r->mutex };
+                    r->idle.push_back(buf);
+                }
+
+                owner = -1;
+                reg.reset();
+                buf = nullptr;
+            }
+
+            ~handle()
+            {
+                release();
+            }
+        };
+
+    }
+
+    recorder::recorder(std::string filename, int pid, long max_events)
+        : filename(filename), pid(pid), id(next_id++), max_events(max_events)
+        , nevents(0), reg(std::make_shared<registry>())
+    {
+        std::ofstream ofs { filename };
+
+        if (!ofs) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        origin = std::chrono::steady_clock::now();
+    }
+
+    buffer& recorder::local()
+    {
+        // by id rather than address, in case a recorder is made where
+        // an old one used to be
+        thread_local handle h;
+
+        if (h.owner != id) {
+            h.release();
+
+            std::lock_guard<std::mutex> lock { reg->mutex };
+
+            if (reg->idle.empty()) {
+                reg->buffers.push_back(std::unique_ptr<buffer>(new buffer));
+                reg->buffers.back()->tid = reg->buffers.size() - 1;
+                h.buf = reg->buffers.back().get();
+            } else {
+                h.buf = reg->idle.back();
+                reg->idle.pop_back();
+            }
+
+            h.owner = id;
+            h.reg = reg;
+        }
+
+        return *h.buf;
+    }
+
+    void recorder::add(char const *name, std::string const& key,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end)
+    {
+        if (nevents.fetch_add(1, std::memory_order_relaxed) >= max_events) {
+            return;
+        }
+
+        buffer& b = local();
+
+        if (b.keys.empty() || b.keys.back() != key) {
+            b.keys.push_back(key);
+        }
+
+        b.events.push_back(event { name, (int) b.keys.size() - 1, start, end });
+    }
+
+    namespace {
+
+        void write_string(std::string& out, std::string const& s)
+        {
+            out += '"';
+
+            for (char c: s) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if ((unsigned char) c < 0x20) {
+                    char esc[8];
+                    std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += c;
+                }
+            }
+
+            out += '"';
+        }
+
+    }
+
+    /*
+     * Stages are complete events ("ph": "X") in microseconds since the
+     * recorder was made, with the utterance key as an argument.
+     */
+    void recorder::write()
+    {
+        std::lock_guard<std::mutex> lock { reg->mutex };
+
+        std::ofstream ofs { filename };
+
+        if (!ofs) {
+            throw std::logic_error("unable to open " + filename);
+        }
+
+        std::string out;
+        char num[128];
+        bool first = true;
+
+        out += "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+        for (auto& b: reg->buffers) {
+            std::snprintf(num, sizeof(num),
+                "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}}",
+                first ? "" : ",\n", pid, b->tid, b->tid);
+            out += num;
+            first = false;
+
+            for (auto& e: b->events) {
+                std::chrono::duration<double, std::micro> ts = e.start - origin;
+                std::chrono::duration<double, std::micro> dur = e.end - e.start;
+
+                out += ",\n{\"name\": ";
+                write_string(out, e.name);
+                std::snprintf(num, sizeof(num),
+                    ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+                    ts.count(), dur.count(), pid, b->tid);
+                out += num;
+
+                std::string const& key = b->keys[e.key];
+
+                if (!key.empty()) {
+                    out += ", \"args\": {\"key\": ";
+                    write_string(out, key);
+                    out += "}";
+                }
+
+                out += "}";
+            }
+
+            ofs.write(out.data(), out.size());
+            out.clear();
+        }
+
+        out += "\n]}\n";
+        ofs.write(out.data(), out.size());
+
+        if (nevents > max_events) {
+            std::cerr << "trace: dropped " << nevents - max_events
+                << " events past the first " << max_events << std::endl;
+        }
+    }
+
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace trace {
+
+    struct event {
+        char const *name;
+        int key;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point end;
+    };
+
+    /*
+     * Events of one thread at a time.  Keys are stored once per run of
+     * events with the same key and referred to by index.
+     */
+    struct buffer {
+        int tid;
+        std::vector<event> events;
+        std::vector<std::string> keys;
+    };
+
+    /*
+     * Timeline of the stages of a pipeline in the trace event format,
+     * to be opened in chrome://tracing or Perfetto.
+     *
+     * Every thread appends to a buffer of its own, so add() only takes
+     * a lock the first time a thread records an event.  A thread that
+     * exits gives its buffer to the next new thread, so the number of
+     * buffers stays at the number of threads alive at once, however
+     * often the loaders and workers are restarted.  Events past the
+     * first max_events are counted and dropped, which bounds memory in
+     * long runs; write() reports the count.
+     *
+     * write() reads all buffers and has to be called after the threads
+     * that recorded events are done, usually at the end of run().  pid
+     * tells apart the traces of the ranks of a distributed run.
+     */
+    struct recorder {
+
+        recorder(std::string filename, int pid = 0, long max_events = 1 << 20);
+
+        recorder(recorder const&) = delete;
+        recorder& operator=(recorder const&) = delete;
+
+        void add(char const *name, std::string const& key,
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::time_point end);
+
+        void write();
+
+        struct registry {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<buffer>> buffers;
+            std::vector<buffer*> idle;
+        };
+
+    private:
+        std::string filename;
+        int pid;
+        long id;
+        long max_events;
+
+        std::atomic<long> nevents;
+
+        std::chrono::steady_clock::time_point origin;
+
+        std::shared_ptr<registry> reg;
+
+        buffer& local();
+    };
+
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include "segbin/worker-pool.h"
+#include <stdexcept>
+
+namespace worker_pool {
+
+    pool::pool(int nthread)
+        : njob(0), pending(0), generation(0), stop(false)
+    {
+        for (int i = 0; i < nthread; ++i) {
+            threads.push_back(std::thread { &pool::work, this, i });
+        }
+    }
+
+    pool::~pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+            stop = true;
+        }
+
+        started.notify_all();
+
+        for (auto& t: threads) {
+            t.join();
+        }
+    }
+
+    int pool::size() const
+    {
+        return threads.size();
+    }
+
+    void pool::run(int n, std::function<void(int)> f)
+    {
+        if (n > threads.size()) {
+            throw std::logic_error("more jobs than workers");
+        }
+
+        std::unique_lock<std::mutex> lock { mutex };
+
+        job = f;
+        njob = n;
+        pending = n;
+        error = nullptr;
+        ++generation;
+
+        started.notify_all();
+
+        finished.wait(lock, [&]() { return pending == 0; });
+
+        job = nullptr;
+
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void pool::work(int i)
+    {
+        long seen = 0;
+
+        while (1) {
+            std::function<void(int)> f;
+
+            {
+                std::unique_lock<std::mutex> lock { mutex };
+
+                started.wait(lock, [&]() { return stop || generation != seen; });
+
+                if (stop) {
+                    return;
+                }
+
+                seen = generation;
+
+                if (i >= njob) {
+                    continue;
+                }
+
+                f = job;
+            }
+
+            std::exception_ptr e;
+
+            try {
+                f(i);
+            } catch (...) {
+                e = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock { mutex };
+
+                if (e != nullptr && error == nullptr) {
+                    error = e;
+                }
+
+                --pending;
+            }
+
+            finished.notify_all();
+        }
+    }
+
+}
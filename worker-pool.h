@@ -0,0 +1,52 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace worker_pool {
+
+    /*
+     * Threads that live as long as the pool and take one job at a time.
+     * run(n, f) calls f(i) on worker i for i < n and returns when all
+     * of them are done, so the thread_local state of a worker, such as
+     * its workspaces and trace buffer, carries over from one step to
+     * the next.  The first exception thrown by f is rethrown by run().
+     */
+    struct pool {
+
+        pool(int nthread);
+        ~pool();
+
+        pool(pool const&) = delete;
+        pool& operator=(pool const&) = delete;
+
+        int size() const;
+
+        void run(int n, std::function<void(int)> f);
+
+    private:
+        std::vector<std::thread> threads;
+
+        std::mutex mutex;
+        std::condition_variable started;
+        std::condition_variable finished;
+
+        std::function<void(int)> job;
+        int njob;
+        int pending;
+        long generation;
+        bool stop;
+
+        std::exception_ptr error;
+
+        void work(int i);
+    };
+
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+namespace workspace {
+
+    /*
+     * Free list of buffers for the per-utterance arrays of the dense
+     * segment path, so that scores, gradients and dynamic programming
+     * tables are allocated once and then reused from one utterance to
+     * the next.
+     *
+     * get(n, value) hands out the smallest free buffer that holds n
+     * elements, or grows the largest one when none does, so the
+     * buffers settle at the high-water mark of the run and allocation
+     * stops after the first few utterances.  put(v) returns a buffer
+     * with its capacity.
+     *
+     * Pools are not thread-safe; use local<T>() for the pool of the
+     * calling thread.  That pool goes away with the thread, so buffers
+     * are only reused across utterances by threads that live through
+     * them, such as the workers of a worker_pool::pool or the decoding
+     * threads of the predictors.  allocs counts the calls to get() that
+     * had to allocate.
+     */
+    template <class T>
+    struct pool {
+
+        std::vector<std::vector<T>> free;
+
+        long allocs;
+
+        pool();
+
+        std::vector<T> get(std::size_t n, T value);
+
+        void put(std::vector<T>&& v);
+
+        // frees all buffers
+        void clear();
+    };
+
+    template <class T>
+    pool<T>& local();
+
+}
+
+namespace workspace {
+
+    template <class T>
+    pool<T>::pool()
+        : allocs(0)
+    {}
+
+    template <class T>
+    std::vector<T> pool<T>::get(std::size_t n, T value)
+    {
+        int best = -1;
+        int largest = -1;
+
+        for (int i = 0; i < free.size(); ++i) {
+            std::size_t c = free[i].capacity();
+
+            if (c >= n && (best == -1 || c < free[best].capacity())) {
+                best = i;
+            }
+
+            if (largest == -1 || c > free[largest].capacity()) {
+                largest = i;
+            }
+        }
+
+        if (best == -1) {
+            best = largest;
+            ++allocs;
+        }
+
+        std::vector<T> result;
+
+        if (best != -1) {
+            std::swap(free[best], free.back());
+            result = std::move(free.back());
+            free.pop_back();
+        }
+
+        result.assign(n, value);
+
+        return result;
+    }
+
+    template <class T>
+    void pool<T>::put(std::vector<T>&& v)
+    {
+        if (v.capacity() > 0) {
+            free.push_back(std::move(v));
+        }
+    }
+
+    template <class T>
+    void pool<T>::clear()
+    {
+        free.clear();
+        free.shrink_to_fit();
+    }
+
+    template <class T>
+    pool<T>& local()
+    {
+        static thread_local pool<T> p;
+
+        return p;
+    }
+
+}
+
+#endif